@@ -0,0 +1,65 @@
+'use strict';
+const carmenCache = require('../index.js');
+const fs = require('fs');
+const test = require('tape');
+
+// Compares how big and how quick to read the 'varint' and 'blocks' grid
+// formats are, over the grid lists of real phrases that span many tiles
+(function() {
+    const runs = 50;
+    const tmpdir = '/tmp/temp.' + Math.random().toString(36).substr(2, 5);
+    fs.mkdirSync(tmpdir);
+
+    const memory = new carmenCache.MemoryCache('a');
+    const lists = {
+        'single': require('./fixtures/coalesce-bench-single-3848571113.json'),
+        'multi a': require('./fixtures/coalesce-bench-multi-3848571113.json'),
+        'multi b': require('./fixtures/coalesce-bench-multi-1965155344.json')
+    };
+    for (const phrase of Object.keys(lists)) memory._set(phrase, lists[phrase]);
+    const gets = Object.keys(lists).map((phrase) => [phrase]);
+
+    // the size of the tables a packed cache is made of
+    function packedSize(dir) {
+        return fs.readdirSync(dir)
+            .filter((file) => /\.sst$/.test(file))
+            .reduce((size, file) => size + fs.statSync(dir + '/' + file).size, 0);
+    }
+
+    // the grids of each query in a batched result
+    function batchToArrays(result) {
+        let offset = 0;
+        return result.lengths.map((length) => {
+            const grids = [];
+            for (let i = 0; i < length; i++, offset += 8) {
+                grids.push(result.grids.readUInt32LE(offset + 4) * Math.pow(2, 32) + result.grids.readUInt32LE(offset));
+            }
+            return grids;
+        });
+    }
+
+    const caches = {};
+    for (const format of ['varint', 'blocks']) {
+        const dir = tmpdir + '/' + format;
+        memory.pack(dir, { format: format, compression: 'none' });
+        caches[format] = { cache: new carmenCache.RocksDBCache(format, dir), size: packedSize(dir) };
+    }
+
+    test('grid format size', (t) => {
+        t.deepEqual(batchToArrays(caches.blocks.cache._getBatch(gets)), batchToArrays(caches.varint.cache._getBatch(gets)), 'both formats read the same grids');
+        t.pass('varint tables are ' + caches.varint.size + ' bytes, blocks tables are ' + caches.blocks.size + ' bytes');
+        t.end();
+    });
+
+    for (const format of ['varint', 'blocks']) {
+        test('grid format decode ' + format, (t) => {
+            const cache = caches[format].cache;
+            const time = +new Date;
+            for (let i = 0; i < runs; i++) cache._getBatch(gets);
+            const ops = (+new Date - time) / runs;
+            t.pass('_getBatch of ' + format + ' grids @ ' + ops + 'ms');
+            t.end();
+        });
+    }
+
+})();
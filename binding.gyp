@@ -39,9 +39,11 @@
             'product_dir': '<(module_path)',
             'sources': [
                 "./src/cpp_util.cpp",
+                "./src/memorypool.cpp",
                 "./src/node_util.cpp",
                 "./src/memorycache.cpp",
                 "./src/rocksdbcache.cpp",
+                "./src/cachebuilder.cpp",
                 "./src/coalesce.cpp",
                 "./src/binding.cpp"
             ],
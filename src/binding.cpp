@@ -14,7 +14,12 @@ void JSCache<RocksDBCache>::Initialize(Handle<Object> target) {
     Nan::SetPrototypeMethod(t, "list", JSRocksDBCache::list);
     Nan::SetPrototypeMethod(t, "_get", _get);
     Nan::SetPrototypeMethod(t, "_getMatching", _getmatching);
-    target->Set(Nan::New("RocksDBCache").ToLocalChecked(), t->GetFunction());
+    Nan::SetPrototypeMethod(t, "_getBatch", _getBatch);
+    Nan::SetPrototypeMethod(t, "_getMatchingBatch", _getmatchingBatch);
+    Nan::SetPrototypeMethod(t, "memoryUsage", memoryUsage);
+    Local<Function> fn = t->GetFunction();
+    Nan::SetMethod(fn, "configure", configureRocksDBCache);
+    target->Set(Nan::New("RocksDBCache").ToLocalChecked(), fn);
     constructor.Reset(t);
 }
 
@@ -27,8 +32,14 @@ void JSCache<MemoryCache>::Initialize(Handle<Object> target) {
     Nan::SetPrototypeMethod(t, "pack", JSMemoryCache::pack);
     Nan::SetPrototypeMethod(t, "list", JSMemoryCache::list);
     Nan::SetPrototypeMethod(t, "_set", _set);
+    Nan::SetPrototypeMethod(t, "_setBulk", _setBulk);
+    Nan::SetPrototypeMethod(t, "memoryUsage", memoryUsage);
+    Nan::SetPrototypeMethod(t, "save", save);
+    Nan::SetPrototypeMethod(t, "load", load);
     Nan::SetPrototypeMethod(t, "_get", _get);
     Nan::SetPrototypeMethod(t, "_getMatching", _getmatching);
+    Nan::SetPrototypeMethod(t, "_getBatch", _getBatch);
+    Nan::SetPrototypeMethod(t, "_getMatchingBatch", _getmatchingBatch);
     target->Set(Nan::New("MemoryCache").ToLocalChecked(), t->GetFunction());
     constructor.Reset(t);
 }
@@ -47,15 +58,60 @@ JSCache<T>::~JSCache() {}
  * @name pack
  * @memberof JSCache
  * @param {String}, filename
+ * @param {Object} [options]
+ * @param {Number} [options.threads=1] - MemoryCache only; with more than one thread, key ranges are encoded in parallel into SST files that are bulk-loaded into the output. At most 64; if packing fails, the SST files already written are removed
+ * @param {Number} [options.memoMinKeys=1024] - MemoryCache only; prefixes longer than 6 bytes that at least this many keys start with get memoized grid lists of their own, so autocomplete scans for them don't have to merge every key; 0 leaves this criterion out
+ * @param {Number} [options.memoMinGrids=16384] - MemoryCache only; the same for prefixes with at least this many grids between their keys
+ * @param {Number} [options.memoMaxGrids=0] - MemoryCache only; keep just the highest this many grids in each memoized prefix list, which shrinks the packed cache and speeds up short autocomplete scans. Normal scans read the capped memos, so a cap below 500000, the most a scan returns unless it's extended, also limits what they return; extended scans read every key instead whenever a memo may have been cut short. 0 keeps every grid.
+ * @param {String} [options.compression='snappy'] - how the packed tables are compressed: 'none', 'snappy', 'zlib', 'lz4' or 'zstd'. A RocksDBCache is copied by rewriting its tables, so this can also recompress one.
+ * @param {String} [options.format='varint'] - MemoryCache only; how grid lists are encoded: 'varint', the protobuf messages every version of carmen-cache reads, or 'blocks', which is decoded a block at a time with SIMD instructions where the CPU has them, but can only be read by versions of carmen-cache that support it. Readers detect the format of each cache on their own.
+ * @param {Boolean} [options.skipIndex=false] - MemoryCache only, and only in the 'varint' format; lists longer than 128 grids get an index of their blocks of grids and the tiles each covers, which older versions of carmen-cache ignore. Extended scans within a bounding box then skip the blocks outside of it.
+ * @param {Number} [options.spatialMinGrids=0] - MemoryCache only, and only in the 'varint' format; lists with at least this many grids, memoized prefixes included, are also stored split into cells of tiles, just large enough that a list has no more than 256 of them. Extended scans within a bounding box then read only the cells that overlap it. 0 leaves the copies out.
+ * @param {Function} [options.progress] - only with a callback; called every so often, and once more at the end, with the `keys` and memoized `prefixes` written so far and the `bytes` they took up
+ * @param {Function} [callback] - if supplied, the cache is packed on the threadpool and the callback is called with any error once it's done, rather than true being returned. A MemoryCache stays locked until then, so reads and writes of it wait for the pack to finish, and synchronous ones block the event loop while they do
  * @returns {Boolean}
  * @example
  * const cache = require('@mapbox/carmen-cache');
  * const JSCache = new cache.JSCache('a');
  *
- * cache.pack('filename');
+ * cache.pack('filename', { threads: 4 });
+ *
+ * cache.pack('filename', { progress: (stats) => console.log(stats.keys) }, (err) => {
+ *    if (err) throw err;
+ * });
  *
  */
 
+// passes the latest progress of an asynchronous pack to its progress callback
+template <class T>
+static void packProgress(PackBaton<T>* baton) {
+    PackStats stats;
+    {
+        std::lock_guard<std::mutex> lock(baton->mutex);
+        if (!baton->pending) return;
+        stats = baton->stats;
+        baton->pending = false;
+    }
+
+    Local<Object> result = Nan::New<Object>();
+    result->Set(Nan::New("keys").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.keys)));
+    result->Set(Nan::New("prefixes").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.prefixes)));
+    result->Set(Nan::New("bytes").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.bytes)));
+    v8::Local<v8::Value> argv[1] = {result};
+    Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->progress), 1, argv);
+}
+
+template <class T>
+static void packAsync(uv_async_t* handle) {
+    Nan::HandleScope scope;
+    packProgress(static_cast<PackBaton<T>*>(handle->data));
+}
+
+template <class T>
+static void packClosed(uv_handle_t* handle) {
+    delete static_cast<PackBaton<T>*>(handle->data);
+}
+
 template <class T>
 NAN_METHOD(JSCache<T>::pack) {
     if (info.Length() < 1) {
@@ -64,6 +120,12 @@ NAN_METHOD(JSCache<T>::pack) {
     if (!info[0]->IsString()) {
         return Nan::ThrowTypeError("first argument must be a String");
     }
+    int argc = info.Length();
+    Local<Value> callback;
+    if (argc > 1 && info[argc - 1]->IsFunction()) {
+        callback = info[argc - 1];
+        argc--;
+    }
     try {
         Nan::Utf8String utf8_filename(info[0]);
         if (utf8_filename.length() < 1) {
@@ -71,32 +133,243 @@ NAN_METHOD(JSCache<T>::pack) {
         }
         std::string filename(*utf8_filename);
 
-        T* c = &(node::ObjectWrap::Unwrap<JSCache<T>>(info.This())->cache);
+        PackOptions pack_options;
+        Local<Value> progress;
+        if (argc > 1) {
+            if (!packOptionsFromObject(info[1], pack_options)) return;
+            if (info[1]->IsObject() && info[1]->ToObject()->Has(Nan::New("progress").ToLocalChecked())) {
+                progress = info[1]->ToObject()->Get(Nan::New("progress").ToLocalChecked());
+                if (!progress->IsFunction()) {
+                    return Nan::ThrowTypeError("progress must be a function");
+                }
+                // progress can come from any of the packing threads, so it
+                // can only be reported back through the event loop
+                if (callback.IsEmpty()) {
+                    return Nan::ThrowTypeError("progress can only be reported when packing with a callback");
+                }
+            }
+        }
+
+        JSCache<T>* wrapper = node::ObjectWrap::Unwrap<JSCache<T>>(info.This());
 
-        try {
-            c->pack(filename);
-        } catch (std::exception const& ex) {
-            return Nan::ThrowTypeError(ex.what());
+        if (callback.IsEmpty()) {
+            try {
+                wrapper->cache.pack(filename, pack_options);
+            } catch (std::exception const& ex) {
+                return Nan::ThrowTypeError(ex.what());
+            }
+            info.GetReturnValue().Set(true);
+            return;
         }
-        info.GetReturnValue().Set(true);
+
+        PackBaton<T>* baton = new PackBaton<T>();
+        baton->cache = wrapper;
+        baton->filename = std::move(filename);
+        baton->pack_options = pack_options;
+        baton->pending = false;
+        baton->callback.Reset(callback.As<Function>());
+        if (!progress.IsEmpty()) {
+            baton->progress.Reset(progress.As<Function>());
+            baton->pack_options.progress = [baton](PackStats const& stats) {
+                {
+                    std::lock_guard<std::mutex> lock(baton->mutex);
+                    // with several threads, reports can arrive out of order
+                    if (stats.keys + stats.prefixes < baton->stats.keys + baton->stats.prefixes) return;
+                    baton->stats = stats;
+                    baton->pending = true;
+                }
+                uv_async_send(&baton->async);
+            };
+        }
+
+        uv_async_init(uv_default_loop(), &baton->async, packAsync<T>);
+        baton->async.data = baton;
+        wrapper->_ref();
+        baton->request.data = baton;
+        uv_queue_work(uv_default_loop(), &baton->request, packTask<T>, static_cast<uv_after_work_cb>(packAfter<T>));
+        info.GetReturnValue().Set(Nan::Undefined());
         return;
     } catch (std::exception const& ex) {
         return Nan::ThrowTypeError(ex.what());
     }
 }
 
+template <class T>
+void packTask(uv_work_t* req) {
+    PackBaton<T>* baton = static_cast<PackBaton<T>*>(req->data);
+    try {
+        baton->cache->cache.pack(baton->filename, baton->pack_options);
+    } catch (std::exception const& ex) {
+        baton->error = ex.what();
+    }
+}
+
+// the 'status' parameter is required as part of the uv_after_work_cb
+// signature, but we don't use it
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-parameter"
+template <class T>
+void packAfter(uv_work_t* req, int status) {
+    Nan::HandleScope scope;
+    PackBaton<T>* baton = static_cast<PackBaton<T>*>(req->data);
+
+    // the final report may not have made it through the async handle yet
+    if (!baton->progress.IsEmpty()) packProgress(baton);
+
+    baton->cache->_unref();
+
+    if (!baton->error.empty()) {
+        v8::Local<v8::Value> argv[1] = {Nan::Error(baton->error.c_str())};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 1, argv);
+    } else {
+        v8::Local<v8::Value> argv[1] = {Nan::Null()};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 1, argv);
+    }
+
+    baton->progress.Reset();
+    baton->callback.Reset();
+    // the baton is deleted once the async handle has been closed
+    uv_close(reinterpret_cast<uv_handle_t*>(&baton->async), packClosed<T>);
+}
+#pragma clang diagnostic pop
+
+// Converts the keys listed by a cache into [phrase, languages] pairs
+static Local<Array> keysToArray(std::vector<std::pair<std::string, langfield_type>> const& results) {
+    Local<Array> ids = Nan::New<Array>();
+
+    unsigned idx = 0;
+    for (auto const& tuple : results) {
+        Local<Array> out = Nan::New<Array>();
+        out->Set(0, Nan::New(tuple.first).ToLocalChecked());
+
+        langfield_type langfield = tuple.second;
+        if (langfield == ALL_LANGUAGES) {
+            out->Set(1, Nan::Null());
+        } else {
+            out->Set(1, langfieldToLangarray(langfield));
+        }
+
+        ids->Set(idx++, out);
+    }
+    return ids;
+}
+
+// Converts the result of _get into an Array of grids, or undefined if
+// there are none
+static Local<Value> gridsToArray(intarray const& vector) {
+    if (vector.empty()) return Nan::Undefined();
+    std::size_t size = vector.size();
+    Local<Array> array = Nan::New<Array>(static_cast<int>(size));
+    for (uint32_t i = 0; i < size; ++i) {
+        array->Set(i, Nan::New<Number>(vector[i]));
+    }
+    return array;
+}
+
+// Converts the result of _getMatching into an Array of covers, or undefined
+// if there are none
+static Local<Value> coversToArray(intarray const& vector) {
+    if (vector.empty()) return Nan::Undefined();
+    std::size_t size = vector.size();
+    Local<Array> array = Nan::New<Array>(static_cast<int>(size));
+    for (uint32_t i = 0; i < size; ++i) {
+        auto obj = coverToObject(numToCover(vector[i]));
+
+        // these values don't make any sense outside the context of coalesce, so delete them
+        // it's a little clunky to set and then delete them, but this function as exposed
+        // to node is only used in debugging/testing, so, meh
+        obj->Delete(Nan::New("idx").ToLocalChecked());
+        obj->Delete(Nan::New("tmpid").ToLocalChecked());
+        obj->Delete(Nan::New("distance").ToLocalChecked());
+        obj->Delete(Nan::New("scoredist").ToLocalChecked());
+        array->Set(i, obj);
+    }
+    return array;
+}
+
+// Runs a lookup on the threadpool; the cache is ref'd until the callback
+// has been called, the same way coalesce holds on to its caches
+template <class T>
+static void queueLookup(std::unique_ptr<LookupBaton<T>> baton_ptr, JSCache<T>* wrapper, Local<Value> callback) {
+    LookupBaton<T>* baton = baton_ptr.get();
+    baton->cache = wrapper;
+    baton->callback.Reset(callback.As<Function>());
+
+    wrapper->_ref();
+    baton->request.data = baton;
+    baton_ptr.release();
+    uv_queue_work(uv_default_loop(), &baton->request, lookupTask<T>, static_cast<uv_after_work_cb>(lookupAfter<T>));
+}
+
+template <class T>
+void lookupTask(uv_work_t* req) {
+    LookupBaton<T>* baton = static_cast<LookupBaton<T>*>(req->data);
+    T& c = baton->cache->cache;
+    try {
+        switch (baton->kind) {
+        case LookupKind::get:
+            baton->grids = c.__get(baton->phrase, baton->langfield);
+            break;
+        case LookupKind::getmatching:
+            baton->grids = c.__getmatching(baton->phrase, baton->match_prefixes, baton->langfield, baton->max_results);
+            break;
+        case LookupKind::list:
+            baton->keys = c.list();
+            break;
+        }
+    } catch (std::exception const& ex) {
+        baton->error = ex.what();
+    }
+}
+
+// the 'status' parameter is required as part of the uv_after_work_cb
+// signature, but we don't use it
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-parameter"
+template <class T>
+void lookupAfter(uv_work_t* req, int status) {
+    Nan::HandleScope scope;
+    LookupBaton<T>* baton = static_cast<LookupBaton<T>*>(req->data);
+
+    baton->cache->_unref();
+
+    if (!baton->error.empty()) {
+        v8::Local<v8::Value> argv[1] = {Nan::Error(baton->error.c_str())};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 1, argv);
+    } else {
+        Local<Value> result;
+        switch (baton->kind) {
+        case LookupKind::get:
+            result = gridsToArray(baton->grids);
+            break;
+        case LookupKind::getmatching:
+            result = coversToArray(baton->grids);
+            break;
+        case LookupKind::list:
+            result = keysToArray(baton->keys);
+            break;
+        }
+        v8::Local<v8::Value> argv[2] = {Nan::Null(), result};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 2, argv);
+    }
+
+    baton->callback.Reset();
+    delete baton;
+}
+#pragma clang diagnostic pop
+
 /**
  * lists the keys in the JSCache object
  *
  * @name list
  * @memberof JSCache
- * @param {String} id
+ * @param {Function} [callback] - if supplied, the keys are listed on the threadpool and passed to it, rather than returned
  * @returns {Array} Set of keys/ids
  * @example
  * const cache = require('@mapbox/carmen-cache');
  * const JSCache = new cache.JSCache('a');
  *
- * cache.list('a', (err, result) => {
+ * cache.list((err, result) => {
  *    if (err) throw err;
  *    console.log(result);
  * });
@@ -106,27 +379,16 @@ NAN_METHOD(JSCache<T>::pack) {
 template <class T>
 NAN_METHOD(JSCache<T>::list) {
     try {
-        T* c = &(node::ObjectWrap::Unwrap<JSCache<T>>(info.This())->cache);
-        Local<Array> ids = Nan::New<Array>();
-
-        std::vector<std::pair<std::string, langfield_type>> results = c->list();
-
-        unsigned idx = 0;
-        for (auto const& tuple : results) {
-            Local<Array> out = Nan::New<Array>();
-            out->Set(0, Nan::New(tuple.first).ToLocalChecked());
-
-            langfield_type langfield = tuple.second;
-            if (langfield == ALL_LANGUAGES) {
-                out->Set(1, Nan::Null());
-            } else {
-                out->Set(1, langfieldToLangarray(langfield));
-            }
-
-            ids->Set(idx++, out);
+        JSCache<T>* wrapper = node::ObjectWrap::Unwrap<JSCache<T>>(info.This());
+        if (info.Length() > 0 && info[0]->IsFunction()) {
+            std::unique_ptr<LookupBaton<T>> baton = std::make_unique<LookupBaton<T>>();
+            baton->kind = LookupKind::list;
+            queueLookup(std::move(baton), wrapper, info[0]);
+            info.GetReturnValue().Set(Nan::Undefined());
+            return;
         }
 
-        info.GetReturnValue().Set(ids);
+        info.GetReturnValue().Set(keysToArray(wrapper->cache.list()));
         return;
     } catch (std::exception const& ex) {
         return Nan::ThrowTypeError(ex.what());
@@ -141,6 +403,8 @@ NAN_METHOD(JSCache<T>::list) {
  * @memberof JSCache
  * @param {String} id
  * @param {String} filename
+ * @param {Object} [options] - RocksDBCache only
+ * @param {Number} [options.gridListCacheSize=0] - keep up to this many bytes of the grid lists that prefix scans and `coalesce` decode, least recently used first out, so that phrases many queries share are only read and merged once; 0 keeps none. Scans `coalesce` stops reading early are kept only as far as it read, and a list larger than a quarter of the cache isn't kept. Hits and misses are reported by `memoryUsage`
  * @returns {Object}
  * @example
  * const cache = require('@mapbox/carmen-cache');
@@ -170,8 +434,23 @@ NAN_METHOD(JSCache<RocksDBCache>::New) {
         }
         std::string filename(*utf8_filename);
 
+        size_t grid_list_cache_size = 0;
+        if (info.Length() > 2 && !info[2]->IsNull() && !info[2]->IsUndefined()) {
+            if (!info[2]->IsObject()) {
+                return Nan::ThrowTypeError("third argument 'options', if supplied, must be an Object");
+            }
+            Local<Object> options = info[2]->ToObject();
+            if (options->Has(Nan::New("gridListCacheSize").ToLocalChecked())) {
+                Local<Value> prop_val = options->Get(Nan::New("gridListCacheSize").ToLocalChecked());
+                if (!prop_val->IsNumber() || prop_val->IntegerValue() < 0) {
+                    return Nan::ThrowTypeError("gridListCacheSize must be a non-negative integer");
+                }
+                grid_list_cache_size = static_cast<size_t>(prop_val->IntegerValue());
+            }
+        }
+
         JSCache<RocksDBCache>* im = new JSCache<RocksDBCache>();
-        im->cache = RocksDBCache(filename);
+        im->cache = RocksDBCache(filename, grid_list_cache_size);
         im->Wrap(info.This());
         info.This()->Set(Nan::New("id").ToLocalChecked(), info[0]);
         info.GetReturnValue().Set(info.This());
@@ -188,10 +467,15 @@ NAN_METHOD(JSCache<RocksDBCache>::New) {
  * @name MemoryCache
  * @memberof MemoryCache
  * @param {String} id
+ * @param {Object} [options]
+ * @param {Boolean} [options.compact=false] - hold each grid list delta-encoded, as it will be packed, instead of as raw 64-bit grids; this uses much less memory but makes reads and appends slower
+ * @param {Number} [options.shards=1] - spread keys over this many independently locked shards, so that several `_setBulk` calls can write to the cache at once
  * @returns {Array} grid of integers
  * @example
  * const cache = require('@mapbox/carmen-cache');
  * const MemoryCache = new cache.MemoryCache(id, languages);
+ * const CompactCache = new cache.MemoryCache(id, { compact: true });
+ * const ShardedCache = new cache.MemoryCache(id, { shards: 8 });
  *
  */
 
@@ -208,8 +492,31 @@ NAN_METHOD(JSCache<MemoryCache>::New) {
             return Nan::ThrowTypeError("first argument 'id' must be a String");
         }
 
+        bool compact = false;
+        unsigned shards = 1;
+        if (info.Length() > 1 && !info[1]->IsNull() && !info[1]->IsUndefined()) {
+            if (!info[1]->IsObject()) {
+                return Nan::ThrowTypeError("second argument 'options', if supplied, must be an Object");
+            }
+            Local<Object> options = info[1]->ToObject();
+            if (options->Has(Nan::New("compact").ToLocalChecked())) {
+                Local<Value> prop_val = options->Get(Nan::New("compact").ToLocalChecked());
+                if (!prop_val->IsBoolean()) {
+                    return Nan::ThrowTypeError("compact must be a Boolean");
+                }
+                compact = prop_val->BooleanValue();
+            }
+            if (options->Has(Nan::New("shards").ToLocalChecked())) {
+                Local<Value> prop_val = options->Get(Nan::New("shards").ToLocalChecked());
+                if (!prop_val->IsNumber() || prop_val->IntegerValue() < 1 || prop_val->IntegerValue() > 1024) {
+                    return Nan::ThrowTypeError("shards must be an integer between 1 and 1024");
+                }
+                shards = static_cast<unsigned>(prop_val->IntegerValue());
+            }
+        }
+
         JSCache<MemoryCache>* im = new JSCache<MemoryCache>();
-        im->cache = MemoryCache();
+        im->cache = MemoryCache(compact, shards);
         im->Wrap(info.This());
         info.This()->Set(Nan::New("id").ToLocalChecked(), info[0]);
         info.GetReturnValue().Set(info.This());
@@ -226,7 +533,8 @@ NAN_METHOD(JSCache<MemoryCache>::New) {
   * @memberof JSCache
   * @param {String} id
   * @param {Array} optional; array of languages
-  * @returns {Array} integers referring to grids
+  * @param {Function} [callback] - if supplied, the lookup runs on the threadpool and its result is passed to it, rather than returned
+  * @returns {Array} integers referring to grids, or undefined if there are none
   * @example
   * const cache = require('@mapbox/carmen-cache');
   * const JSCache = new cache.JSCache('a');
@@ -239,7 +547,14 @@ NAN_METHOD(JSCache<MemoryCache>::New) {
 template <class T>
 NAN_METHOD(JSCache<T>::_get) {
     if (info.Length() < 1) {
-        return Nan::ThrowTypeError("expected at least one info: id, [languages]");
+        return Nan::ThrowTypeError("expected at least one info: id, [languages], [callback]");
+    }
+    // the callback, if there is one, comes last
+    int argc = info.Length();
+    Local<Value> callback;
+    if (argc > 1 && info[argc - 1]->IsFunction()) {
+        callback = info[argc - 1];
+        argc--;
     }
     if (!info[0]->IsString()) {
         return Nan::ThrowTypeError("first arg must be a String");
@@ -252,7 +567,7 @@ NAN_METHOD(JSCache<T>::_get) {
         std::string id(*utf8_id);
 
         langfield_type langfield;
-        if (info.Length() > 1 && !(info[1]->IsNull() || info[1]->IsUndefined())) {
+        if (argc > 1 && !(info[1]->IsNull() || info[1]->IsUndefined())) {
             if (!info[1]->IsArray()) {
                 return Nan::ThrowTypeError("second arg, if supplied must be an Array");
             }
@@ -261,20 +576,19 @@ NAN_METHOD(JSCache<T>::_get) {
             langfield = ALL_LANGUAGES;
         }
 
-        T* c = &(node::ObjectWrap::Unwrap<JSCache<T>>(info.This())->cache);
-        intarray vector = c->__get(id, langfield);
-        if (!vector.empty()) {
-            std::size_t size = vector.size();
-            Local<Array> array = Nan::New<Array>(static_cast<int>(size));
-            for (uint32_t i = 0; i < size; ++i) {
-                array->Set(i, Nan::New<Number>(vector[i]));
-            }
-            info.GetReturnValue().Set(array);
-            return;
-        } else {
+        JSCache<T>* wrapper = node::ObjectWrap::Unwrap<JSCache<T>>(info.This());
+        if (!callback.IsEmpty()) {
+            std::unique_ptr<LookupBaton<T>> baton = std::make_unique<LookupBaton<T>>();
+            baton->kind = LookupKind::get;
+            baton->phrase = std::move(id);
+            baton->langfield = langfield;
+            queueLookup(std::move(baton), wrapper, callback);
             info.GetReturnValue().Set(Nan::Undefined());
             return;
         }
+
+        info.GetReturnValue().Set(gridsToArray(wrapper->cache.__get(id, langfield)));
+        return;
     } catch (std::exception const& ex) {
         return Nan::ThrowTypeError(ex.what());
     }
@@ -288,7 +602,9 @@ NAN_METHOD(JSCache<T>::_get) {
  * @param {String} id
  * @param {Number} matches_prefix - whether or do an exact match (0), prefix scan(1), or word boundary scan(2); used for autocomplete
  * @param {Array} optional; array of languages
- * @returns {Array} integers referring to grids
+ * @param {Boolean} [extendedScan=false] - return every matching grid, however many there are
+ * @param {Function} [callback] - if supplied, the scan runs on the threadpool and its result is passed to it, rather than returned; worthwhile for extended scans, which can take a long time
+ * @returns {Array} integers referring to grids, or undefined if nothing matches
  * @example
  * const cache = require('@mapbox/carmen-cache');
  * const JSCache = new cache.JSCache('a');
@@ -301,7 +617,14 @@ NAN_METHOD(JSCache<T>::_get) {
 template <class T>
 NAN_METHOD(JSCache<T>::_getmatching) {
     if (info.Length() < 2) {
-        return Nan::ThrowTypeError("expected two to four info: id, match_prefixes, [languages], [extendedScan]");
+        return Nan::ThrowTypeError("expected two to five info: id, match_prefixes, [languages], [extendedScan], [callback]");
+    }
+    // the callback, if there is one, comes last
+    int argc = info.Length();
+    Local<Value> callback;
+    if (argc > 2 && info[argc - 1]->IsFunction()) {
+        callback = info[argc - 1];
+        argc--;
     }
     if (!info[0]->IsString()) {
         return Nan::ThrowTypeError("first arg must be a String");
@@ -323,7 +646,7 @@ NAN_METHOD(JSCache<T>::_getmatching) {
         PrefixMatch match_prefixes = static_cast<PrefixMatch>(int32_prefix);
 
         langfield_type langfield;
-        if (info.Length() > 2 && !(info[2]->IsNull() || info[2]->IsUndefined())) {
+        if (argc > 2 && !(info[2]->IsNull() || info[2]->IsUndefined())) {
             if (!info[2]->IsArray()) {
                 return Nan::ThrowTypeError("third arg, if supplied, must be an Array");
             }
@@ -333,7 +656,7 @@ NAN_METHOD(JSCache<T>::_getmatching) {
         }
 
         bool extended_scan;
-        if (info.Length() > 3 && !(info[3]->IsNull() || info[3]->IsUndefined())) {
+        if (argc > 3 && !(info[3]->IsNull() || info[3]->IsUndefined())) {
             if (!info[3]->IsBoolean()) {
                 return Nan::ThrowTypeError("fourth arg, if supplied, must be a boolean");
             }
@@ -342,30 +665,22 @@ NAN_METHOD(JSCache<T>::_getmatching) {
             extended_scan = false;
         }
 
-        T* c = &(node::ObjectWrap::Unwrap<JSCache<T>>(info.This())->cache);
+        JSCache<T>* wrapper = node::ObjectWrap::Unwrap<JSCache<T>>(info.This());
         size_t max_results = extended_scan ? std::numeric_limits<size_t>::max() : PREFIX_MAX_GRID_LENGTH;
-        intarray vector = c->__getmatching(id, match_prefixes, langfield, max_results);
-        if (!vector.empty()) {
-            std::size_t size = vector.size();
-            Local<Array> array = Nan::New<Array>(static_cast<int>(size));
-            for (uint32_t i = 0; i < size; ++i) {
-                auto obj = coverToObject(numToCover(vector[i]));
-
-                // these values don't make any sense outside the context of coalesce, so delete them
-                // it's a little clunky to set and then delete them, but this function as exposed
-                // to node is only used in debugging/testing, so, meh
-                obj->Delete(Nan::New("idx").ToLocalChecked());
-                obj->Delete(Nan::New("tmpid").ToLocalChecked());
-                obj->Delete(Nan::New("distance").ToLocalChecked());
-                obj->Delete(Nan::New("scoredist").ToLocalChecked());
-                array->Set(i, obj);
-            }
-            info.GetReturnValue().Set(array);
-            return;
-        } else {
+        if (!callback.IsEmpty()) {
+            std::unique_ptr<LookupBaton<T>> baton = std::make_unique<LookupBaton<T>>();
+            baton->kind = LookupKind::getmatching;
+            baton->phrase = std::move(id);
+            baton->match_prefixes = match_prefixes;
+            baton->langfield = langfield;
+            baton->max_results = max_results;
+            queueLookup(std::move(baton), wrapper, callback);
             info.GetReturnValue().Set(Nan::Undefined());
             return;
         }
+
+        info.GetReturnValue().Set(coversToArray(wrapper->cache.__getmatching(id, match_prefixes, langfield, max_results)));
+        return;
     } catch (std::exception const& ex) {
         return Nan::ThrowTypeError(ex.what());
     }
@@ -423,6 +738,778 @@ NAN_METHOD(JSCache<MemoryCache>::_set) {
     return;
 }
 
+/**
+ * Replaces or appends the data for many keys in one call. Grids are read
+ * straight out of a binary buffer rather than from a JS array of numbers,
+ * so values above 2^53 (such as grids with the language match bit set)
+ * keep their full precision.
+ *
+ * @name setBulk
+ * @memberof MemoryCache
+ * @param {String[]} ids - the keys to set
+ * @param {Buffer} data - the grids for every key, concatenated, as little-endian 64-bit unsigned integers; any typed array or DataView (such as a BigUint64Array) is accepted too
+ * @param {Number[]} lengths - how many grids from `data` belong to each key, in the same order as `ids`
+ * @param {Array} [languages] - an array holding, for each key, an array of relevant languages or null
+ * @param {Boolean} [append] - T: append to data, F: replace data
+ * @param {Function} [callback] - if supplied, the keys are set on the libuv threadpool and `callback(err)` is called once they all are; `data` must not be modified in the meantime. Several such calls can run at once, and scale best on a cache created with the `shards` option
+ * @returns undefined
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const MemoryCache = new cache.MemoryCache('a');
+ *
+ * const data = new BigUint64Array([1n, 2n, 3n, 4n]);
+ * MemoryCache._setBulk(['a', 'b'], data, [3, 1], [[0], null]);
+ * MemoryCache._setBulk(['c'], data, [4], null, false, (err) => {
+ *      if (err) throw err;
+ * });
+ *
+ */
+
+// the arguments of a _setBulk call, once they've been checked
+struct BulkArgs {
+    std::vector<std::string> keys;
+    std::vector<size_t> counts;
+    std::vector<langfield_type> langfields;
+    const char* grids = nullptr;
+};
+
+static bool throwTypeError(const char* message) {
+    Nan::ThrowTypeError(message);
+    return false;
+}
+
+// Reads the ids, data, lengths and [languages] arguments taken by the
+// _setBulk methods, validating all of them before anything gets written.
+// Returns false, having thrown a JS TypeError, if any are invalid.
+static bool bulkArgsFromInfo(NAN_METHOD_ARGS_TYPE info, int argc, BulkArgs& args) {
+    if (!info[0]->IsArray()) {
+        return throwTypeError("first arg must be an Array");
+    }
+    if (!info[1]->IsArrayBufferView()) {
+        return throwTypeError("second arg must be a Buffer or typed array");
+    }
+    if (!info[2]->IsArray()) {
+        return throwTypeError("third arg must be an Array");
+    }
+    Local<Array> ids = Local<Array>::Cast(info[0]);
+    Local<Array> lengths = Local<Array>::Cast(info[2]);
+    uint32_t ids_length = ids->Length();
+    if (lengths->Length() != ids_length) {
+        return throwTypeError("third arg must have one length per id");
+    }
+
+    Local<Array> languages;
+    bool has_languages = argc > 3 && !(info[3]->IsNull() || info[3]->IsUndefined());
+    if (has_languages) {
+        if (!info[3]->IsArray()) {
+            return throwTypeError("fourth arg, if supplied must be an Array");
+        }
+        languages = Local<Array>::Cast(info[3]);
+        if (languages->Length() != ids_length) {
+            return throwTypeError("fourth arg must have one entry per id");
+        }
+    }
+
+    Nan::TypedArrayContents<char> data(info[1]);
+    size_t data_length = data.length() / sizeof(value_type);
+    if (data.length() % sizeof(value_type) != 0) {
+        return throwTypeError("second arg must hold a whole number of 64-bit grids");
+    }
+
+    // validate everything before touching the cache so that a bad
+    // argument doesn't leave it half-written
+    std::vector<std::string>& keys = args.keys;
+    std::vector<size_t>& counts = args.counts;
+    std::vector<langfield_type>& langfields = args.langfields;
+    keys.reserve(ids_length);
+    counts.reserve(ids_length);
+    langfields.reserve(ids_length);
+    size_t total = 0;
+    for (uint32_t i = 0; i < ids_length; i++) {
+        Local<Value> id = ids->Get(i);
+        if (!id->IsString()) {
+            return throwTypeError("all ids must be Strings");
+        }
+        Nan::Utf8String utf8_id(id);
+        if (utf8_id.length() < 1) {
+            return throwTypeError("all ids must be non-empty Strings");
+        }
+        keys.emplace_back(*utf8_id);
+
+        Local<Value> length = lengths->Get(i);
+        if (!length->IsNumber() || length->IntegerValue() < 0) {
+            return throwTypeError("all lengths must be non-negative integers");
+        }
+        counts.emplace_back(static_cast<size_t>(length->IntegerValue()));
+        total += counts.back();
+
+        langfield_type langfield = ALL_LANGUAGES;
+        if (has_languages) {
+            Local<Value> langs = languages->Get(i);
+            if (!(langs->IsNull() || langs->IsUndefined())) {
+                if (!langs->IsArray()) {
+                    return throwTypeError("all languages must be Arrays or null");
+                }
+                langfield = langarrayToLangfield(Local<Array>::Cast(langs));
+            }
+        }
+        langfields.emplace_back(langfield);
+    }
+    if (total != data_length) {
+        return throwTypeError("lengths must add up to the number of grids in data");
+    }
+    args.grids = *data;
+    return true;
+}
+
+// sets every key in a _setBulk call, reading their grids one after another
+// out of `grids`
+static void setBulk(MemoryCache& c, std::vector<std::string>& keys, std::vector<size_t> const& counts, std::vector<langfield_type> const& langfields, const char* grids, bool append) {
+    for (size_t i = 0; i < keys.size(); i++) {
+        c._set(std::move(keys[i]), grids, counts[i], langfields[i], append);
+        grids += counts[i] * sizeof(value_type);
+    }
+}
+
+template <>
+NAN_METHOD(JSCache<MemoryCache>::_setBulk) {
+    if (info.Length() < 3) {
+        return Nan::ThrowTypeError("expected at least three info: ids, data, lengths, [languages], [append], [callback]");
+    }
+    // the callback, if there is one, comes last
+    int argc = info.Length();
+    Local<Value> callback;
+    if (argc > 3 && info[argc - 1]->IsFunction()) {
+        callback = info[argc - 1];
+        argc--;
+    }
+    bool append = argc > 4 && info[4]->IsBoolean() && info[4]->BooleanValue();
+
+    try {
+        BulkArgs args;
+        if (!bulkArgsFromInfo(info, argc, args)) return;
+
+        JSMemoryCache* wrapper = node::ObjectWrap::Unwrap<JSMemoryCache>(info.This());
+        if (callback.IsEmpty()) {
+            setBulk(wrapper->cache, args.keys, args.counts, args.langfields, args.grids, append);
+        } else {
+            std::unique_ptr<SetBulkBaton> baton_ptr = std::make_unique<SetBulkBaton>();
+            SetBulkBaton* baton = baton_ptr.get();
+            baton->cache = wrapper;
+            baton->keys = std::move(args.keys);
+            baton->counts = std::move(args.counts);
+            baton->langfields = std::move(args.langfields);
+            baton->append = append;
+            baton->data.Reset(info[1]);
+            baton->grids = args.grids;
+            baton->callback.Reset(callback.As<Function>());
+
+            wrapper->_ref();
+            baton->request.data = baton;
+            baton_ptr.release();
+            uv_queue_work(uv_default_loop(), &baton->request, setBulkTask, static_cast<uv_after_work_cb>(setBulkAfter));
+        }
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+    info.GetReturnValue().Set(Nan::Undefined());
+    return;
+}
+
+void setBulkTask(uv_work_t* req) {
+    SetBulkBaton* baton = static_cast<SetBulkBaton*>(req->data);
+    try {
+        setBulk(baton->cache->cache, baton->keys, baton->counts, baton->langfields, baton->grids, baton->append);
+    } catch (std::exception const& ex) {
+        baton->error = ex.what();
+    }
+}
+
+// the 'status' parameter is required as part of the uv_after_work_cb
+// signature, but we don't use it
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-parameter"
+void setBulkAfter(uv_work_t* req, int status) {
+    Nan::HandleScope scope;
+    SetBulkBaton* baton = static_cast<SetBulkBaton*>(req->data);
+
+    baton->cache->_unref();
+
+    if (!baton->error.empty()) {
+        v8::Local<v8::Value> argv[1] = {Nan::Error(baton->error.c_str())};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 1, argv);
+    } else {
+        v8::Local<v8::Value> argv[1] = {Nan::Null()};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 1, argv);
+    }
+
+    baton->data.Reset();
+    baton->callback.Reset();
+    delete baton;
+}
+#pragma clang diagnostic pop
+
+// Reads the queries of a batched lookup: an Array of [phrase, languages]
+// pairs for _getBatch, or of [phrase, matchPrefixes, languages] triples for
+// _getMatchingBatch, where languages can be left out or null. Returns false,
+// having thrown a JS TypeError, if any are invalid.
+static bool batchQueriesFromValue(Local<Value> value, bool with_match_prefixes, std::vector<BatchQuery>& queries) {
+    if (!value->IsArray()) {
+        return throwTypeError("first arg must be an Array");
+    }
+    Local<Array> array = Local<Array>::Cast(value);
+    uint32_t length = array->Length();
+    size_t languages_idx = with_match_prefixes ? 2 : 1;
+    queries.reserve(length);
+    for (uint32_t i = 0; i < length; i++) {
+        Local<Value> item = array->Get(i);
+        if (!item->IsArray()) {
+            return throwTypeError("every query must be an Array");
+        }
+        Local<Array> query = Local<Array>::Cast(item);
+
+        Local<Value> phrase = query->Get(0);
+        if (!phrase->IsString()) {
+            return throwTypeError("every query must start with a phrase String");
+        }
+        Nan::Utf8String utf8_phrase(phrase);
+        if (utf8_phrase.length() < 1) {
+            return throwTypeError("every query must start with a phrase String");
+        }
+
+        PrefixMatch match_prefixes = PrefixMatch::disabled;
+        if (with_match_prefixes) {
+            Local<Value> prefix = query->Get(1);
+            if (!prefix->IsNumber() || prefix->Int32Value() < 0 || prefix->Int32Value() > 2) {
+                return throwTypeError("matchPrefixes must be an integer between 0 - 2");
+            }
+            match_prefixes = static_cast<PrefixMatch>(prefix->Int32Value());
+        }
+
+        langfield_type langfield = ALL_LANGUAGES;
+        if (query->Length() > languages_idx) {
+            Local<Value> languages = query->Get(static_cast<uint32_t>(languages_idx));
+            if (!(languages->IsNull() || languages->IsUndefined())) {
+                if (!languages->IsArray()) {
+                    return throwTypeError("languages, if supplied, must be an Array");
+                }
+                langfield = langarrayToLangfield(Local<Array>::Cast(languages));
+            }
+        }
+
+        queries.push_back(BatchQuery{*utf8_phrase, match_prefixes, langfield});
+    }
+    return true;
+}
+
+// Packs the results of a batched lookup into one Buffer of little-endian
+// 64-bit grids, with an Array saying how many belong to each query. Throws
+// if they don't fit in a Buffer, which callers turn into a TypeError.
+static Local<Object> batchResultsToObject(std::vector<intarray> const& results) {
+    size_t total = 0;
+    for (intarray const& result : results) {
+        total += result.size();
+    }
+    // Nan::NewBuffer takes a 32-bit length, whatever node allows
+    size_t max_grids = std::min<size_t>(node::Buffer::kMaxLength, std::numeric_limits<uint32_t>::max()) / sizeof(value_type);
+    if (total > max_grids) {
+        throw std::length_error("batch results hold " + std::to_string(total) + " grids, more than the " + std::to_string(max_grids) + " a Buffer can");
+    }
+
+    Local<Object> grids = Nan::NewBuffer(static_cast<uint32_t>(total * sizeof(value_type))).ToLocalChecked();
+    char* data = node::Buffer::Data(grids);
+    Local<Array> lengths = Nan::New<Array>(static_cast<int>(results.size()));
+    for (uint32_t i = 0; i < results.size(); i++) {
+        intarray const& result = results[i];
+        if (!result.empty()) {
+            memcpy(data, result.data(), result.size() * sizeof(value_type));
+            data += result.size() * sizeof(value_type);
+        }
+        lengths->Set(i, Nan::New<Number>(static_cast<double>(result.size())));
+    }
+
+    Local<Object> out = Nan::New<Object>();
+    out->Set(Nan::New("grids").ToLocalChecked(), grids);
+    out->Set(Nan::New("lengths").ToLocalChecked(), lengths);
+    return out;
+}
+
+/**
+ * Looks up many phrases at once, as `_get` would, in a single call. A
+ * RocksDBCache fetches them all with one MultiGet. Grids come back as raw
+ * 64-bit integers, so those with the language match bit set keep their full
+ * precision.
+ *
+ * @name getBatch
+ * @memberof JSCache
+ * @param {Array[]} queries - `[phrase, languages]` pairs; languages may be left out or null
+ * @returns {Object} `{ grids, lengths }`: a Buffer with every query's grids one after another, as little-endian 64-bit unsigned integers, and how many of them belong to each query. Throws a TypeError if there are more grids than a Buffer can hold
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const RocksDBCache = new cache.RocksDBCache('a', 'filename');
+ *
+ * const result = RocksDBCache._getBatch([['main street'], ['main road', [0, 1]]]);
+ * // => { grids: <Buffer ...>, lengths: [3, 0] }
+ */
+
+template <class T>
+NAN_METHOD(JSCache<T>::_getBatch) {
+    if (info.Length() < 1) {
+        return Nan::ThrowTypeError("expected one info: queries");
+    }
+    std::vector<BatchQuery> queries;
+    if (!batchQueriesFromValue(info[0], false, queries)) return;
+    try {
+        T* c = &(node::ObjectWrap::Unwrap<JSCache<T>>(info.This())->cache);
+        info.GetReturnValue().Set(batchResultsToObject(c->__getBatch(queries)));
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+}
+
+/**
+ * Runs many `_getMatching` lookups in a single call. A RocksDBCache runs the
+ * scans in key order through one iterator, so neighbouring scans share the
+ * blocks they read. Results come back the same way as from `_getBatch`.
+ *
+ * @name getMatchingBatch
+ * @memberof JSCache
+ * @param {Array[]} queries - `[phrase, matchPrefixes, languages]` triples, where matchPrefixes is 0 for an exact match, 1 for a prefix scan or 2 for a word boundary scan, and languages may be left out or null
+ * @param {Boolean} [extendedScan=false] - return every matching grid rather than at most as many as `_getMatching` does
+ * @returns {Object} `{ grids, lengths }`
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const RocksDBCache = new cache.RocksDBCache('a', 'filename');
+ *
+ * const result = RocksDBCache._getMatchingBatch([['main', 1], ['main street', 0, [0]]]);
+ */
+
+template <class T>
+NAN_METHOD(JSCache<T>::_getmatchingBatch) {
+    if (info.Length() < 1) {
+        return Nan::ThrowTypeError("expected one or two info: queries, [extendedScan]");
+    }
+    std::vector<BatchQuery> queries;
+    if (!batchQueriesFromValue(info[0], true, queries)) return;
+
+    bool extended_scan = false;
+    if (info.Length() > 1 && !(info[1]->IsNull() || info[1]->IsUndefined())) {
+        if (!info[1]->IsBoolean()) {
+            return Nan::ThrowTypeError("second arg, if supplied, must be a boolean");
+        }
+        extended_scan = info[1]->BooleanValue();
+    }
+    size_t max_results = extended_scan ? std::numeric_limits<size_t>::max() : PREFIX_MAX_GRID_LENGTH;
+
+    try {
+        T* c = &(node::ObjectWrap::Unwrap<JSCache<T>>(info.This())->cache);
+        info.GetReturnValue().Set(batchResultsToObject(c->__getmatchingBatch(queries, max_results)));
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+}
+
+/**
+ * Reports how much memory the cache holds. Everything a MemoryCache stores
+ * comes out of pools that are only handed back to the system when the cache
+ * is destroyed; `allocated` is the size of those pools, and `used` the part
+ * of them taken up by keys, grid lists and their bookkeeping.
+ *
+ * @name memoryUsage
+ * @memberof MemoryCache
+ * @returns {Object} `{ allocated, used }`, in bytes
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const MemoryCache = new cache.MemoryCache('a');
+ *
+ * MemoryCache._set('a', [1, 2, 3]);
+ * console.log(MemoryCache.memoryUsage()); // { allocated: 1048576, used: 104 }
+ */
+
+template <>
+NAN_METHOD(JSCache<MemoryCache>::memoryUsage) {
+    MemoryCache* c = &(node::ObjectWrap::Unwrap<JSMemoryCache>(info.This())->cache);
+    MemoryUsage usage = c->memoryUsage();
+    Local<Object> out = Nan::New<Object>();
+    out->Set(Nan::New("allocated").ToLocalChecked(), Nan::New<Number>(static_cast<double>(usage.allocated)));
+    out->Set(Nan::New("used").ToLocalChecked(), Nan::New<Number>(static_cast<double>(usage.used)));
+    info.GetReturnValue().Set(out);
+}
+
+/**
+ * Sets up resources shared by every RocksDBCache opened from then on, so that
+ * a process with many indexes can be held to one memory budget: a single LRU
+ * block cache, which also holds the index and filter blocks of every table,
+ * and a budget of table files that may be open at once, split between the
+ * caches. Caches that are already open keep what they were opened with.
+ *
+ * @name configure
+ * @memberof RocksDBCache
+ * @param {Object} options
+ * @param {Number} [options.blockCacheSize=0] - size in bytes of the shared block cache; 0 gives each cache RocksDB's own default one
+ * @param {Number} [options.maxOpenFiles=-1] - how many table files all caches together may keep open; -1 for no limit. Every cache is allowed at least 10, which may overdraw the budget
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * cache.RocksDBCache.configure({ blockCacheSize: 512 * 1024 * 1024, maxOpenFiles: 1000 });
+ */
+
+NAN_METHOD(configureRocksDBCache) {
+    if (info.Length() < 1 || !info[0]->IsObject()) {
+        return Nan::ThrowTypeError("expected an 'options' Object");
+    }
+    Local<Object> options = info[0]->ToObject();
+
+    size_t block_cache_size = 0;
+    Local<String> block_cache_key = Nan::New("blockCacheSize").ToLocalChecked();
+    if (options->Has(block_cache_key)) {
+        Local<Value> prop_val = options->Get(block_cache_key);
+        if (!prop_val->IsNumber() || prop_val->IntegerValue() < 0) {
+            return Nan::ThrowTypeError("blockCacheSize must be a non-negative integer");
+        }
+        block_cache_size = static_cast<size_t>(prop_val->IntegerValue());
+    }
+
+    int max_open_files = -1;
+    Local<String> max_open_files_key = Nan::New("maxOpenFiles").ToLocalChecked();
+    if (options->Has(max_open_files_key)) {
+        Local<Value> prop_val = options->Get(max_open_files_key);
+        if (!prop_val->IsNumber() || prop_val->IntegerValue() < -1 || prop_val->IntegerValue() > std::numeric_limits<int>::max()) {
+            return Nan::ThrowTypeError("maxOpenFiles must be -1 or a non-negative integer");
+        }
+        max_open_files = static_cast<int>(prop_val->IntegerValue());
+    }
+
+    RocksDBCache::configure(block_cache_size, max_open_files);
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+/**
+ * Reports what the cache costs. `tableReaders` and `memtables` belong to this
+ * cache alone; when a shared block cache has been set up with `configure`,
+ * `blockCache` describes that one cache, shared with every other RocksDBCache
+ * opened since, and is otherwise null. `gridListCache` describes the cache's
+ * own cache of decoded grid lists, if it was opened with one, and is
+ * otherwise null.
+ *
+ * @name memoryUsage
+ * @memberof RocksDBCache
+ * @returns {Object} `{ tableReaders, memtables, openFiles, blockCache: { capacity, usage, pinned }, gridListCache: { capacity, usage, hits, misses } }`, in bytes, except for `openFiles`, the table files reserved for this cache from the budget (-1 if there is none), and `hits` and `misses`, the lookups the grid list cache could and couldn't answer
+ */
+
+template <>
+NAN_METHOD(JSCache<RocksDBCache>::memoryUsage) {
+    RocksDBCache* c = &(node::ObjectWrap::Unwrap<JSRocksDBCache>(info.This())->cache);
+    try {
+        RocksDBCacheUsage usage = c->memoryUsage();
+        Local<Object> out = Nan::New<Object>();
+        out->Set(Nan::New("tableReaders").ToLocalChecked(), Nan::New<Number>(static_cast<double>(usage.table_readers)));
+        out->Set(Nan::New("memtables").ToLocalChecked(), Nan::New<Number>(static_cast<double>(usage.memtables)));
+        out->Set(Nan::New("openFiles").ToLocalChecked(), Nan::New<Number>(usage.open_files));
+        if (usage.shared_block_cache) {
+            Local<Object> block_cache = Nan::New<Object>();
+            block_cache->Set(Nan::New("capacity").ToLocalChecked(), Nan::New<Number>(static_cast<double>(usage.block_cache_capacity)));
+            block_cache->Set(Nan::New("usage").ToLocalChecked(), Nan::New<Number>(static_cast<double>(usage.block_cache_usage)));
+            block_cache->Set(Nan::New("pinned").ToLocalChecked(), Nan::New<Number>(static_cast<double>(usage.block_cache_pinned)));
+            out->Set(Nan::New("blockCache").ToLocalChecked(), block_cache);
+        } else {
+            out->Set(Nan::New("blockCache").ToLocalChecked(), Nan::Null());
+        }
+        if (usage.grid_list_cache) {
+            Local<Object> grid_lists = Nan::New<Object>();
+            grid_lists->Set(Nan::New("capacity").ToLocalChecked(), Nan::New<Number>(static_cast<double>(usage.grid_list_capacity)));
+            grid_lists->Set(Nan::New("usage").ToLocalChecked(), Nan::New<Number>(static_cast<double>(usage.grid_list_usage)));
+            grid_lists->Set(Nan::New("hits").ToLocalChecked(), Nan::New<Number>(static_cast<double>(usage.grid_list_hits)));
+            grid_lists->Set(Nan::New("misses").ToLocalChecked(), Nan::New<Number>(static_cast<double>(usage.grid_list_misses)));
+            out->Set(Nan::New("gridListCache").ToLocalChecked(), grid_lists);
+        } else {
+            out->Set(Nan::New("gridListCache").ToLocalChecked(), Nan::Null());
+        }
+        info.GetReturnValue().Set(out);
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+}
+
+// the filename argument shared by save and load
+static bool filenameFromInfo(NAN_METHOD_ARGS_TYPE info, std::string& filename) {
+    if (info.Length() < 1) {
+        return throwTypeError("expected one info: 'filename'");
+    }
+    if (!info[0]->IsString()) {
+        return throwTypeError("first argument must be a String");
+    }
+    Nan::Utf8String utf8_filename(info[0]);
+    if (utf8_filename.length() < 1) {
+        return throwTypeError("first arg must be a String");
+    }
+    filename = *utf8_filename;
+    return true;
+}
+
+/**
+ * Writes a snapshot of the cache to a flat binary file that `load` can read
+ * back much faster than the cache could be rebuilt with `_set`. Snapshots are
+ * meant for resuming work on the same machine, not for distribution; use
+ * `pack` for that.
+ *
+ * @name save
+ * @memberof MemoryCache
+ * @param {String} filename
+ * @returns {Boolean}
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const MemoryCache = new cache.MemoryCache('a');
+ *
+ * MemoryCache._set('main street', [1, 2, 3]);
+ * MemoryCache.save('a.snapshot');
+ */
+
+template <>
+NAN_METHOD(JSCache<MemoryCache>::save) {
+    std::string filename;
+    if (!filenameFromInfo(info, filename)) return;
+    try {
+        MemoryCache* c = &(node::ObjectWrap::Unwrap<JSMemoryCache>(info.This())->cache);
+        c->save(filename);
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+    info.GetReturnValue().Set(true);
+}
+
+/**
+ * Replaces the contents of the cache with a snapshot written by `save`. The
+ * snapshot can come from a cache with different `compact` or `shards`
+ * options; its lists are converted as they're loaded. If the file can't be
+ * read, the cache is left as it was.
+ *
+ * @name load
+ * @memberof MemoryCache
+ * @param {String} filename
+ * @returns {Boolean}
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const MemoryCache = new cache.MemoryCache('a', { shards: 8 });
+ *
+ * MemoryCache.load('a.snapshot');
+ * MemoryCache._get('main street'); // [3, 2, 1]
+ */
+
+template <>
+NAN_METHOD(JSCache<MemoryCache>::load) {
+    std::string filename;
+    if (!filenameFromInfo(info, filename)) return;
+    try {
+        MemoryCache* c = &(node::ObjectWrap::Unwrap<JSMemoryCache>(info.This())->cache);
+        c->load(filename);
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+    info.GetReturnValue().Set(true);
+}
+
+Nan::Persistent<v8::FunctionTemplate> JSCacheBuilder::constructor;
+
+void JSCacheBuilder::Initialize(Handle<Object> target) {
+    Nan::HandleScope scope;
+    Local<FunctionTemplate> t = Nan::New<FunctionTemplate>(JSCacheBuilder::New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    t->SetClassName(Nan::New("CacheBuilder").ToLocalChecked());
+    Nan::SetPrototypeMethod(t, "_set", _set);
+    Nan::SetPrototypeMethod(t, "_setBulk", _setBulk);
+    Nan::SetPrototypeMethod(t, "finish", finish);
+    target->Set(Nan::New("CacheBuilder").ToLocalChecked(), t->GetFunction());
+    constructor.Reset(t);
+}
+
+JSCacheBuilder::JSCacheBuilder(std::string const& filename, size_t memory_limit)
+    : ObjectWrap(),
+      builder(filename, memory_limit) {}
+
+/**
+ * Builds a RocksDBCache file from grids that can be added in any order and
+ * that don't have to fit in memory all at once. Grids are buffered up to
+ * `memoryLimit` bytes, then sorted and spilled to disk next to the output;
+ * `finish` merges everything and writes the same file that packing a
+ * MemoryCache with the same contents would. If `finish` throws, the output
+ * is removed rather than left half written, and the builder can't be used
+ * again.
+ *
+ * @name CacheBuilder
+ * @memberof CacheBuilder
+ * @param {String} id
+ * @param {String} filename - the RocksDBCache file to create
+ * @param {Object} [options]
+ * @param {Number} [options.memoryLimit=268435456] - roughly how many bytes of grids to hold in memory before spilling them to disk
+ * @returns {Object}
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const builder = new cache.CacheBuilder('a', 'filename', { memoryLimit: 64 * 1024 * 1024 });
+ *
+ * builder._set('main street', [1, 2, 3]);
+ * builder._set('main street', [4]);
+ * builder.finish();
+ * const RocksDBCache = new cache.RocksDBCache('a', 'filename');
+ */
+
+NAN_METHOD(JSCacheBuilder::New) {
+    if (!info.IsConstructCall()) {
+        return Nan::ThrowTypeError("Cannot call constructor as function, you need to use 'new' keyword");
+    }
+    try {
+        if (info.Length() < 2) {
+            return Nan::ThrowTypeError("expected arguments 'id' and 'filename'");
+        }
+        if (!info[0]->IsString()) {
+            return Nan::ThrowTypeError("first argument 'id' must be a String");
+        }
+        if (!info[1]->IsString()) {
+            return Nan::ThrowTypeError("second argument 'filename' must be a String");
+        }
+
+        Nan::Utf8String utf8_filename(info[1]);
+        if (utf8_filename.length() < 1) {
+            return Nan::ThrowTypeError("second arg must be a String");
+        }
+        std::string filename(*utf8_filename);
+
+        size_t memory_limit = 256 * 1024 * 1024;
+        if (info.Length() > 2 && !(info[2]->IsNull() || info[2]->IsUndefined())) {
+            if (!info[2]->IsObject()) {
+                return Nan::ThrowTypeError("third argument 'options', if supplied, must be an Object");
+            }
+            Local<Object> options = info[2]->ToObject();
+            Local<String> memory_limit_key = Nan::New("memoryLimit").ToLocalChecked();
+            if (options->Has(memory_limit_key)) {
+                Local<Value> prop_val = options->Get(memory_limit_key);
+                if (!prop_val->IsNumber() || prop_val->IntegerValue() < 1) {
+                    return Nan::ThrowTypeError("memoryLimit must be a positive integer");
+                }
+                memory_limit = static_cast<size_t>(prop_val->IntegerValue());
+            }
+        }
+
+        JSCacheBuilder* im = new JSCacheBuilder(filename, memory_limit);
+        im->Wrap(info.This());
+        info.This()->Set(Nan::New("id").ToLocalChecked(), info[0]);
+        info.GetReturnValue().Set(info.This());
+        return;
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+}
+
+/**
+ * Adds grids for a key. Unlike MemoryCache, adding to a key that already
+ * has grids always appends to them.
+ *
+ * @name set
+ * @memberof CacheBuilder
+ * @param {String} id
+ * @param {Number[]} data - an array of numbers where each number represents a grid
+ * @param {Array} [languages] - an array of language IDs
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const builder = new cache.CacheBuilder('a', 'filename');
+ *
+ * builder._set('main street', [1, 2, 3], [0]);
+ */
+
+NAN_METHOD(JSCacheBuilder::_set) {
+    if (info.Length() < 2) {
+        return Nan::ThrowTypeError("expected at least two info: id, data, [languages]");
+    }
+    if (!info[0]->IsString()) {
+        return Nan::ThrowTypeError("first arg must be a String");
+    }
+    if (!info[1]->IsArray()) {
+        return Nan::ThrowTypeError("second arg must be an Array");
+    }
+    Local<Array> data = Local<Array>::Cast(info[1]);
+    try {
+        Nan::Utf8String utf8_id(info[0]);
+        if (utf8_id.length() < 1) {
+            return Nan::ThrowTypeError("first arg must be a String");
+        }
+        std::string id(*utf8_id);
+
+        langfield_type langfield = ALL_LANGUAGES;
+        if (info.Length() > 2 && !(info[2]->IsNull() || info[2]->IsUndefined())) {
+            if (!info[2]->IsArray()) {
+                return Nan::ThrowTypeError("third arg, if supplied must be an Array");
+            }
+            langfield = langarrayToLangfield(Local<Array>::Cast(info[2]));
+        }
+
+        unsigned array_size = data->Length();
+        auto vec_data = intarray();
+        vec_data.reserve(array_size);
+        for (unsigned i = 0; i < array_size; ++i) {
+            vec_data.emplace_back(static_cast<uint64_t>(data->Get(i)->NumberValue()));
+        }
+
+        CacheBuilder* b = &(node::ObjectWrap::Unwrap<JSCacheBuilder>(info.This())->builder);
+        b->add(std::move(id), vec_data.data(), vec_data.size(), langfield);
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+    info.GetReturnValue().Set(Nan::Undefined());
+    return;
+}
+
+/**
+ * Adds grids for many keys in one call, reading them out of a binary buffer
+ * the same way MemoryCache's `_setBulk` does. Keys are always appended to.
+ *
+ * @name setBulk
+ * @memberof CacheBuilder
+ * @param {String[]} ids
+ * @param {Buffer} data - every key's grids, one after another, as little-endian 64-bit unsigned integers; any typed array or DataView (such as a BigUint64Array) is accepted too
+ * @param {Number[]} lengths - how many of the grids in `data` belong to each id
+ * @param {Array} [languages] - for each id, an array of language IDs, or null for all languages
+ */
+
+NAN_METHOD(JSCacheBuilder::_setBulk) {
+    if (info.Length() < 3) {
+        return Nan::ThrowTypeError("expected at least three info: ids, data, lengths, [languages]");
+    }
+    try {
+        BulkArgs args;
+        if (!bulkArgsFromInfo(info, info.Length(), args)) return;
+
+        CacheBuilder* b = &(node::ObjectWrap::Unwrap<JSCacheBuilder>(info.This())->builder);
+        const char* grids = args.grids;
+        for (size_t i = 0; i < args.keys.size(); i++) {
+            b->add(std::move(args.keys[i]), grids, args.counts[i], args.langfields[i]);
+            grids += args.counts[i] * sizeof(value_type);
+        }
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+    info.GetReturnValue().Set(Nan::Undefined());
+    return;
+}
+
+/**
+ * Merges everything that was added and writes the cache file, which can then
+ * be opened with RocksDBCache. Nothing more can be added afterwards.
+ *
+ * @name finish
+ * @memberof CacheBuilder
+ * @returns {Boolean}
+ */
+
+NAN_METHOD(JSCacheBuilder::finish) {
+    try {
+        CacheBuilder* b = &(node::ObjectWrap::Unwrap<JSCacheBuilder>(info.This())->builder);
+        b->finish();
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+    info.GetReturnValue().Set(true);
+    return;
+}
+
 /**
  * The PhrasematchSubqObject type describes the metadata known about possible matches to be assessed for stacking by
  * coalesce as seen from Javascript. Note: it is of similar purpose to the PhrasematchSubq C++ struct type, but differs
@@ -816,6 +1903,7 @@ extern "C" {
 static void start(Handle<Object> target) {
     JSMemoryCache::Initialize(target);
     JSRocksDBCache::Initialize(target);
+    JSCacheBuilder::Initialize(target);
     Nan::SetMethod(target, "coalesce", JSCoalesce);
 }
 }
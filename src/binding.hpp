@@ -1,6 +1,7 @@
 #ifndef __CARMEN_BINDING_HPP__
 #define __CARMEN_BINDING_HPP__
 
+#include "cachebuilder.hpp"
 #include "coalesce.hpp"
 #include "memorycache.hpp"
 #include "node_util.hpp"
@@ -37,7 +38,13 @@ class JSCache : public node::ObjectWrap {
     static NAN_METHOD(list);
     static NAN_METHOD(_get);
     static NAN_METHOD(_getmatching);
+    static NAN_METHOD(_getBatch);
+    static NAN_METHOD(_getmatchingBatch);
     static NAN_METHOD(_set);
+    static NAN_METHOD(_setBulk);
+    static NAN_METHOD(memoryUsage);
+    static NAN_METHOD(save);
+    static NAN_METHOD(load);
     explicit JSCache();
     void _ref() { Ref(); }
     void _unref() { Unref(); }
@@ -55,10 +62,35 @@ NAN_METHOD(JSCache<carmen::MemoryCache>::New);
 
 template <>
 NAN_METHOD(JSCache<carmen::MemoryCache>::_set);
+template <>
+NAN_METHOD(JSCache<carmen::MemoryCache>::_setBulk);
+template <>
+NAN_METHOD(JSCache<carmen::MemoryCache>::memoryUsage);
+template <>
+NAN_METHOD(JSCache<carmen::RocksDBCache>::memoryUsage);
+template <>
+NAN_METHOD(JSCache<carmen::MemoryCache>::save);
+template <>
+NAN_METHOD(JSCache<carmen::MemoryCache>::load);
 
 using JSRocksDBCache = JSCache<carmen::RocksDBCache>;
 using JSMemoryCache = JSCache<carmen::MemoryCache>;
 
+// wraps a CacheBuilder; unlike the caches it has nothing to read back, so it
+// doesn't share their template
+class JSCacheBuilder : public node::ObjectWrap {
+  public:
+    static Nan::Persistent<v8::FunctionTemplate> constructor;
+    static void Initialize(v8::Handle<v8::Object> target);
+    static NAN_METHOD(New);
+    static NAN_METHOD(_set);
+    static NAN_METHOD(_setBulk);
+    static NAN_METHOD(finish);
+    JSCacheBuilder(std::string const& filename, size_t memory_limit);
+
+    carmen::CacheBuilder builder;
+};
+
 template <class T>
 intarray __get(JSCache<T>* c, const std::string& phrase, langfield_type langfield, size_t max_results);
 template <class T>
@@ -80,6 +112,83 @@ struct CoalesceBaton : carmen::noncopyable {
     std::string error;
 };
 
+enum class LookupKind {
+    get,
+    getmatching,
+    list
+};
+
+// an asynchronous _get, _getMatching or list call
+template <class T>
+struct LookupBaton : carmen::noncopyable {
+    uv_work_t request;
+    JSCache<T>* cache;
+    LookupKind kind;
+    // params
+    std::string phrase;
+    PrefixMatch match_prefixes;
+    langfield_type langfield;
+    size_t max_results;
+    Nan::Persistent<v8::Function> callback;
+    // return
+    intarray grids;
+    std::vector<std::pair<std::string, langfield_type>> keys;
+    // error
+    std::string error;
+};
+
+template <class T>
+void lookupTask(uv_work_t* req);
+template <class T>
+void lookupAfter(uv_work_t* req, int status);
+
+// an asynchronous pack call; progress is handed from the packing threads to
+// the main thread through `async`
+template <class T>
+struct PackBaton : carmen::noncopyable {
+    uv_work_t request;
+    uv_async_t async;
+    JSCache<T>* cache;
+    // params
+    std::string filename;
+    PackOptions pack_options;
+    Nan::Persistent<v8::Function> progress;
+    Nan::Persistent<v8::Function> callback;
+    // the latest progress, not yet passed to the progress callback if pending
+    std::mutex mutex;
+    PackStats stats;
+    bool pending;
+    // error
+    std::string error;
+};
+
+template <class T>
+void packTask(uv_work_t* req);
+template <class T>
+void packAfter(uv_work_t* req, int status);
+
+// an asynchronous _setBulk call
+struct SetBulkBaton : carmen::noncopyable {
+    uv_work_t request;
+    JSMemoryCache* cache;
+    // params
+    std::vector<std::string> keys;
+    std::vector<size_t> counts;
+    std::vector<langfield_type> langfields;
+    bool append;
+    // the grids are read straight out of the JS buffer, which this keeps alive
+    Nan::Persistent<v8::Value> data;
+    const char* grids;
+    Nan::Persistent<v8::Function> callback;
+    // error
+    std::string error;
+};
+
+void setBulkTask(uv_work_t* req);
+void setBulkAfter(uv_work_t* req, int status);
+
+NAN_METHOD(configureRocksDBCache);
+
 NAN_METHOD(JSCoalesce);
 void jsCoalesceTask(uv_work_t* req);
 void jsCoalesceAfter(uv_work_t* req, int status);
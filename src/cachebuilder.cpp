@@ -0,0 +1,318 @@
+#include "cachebuilder.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <queue>
+
+namespace carmen {
+
+namespace {
+
+// a rough allowance for the map node, key and vector that every buffered key
+// costs on top of its grids
+constexpr size_t SORTER_ENTRY_OVERHEAD = 96;
+// the most runs that are read from at once; beyond this, runs are merged in
+// batches first, to stay clear of open file limits
+constexpr size_t SORTER_MAX_MERGE_WIDTH = 64;
+
+// Reads back a run of sorted records, each a key and the encoded message
+// for its grids, both prefixed with their length
+class RunReader : noncopyable {
+  public:
+    explicit RunReader(std::string const& path)
+        : key(),
+          message(),
+          in_(path, std::ios::binary) {
+        if (!in_) throw std::runtime_error("unable to open sorted run " + path);
+    }
+
+    // loads the next record, returning false once there are none left
+    bool next() {
+        return readString(key) && readString(message);
+    }
+
+    std::string key;
+    std::string message;
+
+  private:
+    bool readString(std::string& out) {
+        uint32_t length;
+        if (!in_.read(reinterpret_cast<char*>(&length), sizeof(length))) return false;
+        out.resize(length);
+        if (length > 0 && !in_.read(&out[0], length)) {
+            throw std::runtime_error("sorted run is truncated");
+        }
+        return true;
+    }
+
+    std::ifstream in_;
+};
+
+// Writes a run, in the format RunReader reads; keys have to come in order
+class RunWriter : noncopyable {
+  public:
+    explicit RunWriter(std::string const& path)
+        : path_(path),
+          out_(path, std::ios::binary | std::ios::trunc) {
+        if (!out_) throw std::runtime_error("unable to write sorted run " + path_);
+    }
+
+    void add(std::string const& key, intarray const& grids) {
+        writeString(key);
+        writeString(encodeVec(grids));
+    }
+
+    void finish() {
+        out_.close();
+        if (!out_) throw std::runtime_error("unable to write sorted run " + path_);
+    }
+
+  private:
+    void writeString(std::string const& data) {
+        auto length = static_cast<uint32_t>(data.size());
+        out_.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        out_.write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+
+    std::string path_;
+    std::ofstream out_;
+};
+
+// appends a run's list to `grids`, which holds the lists of the same key from
+// earlier runs, keeping the whole thing in descending order
+void mergeMessage(std::string const& message, intarray& grids) {
+    if (message.empty()) return;
+    auto middle = static_cast<std::ptrdiff_t>(grids.size());
+    decodeMessage(message, grids, std::numeric_limits<size_t>::max());
+    std::inplace_merge(grids.begin(), grids.begin() + middle, grids.end(), std::greater<uint64_t>());
+}
+
+// k-way merge of a set of runs, combining the lists of keys that appear in
+// more than one of them
+void mergeRuns(std::vector<std::string> const& paths, ExternalSorter::EmitFn const& emit) {
+    std::vector<std::unique_ptr<RunReader>> readers;
+    for (std::string const& path : paths) {
+        readers.emplace_back(new RunReader(path));
+    }
+
+    // take the reader with the smallest key next
+    auto greater_key = [&readers](size_t a, size_t b) {
+        return readers[a]->key > readers[b]->key;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater_key)> heap(greater_key);
+    for (size_t i = 0; i < readers.size(); i++) {
+        if (readers[i]->next()) heap.push(i);
+    }
+
+    std::string key;
+    intarray grids;
+    while (!heap.empty()) {
+        size_t idx = heap.top();
+        heap.pop();
+        key.swap(readers[idx]->key);
+        grids.clear();
+        mergeMessage(readers[idx]->message, grids);
+        if (readers[idx]->next()) heap.push(idx);
+
+        // the same key can turn up once in every run
+        while (!heap.empty() && readers[heap.top()]->key == key) {
+            idx = heap.top();
+            heap.pop();
+            mergeMessage(readers[idx]->message, grids);
+            if (readers[idx]->next()) heap.push(idx);
+        }
+        grids.erase(std::unique(grids.begin(), grids.end()), grids.end());
+
+        emit(key, grids);
+    }
+}
+
+} // namespace
+
+ExternalSorter::ExternalSorter(std::string run_prefix, size_t memory_limit)
+    : run_prefix_(std::move(run_prefix)),
+      memory_limit_(memory_limit),
+      buffer_(),
+      buffered_bytes_(0),
+      runs_(),
+      run_count_(0) {}
+
+ExternalSorter::~ExternalSorter() {
+    removeRuns();
+}
+
+void ExternalSorter::add(std::string const& key, const void* grids, size_t count) {
+    if (count == 0) return;
+
+    auto itr = buffer_.find(key);
+    if (itr == buffer_.end()) {
+        itr = buffer_.emplace(key, intarray()).first;
+        buffered_bytes_ += key.size() + SORTER_ENTRY_OVERHEAD;
+    }
+    intarray& varr = itr->second;
+    size_t existing_size = varr.size();
+    varr.resize(existing_size + count);
+    memcpy(&varr[existing_size], grids, count * sizeof(value_type));
+    buffered_bytes_ += count * sizeof(value_type);
+
+    if (buffered_bytes_ >= memory_limit_) spill();
+}
+
+// writes the buffered keys out in order, each with its grids sorted,
+// deduplicated and encoded the same way pack encodes them
+void ExternalSorter::spill() {
+    if (buffer_.empty()) return;
+
+    runs_.push_back(nextRunPath());
+    RunWriter run(runs_.back());
+    for (auto& item : buffer_) {
+        intarray& varr = item.second;
+        std::sort(varr.begin(), varr.end(), std::greater<uint64_t>());
+        varr.erase(std::unique(varr.begin(), varr.end()), varr.end());
+        run.add(item.first, varr);
+    }
+    run.finish();
+
+    buffer_.clear();
+    buffered_bytes_ = 0;
+}
+
+void ExternalSorter::finish(EmitFn const& emit) {
+    // everything fit in memory, so there's nothing to merge
+    if (runs_.empty()) {
+        for (auto& item : buffer_) {
+            intarray& varr = item.second;
+            std::sort(varr.begin(), varr.end(), std::greater<uint64_t>());
+            varr.erase(std::unique(varr.begin(), varr.end()), varr.end());
+            emit(item.first, varr);
+        }
+        buffer_.clear();
+        buffered_bytes_ = 0;
+        return;
+    }
+
+    spill();
+
+    while (runs_.size() > SORTER_MAX_MERGE_WIDTH) {
+        std::vector<std::string> batch(runs_.begin(), runs_.begin() + SORTER_MAX_MERGE_WIDTH);
+        runs_.push_back(nextRunPath());
+        RunWriter run(runs_.back());
+        mergeRuns(batch, [&run](std::string const& key, intarray const& grids) {
+            run.add(key, grids);
+        });
+        run.finish();
+
+        for (std::string const& path : batch) {
+            std::remove(path.c_str());
+        }
+        runs_.erase(runs_.begin(), runs_.begin() + SORTER_MAX_MERGE_WIDTH);
+    }
+
+    mergeRuns(runs_, emit);
+    removeRuns();
+}
+
+std::string ExternalSorter::nextRunPath() {
+    return run_prefix_ + "-" + std::to_string(run_count_++) + ".run";
+}
+
+void ExternalSorter::removeRuns() {
+    for (std::string const& path : runs_) {
+        std::remove(path.c_str());
+    }
+    runs_.clear();
+}
+
+CacheBuilder::CacheBuilder(std::string const& filename, size_t memory_limit)
+    : filename_(filename),
+      memory_limit_(memory_limit),
+      db_(),
+      options_(cacheDBOptions()),
+      keys_(),
+      failed_(false) {
+    options_.create_if_missing = true;
+    rocksdb::Status status = OpenDB(options_, filename_, db_);
+    if (!status.ok()) {
+        throw std::invalid_argument("unable to open rocksdb file for building");
+    }
+    // the sorted runs are spilled into the database directory, next to
+    // where their contents will end up
+    keys_.reset(new ExternalSorter(filename_ + "/build-keys", memory_limit_));
+}
+
+CacheBuilder::~CacheBuilder() = default;
+
+void CacheBuilder::add(std::string key_id, const void* data, size_t length, langfield_type langfield) {
+    if (failed_) throw std::runtime_error("cache failed to build and was removed");
+    if (!keys_) throw std::runtime_error("cache has already been built");
+    add_langfield(key_id, langfield);
+    keys_->add(key_id, data, length);
+}
+
+void CacheBuilder::finish() {
+    if (failed_) throw std::runtime_error("cache failed to build and was removed");
+    if (!keys_) throw std::runtime_error("cache has already been built");
+
+    // the sorted runs are used up as they're read, so whatever happens from
+    // here on, the builder can't be finished again
+    std::unique_ptr<ExternalSorter> keys(std::move(keys_));
+    const std::vector<std::string> sst_paths = {filename_ + "/build-keys.sst", filename_ + "/build-hot.sst", filename_ + "/build-memos.sst"};
+    try {
+        // Keys come out of the sorter in order, so they can be streamed into
+        // an SST file. The memoized prefixes of each key have to be sorted all
+        // over again, which a second sorter does within the same memory limit;
+        // hot prefixes are only held until the keys move past them, so they're
+        // memoized as the keys go by.
+        SstFileSink key_sink(options_, sst_paths[0]);
+        SstFileSink hot_sink(options_, sst_paths[1]);
+        ExternalSorter memos(filename_ + "/build-memos", memory_limit_);
+        auto emit_hot = [&hot_sink](std::string const& key, intarray const& grids) {
+            hot_sink.add(key, encodeVec(grids));
+        };
+        HotPrefixMemoizer hot(emit_hot, PackOptions());
+        std::vector<std::string> memo_keys;
+        keys->finish([&](std::string const& key, intarray const& grids) {
+            key_sink.add(key, encodeVec(grids));
+            PrefixMemoizer::memoKeys(key, memo_keys);
+            for (std::string const& memo_key : memo_keys) {
+                memos.add(memo_key, grids.data(), grids.size());
+            }
+            hot.add(key, grids.data(), grids.size());
+        });
+        hot.finish();
+        keys.reset();
+
+        SstFileSink memo_sink(options_, sst_paths[2]);
+        memos.finish([&memo_sink](std::string const& key, intarray const& grids) {
+            memo_sink.add(key, encodeVec(grids));
+        });
+
+        // the memoized prefixes fall in among the keys, so the two files
+        // overlap and need ingesting separately
+        for (std::string const& file : {key_sink.finish(), memo_sink.finish(), hot_sink.finish()}) {
+            if (file.empty()) continue;
+            rocksdb::Status status = ingestSstFiles(db_, {file});
+            if (!status.ok()) {
+                throw std::runtime_error("unable to ingest built cache: " + status.ToString());
+            }
+        }
+
+        rocksdb::Status status = finishPackedDB(db_, MemoLayout{hot.lengths(), 0}, GridFormat::varint);
+        if (!status.ok()) {
+            throw std::runtime_error("unable to flush built cache: " + status.ToString());
+        }
+    } catch (...) {
+        // Some of the files may already be ingested, and a database holding
+        // the keys without their memos or metadata would open as a complete
+        // cache that answers prefix scans wrongly, so none of it is kept
+        failed_ = true;
+        keys.reset();
+        removeSstFiles(sst_paths);
+        db_.reset();
+        rocksdb::DestroyDB(filename_, options_);
+        throw;
+    }
+    db_.reset();
+}
+
+} // namespace carmen
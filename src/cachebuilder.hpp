@@ -0,0 +1,66 @@
+#ifndef __CARMEN_CACHEBUILDER_HPP__
+#define __CARMEN_CACHEBUILDER_HPP__
+
+#include "cpp_util.hpp"
+
+namespace carmen {
+
+// Sorts (key, grids) records that arrive in any order while holding at most
+// about `memory_limit` bytes of them in memory. Records are buffered until
+// the limit is reached, then spilled to disk as a sorted run; finish() merges
+// the runs back together, combining the grids of keys that were added more
+// than once.
+class ExternalSorter : noncopyable {
+  public:
+    typedef std::function<void(std::string const&, intarray const&)> EmitFn;
+
+    ExternalSorter(std::string run_prefix, size_t memory_limit);
+    ~ExternalSorter();
+
+    // `grids` is read with memcpy, so it can point at unaligned memory
+    void add(std::string const& key, const void* grids, size_t count);
+    // hands every key to `emit` in ascending order, along with all of its
+    // grids sorted in descending order and deduplicated
+    void finish(EmitFn const& emit);
+
+  private:
+    void spill();
+    std::string nextRunPath();
+    void removeRuns();
+
+    std::string run_prefix_;
+    size_t memory_limit_;
+    std::map<key_type, intarray> buffer_;
+    size_t buffered_bytes_;
+    std::vector<std::string> runs_;
+    size_t run_count_;
+};
+
+// Builds a RocksDBCache file from records that can arrive in any order and
+// in any number, without ever holding the whole index in memory the way a
+// MemoryCache does. The output is the same as packing a MemoryCache that had
+// every record appended to it.
+class CacheBuilder : noncopyable {
+  public:
+    CacheBuilder(std::string const& filename, size_t memory_limit);
+    ~CacheBuilder();
+
+    // adds grids to a key; adding to the same key again appends
+    void add(std::string key_id, const void* data, size_t length, langfield_type langfield);
+    // writes everything out; the builder can't be used afterwards. If it
+    // fails, nothing of the cache is left behind, and the builder can't be
+    // used either
+    void finish();
+
+  private:
+    std::string filename_;
+    size_t memory_limit_;
+    std::unique_ptr<rocksdb::DB> db_;
+    rocksdb::Options options_;
+    std::unique_ptr<ExternalSorter> keys_;
+    bool failed_;
+};
+
+} // namespace carmen
+
+#endif // __CARMEN_CACHEBUILDER_HPP__
@@ -83,11 +83,14 @@ inline std::vector<Context> coalesceSingle(std::vector<PhrasematchSubq>& stack,
         maxy = std::numeric_limits<unsigned short>::max();
     }
 
-    // Load and concatenate grids for all ids in `phrases`
+    // Read the grids for all ids in `phrases` as the loop below gets to them:
+    // it usually stops after a few dozen, so there's no use decoding and
+    // merging the rest
     intarray grids;
+    std::unique_ptr<GridCursor> cursor;
     size_t max_results = subq.extended_scan ? std::numeric_limits<size_t>::max() : PREFIX_MAX_GRID_LENGTH;
     if (subq.type == TYPE_MEMORY) {
-        grids = reinterpret_cast<MemoryCache*>(subq.cache)->__getmatching(subq.phrase, subq.prefix, subq.langfield, max_results);
+        cursor = reinterpret_cast<MemoryCache*>(subq.cache)->__getmatchingCursor(subq.phrase, subq.prefix, subq.langfield, max_results);
     } else {
         if (subq.extended_scan && bbox) {
             uint64_t inplace_bbox[4] = {
@@ -95,13 +98,16 @@ inline std::vector<Context> coalesceSingle(std::vector<PhrasematchSubq>& stack,
                 static_cast<uint64_t>((miny & POW2_14M1) << 34),
                 static_cast<uint64_t>((maxx & POW2_14M1) << 20),
                 static_cast<uint64_t>((maxy & POW2_14M1) << 34)};
+            // filtered grids come out of a sort, so they're all read up front
             grids = reinterpret_cast<RocksDBCache*>(subq.cache)->__getmatchingBboxFiltered(subq.phrase, subq.prefix, subq.langfield, max_results, inplace_bbox);
+            std::unique_ptr<MergeCursor<ArraySource>> filtered(new MergeCursor<ArraySource>(grids.size()));
+            filtered->add(std::unique_ptr<ArraySource>(new ArraySource(grids.data(), grids.size(), 0)));
+            cursor = std::move(filtered);
         } else {
-            grids = reinterpret_cast<RocksDBCache*>(subq.cache)->__getmatching(subq.phrase, subq.prefix, subq.langfield, max_results);
+            cursor = reinterpret_cast<RocksDBCache*>(subq.cache)->__getmatchingCursor(subq.phrase, subq.prefix, subq.langfield, max_results);
         }
     }
 
-    unsigned long m = grids.size();
     double relevMax = 0;
     std::vector<Cover> covers;
 
@@ -111,8 +117,9 @@ inline std::vector<Context> coalesceSingle(std::vector<PhrasematchSubq>& stack,
     double lastScoredist = 0;
     double lastDistance = 0;
     double minScoredist = std::numeric_limits<double>::max();
-    for (unsigned long j = 0; j < m; j++) {
-        Cover cover = numToCover(grids[j]);
+    uint64_t grid;
+    while (cursor->next(grid)) {
+        Cover cover = numToCover(grid);
 
         if (bbox) {
             if (cover.x < minx || cover.y < miny || cover.x > maxx || cover.y > maxy) continue;
@@ -163,6 +170,9 @@ inline std::vector<Context> coalesceSingle(std::vector<PhrasematchSubq>& stack,
         lastScoredist = cover.scoredist;
         lastDistance = cover.distance;
     }
+    // let go of whatever the cursor holds on to: pinned blocks, or copies of
+    // a MemoryCache's lists
+    cursor.reset();
 
     // sort grids by distance to proximity point
     std::sort(covers.begin(), covers.end(), coverSortByRelev);
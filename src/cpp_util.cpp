@@ -1,5 +1,13 @@
 
 #include "cpp_util.hpp"
+#include <cstdlib>
+#include <exception>
+#include <iterator>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 namespace carmen {
 
@@ -169,6 +177,36 @@ double scoredist(unsigned zoom, double distance, unsigned short score, double ra
     return ((6 * E_POW[score] / E_POW[7]) + 1) / distRatio;
 }
 
+constexpr int BLOOM_BITS_PER_KEY = 10;
+
+rocksdb::Slice PhrasePrefixTransform::Transform(const rocksdb::Slice& key) const {
+    const char* separator = static_cast<const char*>(memchr(key.data(), LANGFIELD_SEPARATOR, key.size()));
+    // RocksDB only asks for the prefix of keys InDomain accepts, but a key
+    // without a separator is its own prefix rather than a read past its end
+    if (separator == nullptr) return key;
+    return rocksdb::Slice(key.data(), static_cast<size_t>(separator - key.data()) + 1);
+}
+
+bool PhrasePrefixTransform::InDomain(const rocksdb::Slice& key) const {
+    return memchr(key.data(), LANGFIELD_SEPARATOR, key.size()) != nullptr;
+}
+
+rocksdb::Options cacheDBOptions(std::shared_ptr<rocksdb::Cache> const& block_cache) {
+    rocksdb::Options options;
+    options.prefix_extractor = std::make_shared<PhrasePrefixTransform>();
+
+    rocksdb::BlockBasedTableOptions table_options;
+    // full rather than block-based filters, which also take the prefixes
+    table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(BLOOM_BITS_PER_KEY, false));
+    table_options.whole_key_filtering = true;
+    if (block_cache) {
+        table_options.block_cache = block_cache;
+        table_options.cache_index_and_filter_blocks = true;
+    }
+    options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+    return options;
+}
+
 // Open database for read-write availability
 rocksdb::Status OpenDB(const rocksdb::Options& options, const std::string& name, std::unique_ptr<rocksdb::DB>& dbptr) {
     rocksdb::DB* db;
@@ -185,4 +223,568 @@ rocksdb::Status OpenForReadOnlyDB(const rocksdb::Options& options, const std::st
     return status;
 }
 
+// how many keys and prefixes are written between progress reports
+constexpr uint64_t PACK_PROGRESS_INTERVAL = 1 << 16;
+
+PackProgress::PackProgress(PackProgressFn const& progress)
+    : progress_(progress),
+      keys_(0),
+      prefixes_(0),
+      bytes_(0) {}
+
+void PackProgress::add(std::atomic<uint64_t>& counter, size_t bytes) {
+    bytes_ += bytes;
+    uint64_t count = ++counter;
+    if (progress_ && count % PACK_PROGRESS_INTERVAL == 0) progress_(stats());
+}
+
+void PackProgress::finish() {
+    if (progress_) progress_(stats());
+}
+
+PackStats PackProgress::stats() const {
+    return PackStats{keys_.load(), prefixes_.load(), bytes_.load()};
+}
+
+void runThreads(unsigned threads, std::function<void(unsigned)> const& work) {
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&work, &errors, t]() {
+            try {
+                work(t);
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+        });
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (auto& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+}
+
+SstFileSink::SstFileSink(const rocksdb::Options& options, std::string path)
+    : writer_(rocksdb::EnvOptions(), options),
+      path_(std::move(path)),
+      opened_(false) {}
+
+void SstFileSink::add(rocksdb::Slice const& key, rocksdb::Slice const& message) {
+    if (!opened_) {
+        rocksdb::Status status = writer_.Open(path_);
+        if (!status.ok()) throw std::runtime_error("unable to open sst file for packing: " + status.ToString());
+        opened_ = true;
+    }
+    rocksdb::Status status = writer_.Add(key, message);
+    if (!status.ok()) throw std::runtime_error("unable to write sst file for packing: " + status.ToString());
+}
+
+std::string SstFileSink::finish() {
+    if (!opened_) return std::string();
+    rocksdb::Status status = writer_.Finish();
+    if (!status.ok()) throw std::runtime_error("unable to finish sst file for packing: " + status.ToString());
+    return path_;
+}
+
+CellSink::CellSink(const rocksdb::Options& options, std::string path, PackProgress& progress)
+    : sink_(options, std::move(path)),
+      progress_(progress),
+      prefix_(),
+      pending_() {}
+
+void CellSink::add(rocksdb::Slice const& key, std::vector<std::pair<std::string, std::string>>& cells) {
+    if (cells.empty()) return;
+    std::string prefix = spatialPrefix(key);
+    if (prefix != prefix_) {
+        flush();
+        prefix_.swap(prefix);
+    }
+    std::move(cells.begin(), cells.end(), std::back_inserter(pending_));
+    cells.clear();
+}
+
+void CellSink::flush() {
+    std::sort(pending_.begin(), pending_.end());
+    for (auto const& cell : pending_) {
+        sink_.add(cell.first, cell.second);
+        progress_.addCell(cell.first.size() + cell.second.size());
+    }
+    pending_.clear();
+}
+
+std::string CellSink::finish() {
+    flush();
+    return sink_.finish();
+}
+
+std::vector<std::string> writeSstFiles(const rocksdb::Options& options, const std::string& dirname, const std::string& tag, size_t count, unsigned threads, SstEntryFn const& entry) {
+    if (threads < 1) threads = 1;
+    size_t range_size = (count + threads - 1) / threads;
+    std::vector<std::string> paths;
+    for (unsigned t = 0; t < threads; t++) {
+        paths.emplace_back(dirname + "/" + tag + "-" + std::to_string(t) + ".sst");
+    }
+    std::vector<std::string> files(threads);
+
+    try {
+        runThreads(threads, [&](unsigned t) {
+            size_t begin = std::min(count, t * range_size);
+            size_t end = std::min(count, begin + range_size);
+            SstFileSink sink(options, paths[t]);
+
+            std::string key;
+            std::string message;
+            for (size_t i = begin; i < end; i++) {
+                key.clear();
+                message.clear();
+                if (entry(t, i, key, message)) sink.add(key, message);
+            }
+            files[t] = sink.finish();
+        });
+    } catch (...) {
+        // the threads that did finish leave whole files behind, and the
+        // others whatever they had written
+        removeSstFiles(paths);
+        throw;
+    }
+
+    files.erase(std::remove(files.begin(), files.end(), std::string()), files.end());
+    return files;
+}
+
+rocksdb::Status ingestSstFiles(std::unique_ptr<rocksdb::DB> const& db, const std::vector<std::string>& files) {
+    if (files.empty()) return rocksdb::Status::OK();
+
+    rocksdb::IngestExternalFileOptions ingest_options;
+    // the files were written next to the database, so hard-link them in
+    // rather than copying, and let rocksdb remove the originals
+    ingest_options.move_files = true;
+    rocksdb::Status status = db->IngestExternalFile(files, ingest_options);
+    if (!status.ok()) removeSstFiles(files);
+    return status;
+}
+
+void removeSstFiles(const std::vector<std::string>& files) {
+    rocksdb::Env* env = rocksdb::Env::Default();
+    for (std::string const& file : files) {
+        // a file that was never created can't be deleted, which is fine
+        if (!file.empty()) env->DeleteFile(file);
+    }
+}
+
+namespace {
+
+// Each delta in a block is stored in as few bytes as hold it, from 0 to 8,
+// least significant first. The lengths are kept apart from the data, two to
+// a control byte with the first in the low nibble, in the manner of Stream
+// VByte: that way SSSE3 can decode a pair of deltas with one shuffle looked
+// up by its control byte, instead of finding where each one ends.
+struct DeltaTables {
+    // how many data bytes a control byte covers, or 0xff if it is invalid
+    uint8_t lengths[256];
+    // shuffles that spread those bytes over two 64-bit lanes
+    alignas(16) uint8_t shuffles[256][16];
+
+    DeltaTables() {
+        for (unsigned control = 0; control < 256; control++) {
+            unsigned low = control & 0xf;
+            unsigned high = control >> 4;
+            lengths[control] = (low > 8 || high > 8) ? 0xff : static_cast<uint8_t>(low + high);
+            for (unsigned i = 0; i < 8; i++) {
+                shuffles[control][i] = i < low ? static_cast<uint8_t>(i) : 0x80;
+                shuffles[control][8 + i] = i < high ? static_cast<uint8_t>(low + i) : 0x80;
+            }
+        }
+    }
+};
+
+DeltaTables const& deltaTables() {
+    static DeltaTables const tables;
+    return tables;
+}
+
+// The decoders below set out[i] to the i'th of `count` deltas, reading their
+// lengths from `control` and their bytes from `data`. The data has been
+// checked to lie within the message, which ends at `end`.
+typedef void (*DecodeDeltasFn)(const unsigned char* control, const char* data, const char* end, size_t count, uint64_t* out);
+
+void decodeDeltasScalar(const unsigned char* control, const char* data, const char* /* end */, size_t count, uint64_t* out) {
+    for (size_t i = 0; i < count; i++) {
+        unsigned length = (i % 2 == 0) ? (control[i / 2] & 0xfu) : (control[i / 2] >> 4u);
+        uint64_t delta = 0;
+        for (unsigned byte = 0; byte < length; byte++) {
+            delta |= static_cast<uint64_t>(static_cast<unsigned char>(data[byte])) << (8 * byte);
+        }
+        out[i] = delta;
+        data += length;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// x86 is little-endian, so each shuffled lane is already the delta. A pair
+// loads 16 bytes whatever its length, so the last few pairs before the end of
+// the message are left to the scalar decoder.
+__attribute__((target("ssse3"))) void decodeDeltasSSSE3(const unsigned char* control, const char* data, const char* end, size_t count, uint64_t* out) {
+    DeltaTables const& tables = deltaTables();
+    size_t i = 0;
+    for (; i + 2 <= count && end - data >= 16; i += 2, control++) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        __m128i shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>(tables.shuffles[*control]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_shuffle_epi8(bytes, shuffle));
+        data += tables.lengths[*control];
+    }
+    decodeDeltasScalar(control, data, end, count - i, out + i);
+}
+
+#endif
+
+// picks the shuffle decoder if this CPU has it
+DecodeDeltasFn selectDecodeDeltas() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) return decodeDeltasSSSE3;
+#endif
+    return decodeDeltasScalar;
+}
+
+} // namespace
+
+std::string encodeBlocks(value_type const* grids, size_t count) {
+    std::string message;
+    auto out = std::back_inserter(message);
+    protozero::write_varint(out, count);
+
+    for (size_t start = 0; start < count; start += GRID_BLOCK_SIZE) {
+        size_t end = std::min(count, start + GRID_BLOCK_SIZE);
+        protozero::write_varint(out, grids[start]);
+
+        // the control bytes are filled in as the deltas are written after them
+        size_t deltas = end - start - 1;
+        size_t control = message.size();
+        message.append((deltas + 1) / 2, '\0');
+        for (size_t i = 0; i < deltas; i++) {
+            uint64_t delta = grids[start + i] - grids[start + i + 1];
+            unsigned length = 0;
+            while (length < sizeof(delta) && (delta >> (8 * length)) != 0) {
+                message.push_back(static_cast<char>((delta >> (8 * length)) & 0xff));
+                length++;
+            }
+            message[control + i / 2] = static_cast<char>(static_cast<unsigned char>(message[control + i / 2]) | (length << (4 * (i % 2))));
+        }
+    }
+    return message;
+}
+
+GridBlockReader::GridBlockReader(rocksdb::Slice const& message)
+    : pos_(message.data()),
+      end_(message.data() + message.size()),
+      count_(0),
+      remaining_(0),
+      size_(0) {
+    if (pos_ != end_) count_ = static_cast<size_t>(protozero::decode_varint(&pos_, end_));
+    remaining_ = count_;
+}
+
+bool GridBlockReader::next() {
+    static DecodeDeltasFn const decode_deltas = selectDecodeDeltas();
+    DeltaTables const& tables = deltaTables();
+
+    if (remaining_ == 0) return false;
+    size_ = std::min(remaining_, GRID_BLOCK_SIZE);
+    remaining_ -= size_;
+
+    block_[0] = protozero::decode_varint(&pos_, end_);
+    if (size_ == 1) return true;
+
+    size_t deltas = size_ - 1;
+    size_t controls = (deltas + 1) / 2;
+    if (static_cast<size_t>(end_ - pos_) < controls) throw std::runtime_error("grid block is truncated");
+    auto control = reinterpret_cast<const unsigned char*>(pos_);
+    pos_ += controls;
+
+    // the lengths are checked up front, so that the decoders needn't
+    size_t bytes = 0;
+    for (size_t i = 0; i < controls; i++) {
+        if (tables.lengths[control[i]] == 0xff) throw std::runtime_error("grid block is corrupt");
+        bytes += tables.lengths[control[i]];
+    }
+    if (deltas % 2 == 1 && (control[controls - 1] >> 4u) != 0) throw std::runtime_error("grid block is corrupt");
+    if (static_cast<size_t>(end_ - pos_) < bytes) throw std::runtime_error("grid block is truncated");
+
+    // the deltas are decoded in bulk, which is what benefits from SIMD, and
+    // then subtracted one after the other
+    decode_deltas(control, pos_, end_, deltas, block_ + 1);
+    pos_ += bytes;
+    for (size_t i = 1; i < size_; i++) {
+        block_[i] = block_[i - 1] - block_[i];
+    }
+    return true;
+}
+
+rocksdb::Status finishPackedDB(std::unique_ptr<rocksdb::DB> const& db, MemoLayout const& layout, GridFormat format) {
+    rocksdb::Status status = db->Put(rocksdb::WriteOptions(), MEMO_TIERS_KEY, encodeMemoLengths(layout.hot_lengths));
+    // uncapped caches leave the key out, the same as older ones
+    if (status.ok() && layout.max_grids > 0) {
+        status = db->Put(rocksdb::WriteOptions(), MEMO_CAP_KEY, std::to_string(layout.max_grids));
+    }
+    // and so do caches in the varint format
+    if (status.ok() && format != GridFormat::varint) {
+        status = db->Put(rocksdb::WriteOptions(), GRID_FORMAT_KEY, std::to_string(static_cast<unsigned>(format)));
+    }
+    if (!status.ok()) return status;
+    return db->Flush(rocksdb::FlushOptions());
+}
+
+MemoLayout readMemoLayout(rocksdb::DB& db) {
+    MemoLayout layout{0, 0};
+    std::string message;
+    if (db.Get(rocksdb::ReadOptions(), MEMO_TIERS_KEY, &message).ok()) {
+        layout.hot_lengths = decodeMemoLengths(message);
+    }
+    if (db.Get(rocksdb::ReadOptions(), MEMO_CAP_KEY, &message).ok()) {
+        layout.max_grids = static_cast<size_t>(std::strtoull(message.c_str(), nullptr, 10));
+    }
+    return layout;
+}
+
+GridFormat readGridFormat(rocksdb::DB& db) {
+    std::string message;
+    if (!db.Get(rocksdb::ReadOptions(), GRID_FORMAT_KEY, &message).ok()) return GridFormat::varint;
+    unsigned long format = std::strtoul(message.c_str(), nullptr, 10);
+    if (format != static_cast<unsigned>(GridFormat::varint) && format != static_cast<unsigned>(GridFormat::blocks)) {
+        throw std::runtime_error("unsupported grid format " + message + "; the cache was packed by a newer version of carmen-cache");
+    }
+    return static_cast<GridFormat>(format);
+}
+
+namespace {
+
+// the number of cells the (sorted) tile codes of a list fall into at a shift
+size_t countCells(std::vector<uint32_t> const& tiles, unsigned shift) {
+    size_t cells = 0;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        if (i == 0 || (tiles[i] >> (2 * shift)) != (tiles[i - 1] >> (2 * shift))) cells++;
+    }
+    return cells;
+}
+
+} // namespace
+
+void addSpatialCopy(PackOptions const& pack_options, rocksdb::Slice const& key, value_type const* grids, size_t count, std::string& message, std::vector<std::pair<std::string, std::string>>& cells) {
+    if (pack_options.spatial_min_grids == 0 || count < pack_options.spatial_min_grids) return;
+
+    std::vector<uint32_t> tiles(count);
+    for (size_t i = 0; i < count; i++) {
+        tiles[i] = gridTile(grids[i]);
+    }
+    std::vector<uint32_t> sorted(tiles);
+    std::sort(sorted.begin(), sorted.end());
+
+    // the smallest cells that keep to SPATIAL_MAX_CELLS; at a shift of 14
+    // everything is in one cell, which is no use to anyone
+    unsigned shift = 0;
+    while (countCells(sorted, shift) > SPATIAL_MAX_CELLS) {
+        shift++;
+    }
+    if (countCells(sorted, shift) < 2) return;
+
+    // grids are added in the order they come in, so each cell stays sorted
+    std::map<uint32_t, intarray> split;
+    for (size_t i = 0; i < count; i++) {
+        split[tiles[i] >> (2 * shift)].push_back(grids[i]);
+    }
+    std::string prefix = spatialPrefix(key);
+    rocksdb::Slice langfield = langfieldBytes(key);
+    for (auto const& cell : split) {
+        std::string cell_key(prefix);
+        appendCell(cell_key, cell.first);
+        cell_key.append(langfield.data(), langfield.size());
+        cells.emplace_back(std::move(cell_key), encodeGrids(pack_options, cell.second));
+    }
+    protozero::pbf_writer(message).add_uint64(CACHE_CELLS, shift);
+}
+
+PrefixMemoizer::PrefixMemoizer(EmitFn emit, PackOptions const& pack_options)
+    : emit_(emit),
+      tiers_(),
+      max_grids_(pack_options.memo_max_grids),
+      hot_(emit, pack_options) {
+    tiers_.push_back(Tier{"=1", MEMO_PREFIX_LENGTH_T1, std::string(), std::map<key_type, intarray>()});
+    tiers_.push_back(Tier{"=2", MEMO_PREFIX_LENGTH_T2, std::string(), std::map<key_type, intarray>()});
+}
+
+// finds the end of the phrase in a key, which is where its langfield starts
+inline size_t phraseLength(rocksdb::Slice const& key) {
+    const void* separator = memchr(key.data(), LANGFIELD_SEPARATOR, key.size());
+    return separator == nullptr ? key.size() : static_cast<size_t>(static_cast<const char*>(separator) - key.data());
+}
+
+void PrefixMemoizer::add(rocksdb::Slice const& key, value_type const* grids, size_t count) {
+    size_t phrase_length = phraseLength(key);
+
+    for (Tier& tier : tiers_) {
+        // phrases shorter than the first tier only get a first-tier entry
+        if (&tier != &tiers_.front() && phrase_length < tiers_.front().length) continue;
+
+        // use the full phrase for things shorter than the limit or the prefix
+        // otherwise, then append the langfield back onto it again
+        size_t group_length = std::min(phrase_length, tier.length);
+        if (tier.group.compare(0, std::string::npos, key.data(), group_length) != 0) {
+            flush(tier);
+            tier.group.assign(key.data(), group_length);
+        }
+
+        std::string prefix = tier.tag + tier.group;
+        prefix.append(key.data() + phrase_length, key.size() - phrase_length);
+
+        intarray& buf = tier.buffers[prefix];
+        buf.insert(buf.end(), grids, grids + count);
+    }
+
+    hot_.add(key, grids, count);
+}
+
+void PrefixMemoizer::finish() {
+    for (Tier& tier : tiers_) {
+        flush(tier);
+    }
+    hot_.finish();
+}
+
+void PrefixMemoizer::flush(Tier& tier) {
+    for (auto& item : tier.buffers) {
+        intarray& varr = item.second;
+
+        // delta-encode values, sorted in descending order.
+        std::sort(varr.begin(), varr.end(), std::greater<uint64_t>());
+        // remove duplicates
+        varr.erase(std::unique(varr.begin(), varr.end()), varr.end());
+        if (max_grids_ > 0 && varr.size() > max_grids_) varr.resize(max_grids_);
+
+        emit_(item.first, varr);
+    }
+    tier.buffers.clear();
+}
+
+bool PrefixMemoizer::sameGroup(rocksdb::Slice const& a, rocksdb::Slice const& b) {
+    size_t a_length = std::min(phraseLength(a), static_cast<size_t>(MEMO_PREFIX_LENGTH_T1));
+    size_t b_length = std::min(phraseLength(b), static_cast<size_t>(MEMO_PREFIX_LENGTH_T1));
+    return a_length == b_length && memcmp(a.data(), b.data(), a_length) == 0;
+}
+
+void PrefixMemoizer::memoKeys(rocksdb::Slice const& key, std::vector<std::string>& out) {
+    size_t phrase_length = phraseLength(key);
+    out.clear();
+
+    out.emplace_back("=1");
+    out.back().append(key.data(), std::min(phrase_length, static_cast<size_t>(MEMO_PREFIX_LENGTH_T1)));
+    out.back().append(key.data() + phrase_length, key.size() - phrase_length);
+
+    if (phrase_length >= MEMO_PREFIX_LENGTH_T1) {
+        out.emplace_back("=2");
+        out.back().append(key.data(), std::min(phrase_length, static_cast<size_t>(MEMO_PREFIX_LENGTH_T2)));
+        out.back().append(key.data() + phrase_length, key.size() - phrase_length);
+    }
+}
+
+HotPrefixMemoizer::HotPrefixMemoizer(EmitFn emit, PackOptions const& pack_options)
+    : emit_(std::move(emit)),
+      min_keys_(pack_options.memo_min_keys),
+      min_grids_(pack_options.memo_min_grids),
+      max_grids_(pack_options.memo_max_grids),
+      phrase_(),
+      groups_(),
+      entries_(),
+      grids_(),
+      memos_(),
+      lengths_(0) {}
+
+void HotPrefixMemoizer::add(rocksdb::Slice const& key, value_type const* grids, size_t count) {
+    size_t phrase_length = phraseLength(key);
+
+    // the candidates this phrase doesn't share with the last one are done
+    size_t shared = 0;
+    size_t shared_limit = std::min(phrase_length, phrase_.size());
+    while (shared < shared_limit && key[shared] == phrase_[shared]) {
+        shared++;
+    }
+    while (!groups_.empty() && MEMO_PREFIX_LENGTH_T2 + groups_.size() > shared) {
+        close();
+    }
+    phrase_.assign(key.data(), phrase_length);
+
+    // and its longer prefixes are new ones
+    size_t candidates = std::min(phrase_length, static_cast<size_t>(MEMO_PREFIX_MAX_LENGTH));
+    while (MEMO_PREFIX_LENGTH_T2 + groups_.size() < candidates) {
+        groups_.push_back(Group{entries_.size(), grids_.size()});
+    }
+    if (groups_.empty()) return;
+
+    entries_.push_back(Entry{std::string(key.data() + phrase_length, key.size() - phrase_length), grids_.size(), grids_.size() + count});
+    grids_.insert(grids_.end(), grids, grids + count);
+}
+
+void HotPrefixMemoizer::finish() {
+    while (!groups_.empty()) {
+        close();
+    }
+}
+
+// decides whether the longest candidate is hot, memoizing it if so
+void HotPrefixMemoizer::close() {
+    Group group = groups_.back();
+    groups_.pop_back();
+    size_t length = MEMO_PREFIX_LENGTH_T2 + groups_.size() + 1;
+
+    size_t keys = entries_.size() - group.entries_begin;
+    size_t grids = grids_.size() - group.grids_begin;
+    if ((min_keys_ > 0 && keys >= min_keys_) || (min_grids_ > 0 && grids >= min_grids_)) {
+        lengths_ |= uint64_t(1) << length;
+        std::string prefix = "=+" + phrase_.substr(0, length);
+        for (size_t i = group.entries_begin; i < entries_.size(); i++) {
+            Entry const& entry = entries_[i];
+            intarray& varr = memos_[prefix + entry.langfield];
+            varr.insert(varr.end(), grids_.begin() + static_cast<std::ptrdiff_t>(entry.grids_begin), grids_.begin() + static_cast<std::ptrdiff_t>(entry.grids_end));
+        }
+    }
+
+    // longer prefixes close first, but can sort after shorter ones, so the
+    // memos are only emitted once the shortest candidate is done
+    if (groups_.empty()) {
+        for (auto& item : memos_) {
+            intarray& varr = item.second;
+            std::sort(varr.begin(), varr.end(), std::greater<uint64_t>());
+            varr.erase(std::unique(varr.begin(), varr.end()), varr.end());
+            if (max_grids_ > 0 && varr.size() > max_grids_) varr.resize(max_grids_);
+            emit_(item.first, varr);
+        }
+        memos_.clear();
+        entries_.clear();
+        grids_.clear();
+    }
+}
+
+std::string encodeMemoLengths(uint64_t lengths) {
+    std::string message;
+    for (unsigned length = 0; length < 64; length++) {
+        if (lengths & (uint64_t(1) << length)) message.push_back(static_cast<char>(length));
+    }
+    return message;
+}
+
+uint64_t decodeMemoLengths(rocksdb::Slice const& message) {
+    uint64_t lengths = 0;
+    for (size_t i = 0; i < message.size(); i++) {
+        auto length = static_cast<unsigned char>(message[i]);
+        if (length < 64) lengths |= uint64_t(1) << length;
+    }
+    return lengths;
+}
+
 } // namespace carmen
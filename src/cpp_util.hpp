@@ -13,18 +13,34 @@
 #pragma clang diagnostic ignored "-Wsign-conversion"
 #pragma clang diagnostic ignored "-Wshorten-64-to-32"
 
+#include "rocksdb/cache.h"
 #include "rocksdb/db.h"
+#include "rocksdb/filter_policy.h"
+#include "rocksdb/slice_transform.h"
+#include "rocksdb/sst_file_writer.h"
+#include "rocksdb/table.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
+#include <functional>
+#include <limits>
 #include <map>
 #include <protozero/pbf_reader.hpp>
 #include <protozero/pbf_writer.hpp>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 #pragma clang diagnostic pop
 
+// this is an external library, so squash this warning
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#include "radix_max_heap.h"
+#pragma clang diagnostic pop
+
 namespace carmen {
 
 typedef std::string key_type;
@@ -33,7 +49,6 @@ typedef unsigned __int128 langfield_type;
 // fully cached item
 typedef std::vector<value_type> intarray;
 typedef std::vector<key_type> keyarray;
-typedef std::map<key_type, intarray> arraycache;
 
 class noncopyable {
   protected:
@@ -266,9 +281,10 @@ inline void add_langfield(std::string& s, langfield_type langfield) {
 //
 // we centralize both the adding of the field and extracting of the field here to keep from having
 // to handle that optimization everywhere
-inline langfield_type extract_langfield(std::string const& s) {
-    size_t length = s.length();
-    size_t langfield_start = s.find(LANGFIELD_SEPARATOR) + 1;
+inline langfield_type extract_langfield(rocksdb::Slice const& s) {
+    size_t length = s.size();
+    const void* separator = memchr(s.data(), LANGFIELD_SEPARATOR, length);
+    size_t langfield_start = separator == nullptr ? 0 : static_cast<size_t>(static_cast<const char*>(separator) - s.data()) + 1;
     size_t distance_from_end = length - langfield_start;
 
     if (distance_from_end == 0) {
@@ -280,7 +296,10 @@ inline langfield_type extract_langfield(std::string const& s) {
     }
 }
 
-inline void packVec(intarray const& varr, std::unique_ptr<rocksdb::DB> const& db, std::string const& key) {
+// delta-encodes a list of grids, sorted in descending order, into the
+// protobuf message format we store as rocksdb values
+template <typename Array>
+inline std::string encodeVec(Array const& varr) {
     std::string message;
 
     protozero::pbf_writer item_writer(message);
@@ -300,9 +319,813 @@ inline void packVec(intarray const& varr, std::unique_ptr<rocksdb::DB> const& db
         }
     }
 
-    db->Put(rocksdb::WriteOptions(), key, message);
+    return message;
+}
+
+#define CACHE_MESSAGE 1
+#define CACHE_ITEM 1
+#define CACHE_INDEX 2
+#define CACHE_CELLS 3
+
+// A skip index splits a list into blocks of SKIP_INDEX_BLOCK_SIZE grids and
+// records, for each block, SKIP_INDEX_ENTRY_SIZE varints in a packed
+// CACHE_INDEX field after the grids: the byte offset of the block within
+// the packed grids, relative to the previous block; its number of grids;
+// its first grid, so that decoding can start there; and the smallest and
+// largest tile x and y in it. Readers that don't know about the field skip
+// it, and lists no longer than one block never get one.
+constexpr size_t SKIP_INDEX_BLOCK_SIZE = 128;
+constexpr size_t SKIP_INDEX_ENTRY_SIZE = 7;
+
+inline size_t varintLength(uint64_t value) {
+    size_t length = 1;
+    for (; value >= 0x80; value >>= 7) {
+        length++;
+    }
+    return length;
+}
+
+// encodes a list the way encodeVec does, adding a skip index if it's long
+// enough to need one
+template <typename Array>
+inline std::string encodeIndexedVec(Array const& varr) {
+    std::string message = encodeVec(varr);
+    if (varr.size() <= SKIP_INDEX_BLOCK_SIZE) return message;
+
+    std::vector<uint64_t> index;
+    index.reserve((varr.size() / SKIP_INDEX_BLOCK_SIZE + 1) * SKIP_INDEX_ENTRY_SIZE);
+    uint64_t lastval = 0;
+    size_t offset = 0;
+    size_t last_offset = 0;
+    for (size_t start = 0; start < varr.size(); start += SKIP_INDEX_BLOCK_SIZE) {
+        size_t end = std::min(varr.size(), start + SKIP_INDEX_BLOCK_SIZE);
+        uint64_t min_x = POW2_14M1, max_x = 0, min_y = POW2_14M1, max_y = 0;
+        size_t block_offset = offset;
+        for (size_t i = start; i < end; i++) {
+            uint64_t grid = static_cast<uint64_t>(varr[i]);
+            offset += varintLength(lastval == 0 ? grid : lastval - grid);
+            lastval = grid;
+            uint64_t x = (grid & X_MASK) >> 20;
+            uint64_t y = (grid & Y_MASK) >> 34;
+            min_x = std::min(min_x, x);
+            max_x = std::max(max_x, x);
+            min_y = std::min(min_y, y);
+            max_y = std::max(max_y, y);
+        }
+        index.insert(index.end(), {block_offset - last_offset, end - start, static_cast<uint64_t>(varr[start]), min_x, max_x, min_y, max_y});
+        last_offset = block_offset;
+    }
+
+    protozero::pbf_writer item_writer(message);
+    item_writer.add_packed_uint64(CACHE_INDEX, index.begin(), index.end());
+    return message;
+}
+
+// Packed varints are decoded a 64-bit word at a time rather than a byte at
+// a time: the first byte without a continuation bit gives the length of a
+// varint, and the 7-bit groups of up to 8 bytes are squeezed together
+// without branching. Grids take at most 53 bits, so longer varints are rare
+// and go through protozero, as do the last few bytes of a field.
+inline uint64_t squeezeVarint(uint64_t word) {
+    word &= 0x7f7f7f7f7f7f7f7fULL;
+    word = (word & 0x007f007f007f007fULL) | ((word & 0x7f007f007f007f00ULL) >> 1);
+    word = (word & 0x00003fff00003fffULL) | ((word & 0x3fff00003fff0000ULL) >> 2);
+    return (word & 0x000000000fffffffULL) | ((word & 0x0fffffff00000000ULL) >> 4);
+}
+
+inline uint64_t readVarint(const char*& data, const char* end) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (end - data >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        uint64_t stops = ~word & 0x8080808080808080ULL;
+        if (stops != 0) {
+            // the bits up to and including the last byte of the varint
+            auto bits = static_cast<unsigned>(__builtin_ctzll(stops)) + 1;
+            data += bits / 8;
+            return squeezeVarint(word & (~0ULL >> (64 - bits)));
+        }
+    }
+#endif
+    return protozero::decode_varint(&data, end);
+}
+
+// the number of varints in a packed field, which is the number of bytes
+// without a continuation bit
+inline size_t countVarints(const char* data, const char* end) {
+    size_t count = 0;
+    for (; end - data >= 8; data += 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        count += static_cast<size_t>(__builtin_popcountll(~word & 0x8080808080808080ULL));
+    }
+    for (; data != end; ++data) {
+        if (!(*data & 0x80)) count++;
+    }
+    return count;
+}
+
+// Where the grids of a protobuf message are, its skip index if it has one,
+// and the cell size of its spatial copy if it has one
+struct PackedGrids {
+    explicit PackedGrids(rocksdb::Slice const& message)
+        : data(nullptr),
+          end(nullptr),
+          index(nullptr),
+          index_end(nullptr),
+          cell_shift(-1) {
+        protozero::pbf_reader item(message.data(), message.size());
+        while (item.next()) {
+            if (item.tag() == CACHE_ITEM) {
+                auto field = item.get_view();
+                data = field.data();
+                end = data + field.size();
+            } else if (item.tag() == CACHE_INDEX) {
+                auto field = item.get_view();
+                index = field.data();
+                index_end = index + field.size();
+            } else if (item.tag() == CACHE_CELLS) {
+                cell_shift = static_cast<int>(item.get_uint64());
+            } else {
+                item.skip();
+            }
+        }
+    }
+
+    const char* data;
+    const char* end;
+    const char* index;
+    const char* index_end;
+    int cell_shift;
+};
+
+// A block of grids as described by a skip index, with its tile extent
+// shifted into the positions x and y occupy in a grid
+struct GridIndexBlock {
+    size_t offset;
+    size_t count;
+    uint64_t first;
+    uint64_t min_x;
+    uint64_t max_x;
+    uint64_t min_y;
+    uint64_t max_y;
+};
+
+// reads the next block of a skip index, keeping track of its offset
+inline GridIndexBlock readIndexBlock(const char*& index, const char* index_end, size_t offset) {
+    GridIndexBlock block;
+    block.offset = offset + static_cast<size_t>(readVarint(index, index_end));
+    block.count = static_cast<size_t>(readVarint(index, index_end));
+    block.first = readVarint(index, index_end);
+    block.min_x = readVarint(index, index_end) << 20;
+    block.max_x = readVarint(index, index_end) << 20;
+    block.min_y = readVarint(index, index_end) << 34;
+    block.max_y = readVarint(index, index_end) << 34;
+    return block;
+}
+
+// delta-decodes up to `count` varints following `lastval` into `out`; see
+// decodePackedGrids
+template <typename Keep>
+inline value_type* decodeDeltas(const char* data, const char* end, size_t count, uint64_t lastval, value_type* out, value_type* out_end, uint64_t boost, Keep const& keep) {
+    for (; count > 0 && data != end && out != out_end; count--) {
+        uint64_t delta = readVarint(data, end);
+        lastval = lastval == 0 ? delta : lastval - delta;
+        *out = lastval | boost;
+        if (keep(lastval)) ++out;
+    }
+    return out;
+}
+
+// Delta-decodes up to `limit` grids of a protobuf message onto the end of
+// `array`, setting the bits in `boost` on each of them and leaving out any
+// that `keep` rejects. The array is sized up front from the number of
+// grids, so they're written straight into it. If the list has a skip index,
+// blocks that `keep_block` rejects aren't decoded at all.
+template <typename Keep, typename KeepBlock>
+inline void decodePackedGrids(rocksdb::Slice const& message, intarray& array, size_t limit, uint64_t boost, Keep const& keep, KeepBlock const& keep_block) {
+    PackedGrids grids(message);
+    size_t start = array.size();
+    if (grids.data == nullptr || start >= limit) return;
+
+    if (grids.index == nullptr) {
+        array.resize(start + std::min(countVarints(grids.data, grids.end), limit - start));
+        value_type* out = decodeDeltas(grids.data, grids.end, std::numeric_limits<size_t>::max(), 0, array.data() + start, array.data() + array.size(), boost, keep);
+        array.resize(static_cast<size_t>(out - array.data()));
+        return;
+    }
+
+    size_t count = 0;
+    size_t offset = 0;
+    for (const char* index = grids.index; index != grids.index_end;) {
+        GridIndexBlock block = readIndexBlock(index, grids.index_end, offset);
+        offset = block.offset;
+        if (keep_block(block)) count += block.count;
+    }
+    array.resize(start + std::min(count, limit - start));
+    value_type* out = array.data() + start;
+    value_type* out_end = array.data() + array.size();
+
+    offset = 0;
+    for (const char* index = grids.index; index != grids.index_end && out != out_end;) {
+        GridIndexBlock block = readIndexBlock(index, grids.index_end, offset);
+        offset = block.offset;
+        if (!keep_block(block) || block.count == 0) continue;
+        if (block.offset >= static_cast<size_t>(grids.end - grids.data)) {
+            throw std::runtime_error("skip index points past the end of its list");
+        }
+
+        // the first grid comes from the index, since its delta is relative
+        // to the end of the previous block
+        const char* data = grids.data + block.offset;
+        readVarint(data, grids.end);
+        *out = block.first | boost;
+        if (keep(block.first)) ++out;
+        out = decodeDeltas(data, grids.end, block.count - 1, block.first, out, out_end, boost, keep);
+    }
+    array.resize(static_cast<size_t>(out - array.data()));
+}
+
+// this is a basic decoding operation that unpacks a whole protobuff message
+inline void decodeMessage(rocksdb::Slice const& message, intarray& array, size_t limit) {
+    decodePackedGrids(message, array, limit, 0, [](uint64_t) { return true; }, [](GridIndexBlock const&) { return true; });
+}
+
+// this function is as above, but also modifies the output of the protobuf message
+// to set the language-match bit to true, effectively boosting its sort order
+inline void decodeAndBoostMessage(rocksdb::Slice const& message, intarray& array, size_t limit) {
+    decodePackedGrids(message, array, limit, LANGUAGE_MATCH_BOOST, [](uint64_t) { return true; }, [](GridIndexBlock const&) { return true; });
+}
+
+// A spatial copy of a list splits its grids into cells of 2^shift by
+// 2^shift tiles, each stored as a list of its own under SPATIAL_KEY_PREFIX,
+// the phrase, the langfield separator, the Morton code of the cell as 4
+// big-endian bytes, and the langfield. Cells are numbered in Morton order,
+// so the cells within a bounding box all lie between the codes of its
+// corners and can be read with one seek. The main list records the shift in
+// a CACHE_CELLS field, which readers that don't know about it skip.
+#define SPATIAL_KEY_PREFIX "=@"
+// cells are made just large enough that a list has no more than this many
+constexpr size_t SPATIAL_MAX_CELLS = 256;
+
+inline uint32_t spreadBits(uint32_t value) {
+    value &= 0x0000ffff;
+    value = (value | (value << 8)) & 0x00ff00ff;
+    value = (value | (value << 4)) & 0x0f0f0f0f;
+    value = (value | (value << 2)) & 0x33333333;
+    return (value | (value << 1)) & 0x55555555;
+}
+
+inline uint32_t compactBits(uint32_t value) {
+    value &= 0x55555555;
+    value = (value | (value >> 1)) & 0x33333333;
+    value = (value | (value >> 2)) & 0x0f0f0f0f;
+    value = (value | (value >> 4)) & 0x00ff00ff;
+    return (value | (value >> 8)) & 0x0000ffff;
+}
+
+// interleaves the bits of a cell's x and y; shifting a tile's code right by
+// twice a cell shift gives the code of the cell it's in
+inline uint32_t mortonCode(uint32_t x, uint32_t y) {
+    return spreadBits(x) | (spreadBits(y) << 1);
+}
+
+inline void mortonDecode(uint32_t code, uint32_t& x, uint32_t& y) {
+    x = compactBits(code);
+    y = compactBits(code >> 1);
+}
+
+// the Morton code of the tile a grid is in
+inline uint32_t gridTile(uint64_t grid) {
+    return mortonCode(static_cast<uint32_t>((grid & X_MASK) >> 20), static_cast<uint32_t>((grid & Y_MASK) >> 34));
+}
+
+// the part of the spatial keys of a list's cells that comes before the cell
+inline std::string spatialPrefix(rocksdb::Slice const& key) {
+    const void* separator = memchr(key.data(), LANGFIELD_SEPARATOR, key.size());
+    size_t phrase_length = separator == nullptr ? key.size() : static_cast<size_t>(static_cast<const char*>(separator) - key.data());
+    std::string prefix(SPATIAL_KEY_PREFIX);
+    prefix.append(key.data(), phrase_length);
+    prefix.push_back(LANGFIELD_SEPARATOR);
+    return prefix;
+}
+
+// the langfield of a key, as the bytes it's stored as
+inline rocksdb::Slice langfieldBytes(rocksdb::Slice const& key) {
+    const void* separator = memchr(key.data(), LANGFIELD_SEPARATOR, key.size());
+    if (separator == nullptr) return rocksdb::Slice();
+    size_t start = static_cast<size_t>(static_cast<const char*>(separator) - key.data()) + 1;
+    return rocksdb::Slice(key.data() + start, key.size() - start);
+}
+
+inline void appendCell(std::string& key, uint32_t cell) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        key.push_back(static_cast<char>((cell >> shift) & 0xff));
+    }
+}
+
+inline uint32_t readCell(const char* data) {
+    uint32_t cell = 0;
+    for (size_t i = 0; i < 4; i++) {
+        cell = (cell << 8) | static_cast<unsigned char>(data[i]);
+    }
+    return cell;
+}
+
+inline void packVec(intarray const& varr, std::unique_ptr<rocksdb::DB> const& db, std::string const& key) {
+    db->Put(rocksdb::WriteOptions(), key, encodeVec(varr));
+}
+
+// How the grid lists of a packed cache are encoded, as recorded under
+// GRID_FORMAT_KEY: the protobuf messages above, or blocks of
+// GRID_BLOCK_SIZE grids that decode with SIMD instructions
+enum class GridFormat : uint8_t {
+    varint = 1,
+    blocks = 2
+};
+
+// A block-encoded list starts with a varint count of its grids, followed by
+// the blocks. Each block starts with its first grid as a varint; the deltas
+// between the rest follow as a control byte for every two of them, holding
+// the byte length of each (0 to 8) in a nibble, low nibble first, and then
+// each delta in that many bytes, least significant first.
+constexpr size_t GRID_BLOCK_SIZE = 128;
+
+// block-encodes a list of grids, sorted in descending order
+std::string encodeBlocks(value_type const* grids, size_t count);
+
+// Decodes a block-encoded list one block at a time
+class GridBlockReader : noncopyable {
+  public:
+    explicit GridBlockReader(rocksdb::Slice const& message);
+
+    // the number of grids in the whole list
+    size_t count() const { return count_; }
+    // decodes the next block into data(), returning false at the end of the list
+    bool next();
+    value_type const* data() const { return block_; }
+    size_t size() const { return size_; }
+
+  private:
+    const char* pos_;
+    const char* end_;
+    size_t count_;
+    size_t remaining_;
+    size_t size_;
+    value_type block_[GRID_BLOCK_SIZE];
+};
+
+// decodes up to `limit` grids of a list in either format, setting the
+// language-match bit on each of them if `boost` is set
+inline void decodeGrids(GridFormat format, rocksdb::Slice const& message, intarray& array, size_t limit, bool boost) {
+    if (format == GridFormat::varint) {
+        if (boost) {
+            decodeAndBoostMessage(message, array, limit);
+        } else {
+            decodeMessage(message, array, limit);
+        }
+        return;
+    }
+
+    GridBlockReader reader(message);
+    if (array.size() < limit) array.reserve(array.size() + std::min(reader.count(), limit - array.size()));
+    uint64_t mask = boost ? LANGUAGE_MATCH_BOOST : 0;
+    while (array.size() < limit && reader.next()) {
+        size_t n = std::min(reader.size(), limit - array.size());
+        for (size_t i = 0; i < n; i++) {
+            array.emplace_back(reader.data()[i] | mask);
+        }
+    }
+}
+
+// the number of grids in a list in either format
+inline size_t countGrids(GridFormat format, rocksdb::Slice const& message) {
+    if (format == GridFormat::blocks) return GridBlockReader(message).count();
+    protozero::pbf_reader item(message.data(), message.size());
+    if (!item.next(CACHE_ITEM)) return 0;
+    auto vals = item.get_packed_uint64();
+    return static_cast<size_t>(std::distance(vals.first, vals.second));
 }
 
+// Hands out the grids a scan matches one at a time, in the same order as
+// __getmatching returns them, decoding and merging lists only as far as
+// they're read. Whatever the lists were read from has to outlive the cursor.
+class GridCursor : noncopyable {
+  public:
+    virtual ~GridCursor() = default;
+    // moves on to the next grid, returning false once there are none left
+    virtual bool next(uint64_t& grid) = 0;
+};
+
+// The lists a MergeCursor can read from, handing out grids in descending
+// order with the language boost already applied
+
+// a list that's already decoded
+class ArraySource : noncopyable {
+  public:
+    ArraySource(value_type const* grids, size_t count, uint64_t boost)
+        : pos_(grids),
+          end_(grids + count),
+          boost_(boost) {}
+
+    bool next(uint64_t& grid) {
+        if (pos_ == end_) return false;
+        grid = *pos_++ | boost_;
+        return true;
+    }
+
+  private:
+    value_type const* pos_;
+    value_type const* end_;
+    uint64_t boost_;
+};
+
+// a protobuf message, delta-decoded a varint at a time
+class VarintSource : noncopyable {
+  public:
+    VarintSource(rocksdb::Slice const& message, uint64_t boost)
+        : pos_(nullptr),
+          end_(nullptr),
+          lastval_(0),
+          boost_(boost) {
+        PackedGrids grids(message);
+        pos_ = grids.data;
+        end_ = grids.end;
+    }
+
+    bool next(uint64_t& grid) {
+        if (pos_ == end_) return false;
+        uint64_t delta = readVarint(pos_, end_);
+        lastval_ = lastval_ == 0 ? delta : lastval_ - delta;
+        grid = lastval_ | boost_;
+        return true;
+    }
+
+  private:
+    const char* pos_;
+    const char* end_;
+    uint64_t lastval_;
+    uint64_t boost_;
+};
+
+// a block-encoded list, decoded a block at a time
+class BlockSource : noncopyable {
+  public:
+    BlockSource(rocksdb::Slice const& message, uint64_t boost)
+        : reader_(message),
+          pos_(0),
+          boost_(boost) {}
+
+    bool next(uint64_t& grid) {
+        if (pos_ == reader_.size()) {
+            if (!reader_.next()) return false;
+            pos_ = 0;
+        }
+        grid = reader_.data()[pos_++] | boost_;
+        return true;
+    }
+
+  private:
+    GridBlockReader reader_;
+    size_t pos_;
+    uint64_t boost_;
+};
+
+// The k-way merge of __getmatching as a cursor: every list is already sorted
+// in descending order, so the next grid is always at the head of one of
+// them, and only one grid of each list is decoded ahead of the merge.
+// Grids that turn up in more than one list are handed out once, and at most
+// `max_results` of them are.
+template <typename Source>
+class MergeCursor final : public GridCursor {
+  public:
+    explicit MergeCursor(size_t max_results)
+        : sources_(),
+          heap_(),
+          remaining_(max_results),
+          started_(false),
+          last_(0) {}
+
+    // lists have to be added before the first grid is read
+    void add(std::unique_ptr<Source> source) {
+        uint64_t grid;
+        if (!source->next(grid)) return;
+        heap_.push(grid, sources_.size());
+        sources_.emplace_back(std::move(source));
+    }
+
+    bool next(uint64_t& grid) override {
+        while (remaining_ > 0 && !heap_.empty()) {
+            size_t idx = heap_.top_value();
+            uint64_t top = heap_.top_key();
+            heap_.pop();
+
+            uint64_t following;
+            if (sources_[idx]->next(following)) heap_.push(following, idx);
+            if (started_ && top == last_) continue;
+
+            started_ = true;
+            last_ = top;
+            remaining_--;
+            grid = top;
+            return true;
+        }
+        return false;
+    }
+
+  private:
+    std::vector<std::unique_ptr<Source>> sources_;
+    radix_max_heap::pair_radix_max_heap<uint64_t, size_t> heap_;
+    size_t remaining_;
+    bool started_;
+    uint64_t last_;
+};
+
+// reads everything a cursor has left onto the end of `array`
+template <typename Cursor>
+inline void drainCursor(Cursor& cursor, intarray& array) {
+    uint64_t grid;
+    while (cursor.next(grid)) {
+        array.emplace_back(grid);
+    }
+}
+
+// One of the lookups in a batched get or getmatching; exact gets ignore
+// match_prefixes
+struct BatchQuery {
+    std::string phrase;
+    PrefixMatch match_prefixes;
+    langfield_type langfield;
+};
+
+// How far a pack has got: the keys and memoized prefixes written so far, and
+// the bytes of keys and values they took up
+struct PackStats {
+    uint64_t keys;
+    uint64_t prefixes;
+    uint64_t bytes;
+};
+
+typedef std::function<void(PackStats const&)> PackProgressFn;
+
+// Options controlling how pack() writes a cache out to disk
+struct PackOptions {
+    // with more than one thread, keys are split into contiguous ranges that
+    // are encoded into SST files concurrently and then bulk-ingested, rather
+    // than being written one Put at a time
+    unsigned threads = 1;
+    // how the blocks of the packed tables are compressed; packing a
+    // RocksDBCache rewrites every table, so this can recompress one
+    rocksdb::CompressionType compression = rocksdb::kSnappyCompression;
+    // prefixes longer than the fixed memo tiers are memoized if at least this
+    // many keys, or this many grids, start with them; 0 leaves either out
+    size_t memo_min_keys = 1024;
+    size_t memo_min_grids = 16384;
+    // keep only the highest this many grids in each memoized list; grids
+    // sort by relevance and score first, so scans asking for no more than
+    // this still get the same results. 0 keeps every grid.
+    size_t memo_max_grids = 0;
+    // how grid lists are encoded; caches in the block format can only be
+    // read by versions of carmen-cache that know about it
+    GridFormat format = GridFormat::varint;
+    // give lists in the varint format that are longer than one block a skip
+    // index, so reads can skip the blocks outside of a bounding box
+    bool skip_index = false;
+    // give lists in the varint format with at least this many grids a
+    // spatial copy as well, so reads within a bounding box only decode the
+    // cells it covers; 0 leaves it out
+    size_t spatial_min_grids = 0;
+    // called every so often while packing, and once more at the end; with
+    // several threads it can be called from any of them, even at once
+    PackProgressFn progress;
+};
+
+// encodes a list of grids the way `pack_options` asks for
+template <typename Array>
+inline std::string encodeGrids(PackOptions const& pack_options, Array const& varr) {
+    if (pack_options.format == GridFormat::blocks) return encodeBlocks(varr.data(), varr.size());
+    return pack_options.skip_index ? encodeIndexedVec(varr) : encodeVec(varr);
+}
+
+// If a list is long enough to get a spatial copy, splits it into cells,
+// appends the key and message of each cell to `cells`, and records the cell
+// size in `message`, the list's own encoded message
+void addSpatialCopy(PackOptions const& pack_options, rocksdb::Slice const& key, value_type const* grids, size_t count, std::string& message, std::vector<std::pair<std::string, std::string>>& cells);
+
+// Tallies what a pack writes and reports it to PackOptions::progress; safe
+// to update from several threads
+class PackProgress : noncopyable {
+  public:
+    explicit PackProgress(PackProgressFn const& progress);
+
+    void addKey(size_t bytes) { add(keys_, bytes); }
+    void addPrefix(size_t bytes) { add(prefixes_, bytes); }
+    // the cells of spatial copies only count towards the bytes written
+    void addCell(size_t bytes) { bytes_ += bytes; }
+    // reports the final tally
+    void finish();
+
+  private:
+    void add(std::atomic<uint64_t>& counter, size_t bytes);
+    PackStats stats() const;
+
+    PackProgressFn const& progress_;
+    std::atomic<uint64_t> keys_;
+    std::atomic<uint64_t> prefixes_;
+    std::atomic<uint64_t> bytes_;
+};
+
+// the most threads pack() will run; every thread holds a whole range of
+// keys' worth of encoded lists and writes files of its own, so more than a
+// machine has cores only costs memory
+constexpr unsigned MAX_PACK_THREADS = 64;
+
+// Runs work(0) ... work(threads - 1) on separate threads, waits for all of
+// them, and rethrows the first exception any of them raised
+void runThreads(unsigned threads, std::function<void(unsigned)> const& work);
+
+// Writes entries, which must arrive in ascending key order, to an SST file
+// for bulk ingestion. rocksdb refuses to finish an empty SST file, so the
+// file is only created once the first entry arrives.
+class SstFileSink : noncopyable {
+  public:
+    SstFileSink(const rocksdb::Options& options, std::string path);
+    void add(rocksdb::Slice const& key, rocksdb::Slice const& message);
+    // returns the path of the finished file, or an empty string if nothing was written
+    std::string finish();
+
+  private:
+    rocksdb::SstFileWriter writer_;
+    std::string path_;
+    bool opened_;
+};
+
+// Writes the cells of spatial copies to an SST file as the lists they belong
+// to are encoded, which has to be in ascending key order. A cell key puts the
+// cell ahead of the langfield, so the cells of lists that share a phrase
+// interleave: they're held back and sorted until a list with another phrase
+// comes along, and nothing more is kept in memory.
+class CellSink : noncopyable {
+  public:
+    CellSink(const rocksdb::Options& options, std::string path, PackProgress& progress);
+    // takes the cells of the list under `key`, leaving `cells` empty
+    void add(rocksdb::Slice const& key, std::vector<std::pair<std::string, std::string>>& cells);
+    // returns the path of the finished file, or an empty string if there were no cells
+    std::string finish();
+
+  private:
+    void flush();
+
+    SstFileSink sink_;
+    PackProgress& progress_;
+    std::string prefix_;
+    std::vector<std::pair<std::string, std::string>> pending_;
+};
+
+// Fills in the key and encoded value of the i'th entry to be written to an
+// SST file by the given thread; returns false if the entry should be skipped
+typedef std::function<bool(unsigned, size_t, std::string&, std::string&)> SstEntryFn;
+
+// Writes `count` entries, which must come in ascending key order, into one
+// SST file per thread under `dirname`, and returns the paths of the files.
+// If any thread fails, every file is removed before the error is rethrown.
+std::vector<std::string> writeSstFiles(const rocksdb::Options& options, const std::string& dirname, const std::string& tag, size_t count, unsigned threads, SstEntryFn const& entry);
+// Moves a set of non-overlapping SST files into a database, or removes them
+// if they can't be
+rocksdb::Status ingestSstFiles(std::unique_ptr<rocksdb::DB> const& db, const std::vector<std::string>& files);
+// removes the SST files a failed pack leaves behind, skipping empty paths
+// and files that were never created
+void removeSstFiles(const std::vector<std::string>& files);
+// How a cache's prefixes were memoized, as recorded under MEMO_TIERS_KEY
+// and MEMO_CAP_KEY
+struct MemoLayout {
+    // the lengths of the hot prefixes memoized, as a bitmask
+    uint64_t hot_lengths;
+    // the most grids kept in each memoized list, or 0 if they're complete
+    size_t max_grids;
+};
+
+// Records the memo layout and grid format a cache was packed with, then
+// flushes the database so that all of it is in tables
+rocksdb::Status finishPackedDB(std::unique_ptr<rocksdb::DB> const& db, MemoLayout const& layout, GridFormat format);
+// Reads back the memo layout of a packed cache; caches packed before it was
+// recorded have no hot prefixes and complete lists
+MemoLayout readMemoLayout(rocksdb::DB& db);
+// Reads back the grid format of a packed cache; caches packed before there
+// was a choice are in the varint format
+GridFormat readGridFormat(rocksdb::DB& db);
+
+// Memoizes the hot prefixes longer than the fixed tiers (the "=+" keys):
+// those that at least memo_min_keys keys or memo_min_grids grids start
+// with, which are where autocomplete scans are slowest. Every length up to
+// MEMO_PREFIX_MAX_LENGTH is considered. A memo covers exactly the keys
+// starting with its prefix, so it can only serve a scan for that very
+// prefix, and readers learn which lengths to try from the lengths() that
+// pack records under MEMO_TIERS_KEY. Keys have to be added in ascending
+// order, and memos are emitted in ascending key order too; only the keys
+// sharing the current shortest hot-prefix candidate are held in memory.
+class HotPrefixMemoizer : noncopyable {
+  public:
+    typedef std::function<void(std::string const&, intarray const&)> EmitFn;
+
+    HotPrefixMemoizer(EmitFn emit, PackOptions const& pack_options);
+    void add(rocksdb::Slice const& key, value_type const* grids, size_t count);
+    void finish();
+
+    // the lengths of the prefixes memoized so far, as a bitmask
+    uint64_t lengths() const { return lengths_; }
+
+  private:
+    struct Entry {
+        std::string langfield;
+        size_t grids_begin;
+        size_t grids_end;
+    };
+    // where the keys of a candidate prefix start in entries_ and grids_
+    struct Group {
+        size_t entries_begin;
+        size_t grids_begin;
+    };
+    void close();
+
+    EmitFn emit_;
+    size_t min_keys_;
+    size_t min_grids_;
+    size_t max_grids_;
+    std::string phrase_;
+    // one for every candidate the last phrase has, from the shortest
+    std::vector<Group> groups_;
+    std::vector<Entry> entries_;
+    intarray grids_;
+    std::map<std::string, intarray> memos_;
+    uint64_t lengths_;
+};
+
+// the lengths of hot-prefix memos, as stored under MEMO_TIERS_KEY: one byte
+// per length, in ascending order
+std::string encodeMemoLengths(uint64_t lengths);
+uint64_t decodeMemoLengths(rocksdb::Slice const& message);
+
+// Builds the memoized prefix lists (the "=1" and "=2" keys) that serve short
+// autocomplete scans, along with the hot "=+" ones that pack_options asks
+// for, each cut down to its memo_max_grids highest grids. Keys have to be
+// added in ascending order, which means that all the keys sharing a prefix
+// arrive one after another: each prefix is handed to `emit` as soon as a key
+// outside of it shows up, so only the current prefix group is ever held in
+// memory. Within each tier, prefixes are emitted in ascending key order.
+class PrefixMemoizer : noncopyable {
+  public:
+    typedef std::function<void(std::string const&, intarray const&)> EmitFn;
+
+    explicit PrefixMemoizer(EmitFn emit, PackOptions const& pack_options = PackOptions());
+    void add(rocksdb::Slice const& key, value_type const* grids, size_t count);
+    void add(std::string const& key, intarray const& varr) {
+        add(key, varr.data(), varr.size());
+    }
+    void finish();
+
+    // the lengths of the hot prefixes memoized so far, as a bitmask
+    uint64_t hotLengths() const { return hot_.lengths(); }
+
+    // whether two keys fall in the same top-tier prefix group, and so need
+    // to be fed to the same PrefixMemoizer
+    static bool sameGroup(rocksdb::Slice const& a, rocksdb::Slice const& b);
+    // the keys of the memoized prefixes that a key's grids belong to
+    static void memoKeys(rocksdb::Slice const& key, std::vector<std::string>& out);
+
+  private:
+    struct Tier {
+        std::string tag;
+        size_t length;
+        std::string group;
+        std::map<key_type, intarray> buffers;
+    };
+    void flush(Tier& tier);
+
+    EmitFn emit_;
+    std::vector<Tier> tiers_;
+    size_t max_grids_;
+    HotPrefixMemoizer hot_;
+};
+
+// Cuts keys off just after the langfield separator, so that all the
+// langfields of a phrase share one prefix. Keys without a separator, and the
+// seek targets of prefix scans, are outside its domain.
+class PhrasePrefixTransform : public rocksdb::SliceTransform {
+  public:
+    const char* Name() const override { return "carmen.PhrasePrefix"; }
+    rocksdb::Slice Transform(const rocksdb::Slice& key) const override;
+    bool InDomain(const rocksdb::Slice& key) const override;
+};
+
+// The options every cache database is written and read with: full bloom
+// filters over both whole keys and phrase prefixes, so that exact lookups
+// for phrases missing from an index are mostly answered without reading any
+// data blocks. Databases packed before these options existed have no filters
+// and are read as before. If `block_cache` is set, it's used instead of a
+// cache of the database's own, and holds index and filter blocks too.
+rocksdb::Options cacheDBOptions(std::shared_ptr<rocksdb::Cache> const& block_cache = nullptr);
+
 // rocksdb is also used in memorycache
 rocksdb::Status OpenDB(const rocksdb::Options& options, const std::string& name, std::unique_ptr<rocksdb::DB>& dbptr);
 rocksdb::Status OpenForReadOnlyDB(const rocksdb::Options& options, const std::string& name, std::unique_ptr<rocksdb::DB>& dbptr);
@@ -310,11 +1133,13 @@ rocksdb::Status OpenForReadOnlyDB(const rocksdb::Options& options, const std::st
 #define TYPE_MEMORY 1
 #define TYPE_ROCKSDB 2
 
-#define CACHE_MESSAGE 1
-#define CACHE_ITEM 1
-
 #define MEMO_PREFIX_LENGTH_T1 3
 #define MEMO_PREFIX_LENGTH_T2 6
+// hot prefixes longer than this aren't memoized; lengths() has to fit them
+#define MEMO_PREFIX_MAX_LENGTH 32
+#define MEMO_TIERS_KEY "=#memo_tiers"
+#define MEMO_CAP_KEY "=#memo_cap"
+#define GRID_FORMAT_KEY "=#grid_format"
 #define PREFIX_MAX_GRID_LENGTH 500000
 
 } // namespace carmen
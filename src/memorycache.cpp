@@ -2,167 +2,867 @@
 #include "memorycache.hpp"
 #include "cpp_util.hpp"
 
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace carmen {
 
-intarray MemoryCache::__get(const std::string& phrase, langfield_type langfield) {
-    arraycache const& cache = this->cache_;
+namespace {
+
+// The plain and compact storage modes share the code below: these overloads
+// hand back a list either as the encoded message that pack writes, or as
+// decoded grids, whichever way it happens to be stored
+inline void encodeList(poolarray const& list, PackOptions const& pack_options, std::string& message) {
+    message = encodeGrids(pack_options, list);
+}
+
+// compact lists are already in the varint format, without a skip index
+inline void encodeList(poolstring const& list, PackOptions const& pack_options, std::string& message) {
+    if (pack_options.format == GridFormat::varint && !pack_options.skip_index) {
+        message.assign(list.data(), list.size());
+        return;
+    }
+    intarray grids;
+    decodeMessage(rocksdb::Slice(list.data(), list.size()), grids, std::numeric_limits<size_t>::max());
+    message = encodeGrids(pack_options, grids);
+}
+
+inline poolarray const& decodeList(poolarray const& list, intarray& /* scratch */) {
+    return list;
+}
+
+inline intarray const& decodeList(poolstring const& list, intarray& scratch) {
+    scratch.clear();
+    decodeMessage(rocksdb::Slice(list.data(), list.size()), scratch, std::numeric_limits<size_t>::max());
+    return scratch;
+}
+
+// Collects every non-empty list whose key starts with one of `prefixes`,
+// along with whether its langfield matches the requested one
+template <typename Cache>
+void findLists(Cache const& cache, std::vector<std::string> const& prefixes, langfield_type langfield, std::vector<std::tuple<typename Cache::mapped_type const*, bool>>& lists) {
+    for (std::string const& phrase : prefixes) {
+        size_t phrase_length = phrase.length();
+        const char* phrase_data = phrase.data();
+
+        for (auto itr = cache.lower_bound(phrase); itr != cache.end(); ++itr) {
+            auto const& item = *itr;
+            if (item.first.size() < phrase_length || memcmp(phrase_data, item.first.data(), phrase_length) != 0) break;
+            if (item.second.empty()) continue;
+
+            langfield_type message_langfield = extract_langfield(item.first);
+            auto matches_language = static_cast<bool>(message_langfield & langfield);
+
+            lists.emplace_back(std::make_tuple(&(item.second), matches_language));
+        }
+    }
+}
+
+// Gathers every entry of every shard in key order; the shards' keys are
+// disjoint sorted runs, so k-way merge them through a min-heap of each
+// shard's next entry rather than merging the runs into each other in turn
+template <typename Cache>
+std::vector<typename Cache::const_iterator> sortedItems(std::vector<std::unique_ptr<MemoryCacheShard>> const& shards, Cache MemoryCacheShardData::*member) {
+    using Run = std::pair<typename Cache::const_iterator, typename Cache::const_iterator>;
+    // orders the heap so its front is the run with the smallest next key
+    auto later = [](Run const& a, Run const& b) {
+        return a.first->first.compare(b.first->first) > 0;
+    };
+
+    std::vector<Run> runs;
+    size_t total = 0;
+    for (auto const& shard : shards) {
+        Cache const& cache = (*shard->data).*member;
+        total += cache.size();
+        if (!cache.empty()) runs.emplace_back(cache.begin(), cache.end());
+    }
+    std::make_heap(runs.begin(), runs.end(), later);
+
+    std::vector<typename Cache::const_iterator> items;
+    items.reserve(total);
+    while (!runs.empty()) {
+        std::pop_heap(runs.begin(), runs.end(), later);
+        Run& run = runs.back();
+        items.emplace_back(run.first++);
+        if (run.first == run.second) {
+            runs.pop_back();
+        } else {
+            std::push_heap(runs.begin(), runs.end(), later);
+        }
+    }
+    return items;
+}
+
+// the source a merge reads each kind of list through
+inline std::unique_ptr<ArraySource> listSource(poolarray const& list, uint64_t boost) {
+    return std::unique_ptr<ArraySource>(new ArraySource(list.data(), list.size(), boost));
+}
+
+// compact lists are merged straight out of their encoded messages, decoding
+// each one lazily as the merge consumes it
+inline std::unique_ptr<VarintSource> listSource(poolstring const& list, uint64_t boost) {
+    return std::unique_ptr<VarintSource>(new VarintSource(rocksdb::Slice(list.data(), list.size()), boost));
+}
+
+// every list is already sorted in descending order, so rather than
+// concatenating and sorting the lot, do the same k-way merge as
+// RocksDBCache::__getmatching and stop as soon as we have enough grids
+template <typename Cursor, typename List>
+void addLists(Cursor& cursor, std::vector<std::tuple<List const*, bool>> const& lists) {
+    for (auto const& list : lists) {
+        cursor.add(listSource(*std::get<0>(list), std::get<1>(list) ? LANGUAGE_MATCH_BOOST : 0));
+    }
+}
+
+intarray mergeLists(std::vector<std::tuple<poolarray const*, bool>> const& lists, size_t max_results) {
     intarray array;
-    std::string phrase_with_langfield = phrase;
 
-    add_langfield(phrase_with_langfield, langfield);
-    auto aitr = cache.find(phrase_with_langfield);
-    if (aitr != cache.end()) {
-        array = aitr->second;
+    // short-circuit the merging logic if we only found one list, as will be
+    // the norm for exact matches in translationless indexes
+    if (lists.size() == 1) {
+        poolarray const& list = *std::get<0>(lists[0]);
+        uint64_t boost = std::get<1>(lists[0]) ? LANGUAGE_MATCH_BOOST : 0;
+        size_t length = std::min(list.size(), max_results);
+        array.reserve(length);
+        for (size_t i = 0; i < length; i++) {
+            array.emplace_back(list[i] | boost);
+        }
+        return array;
     }
-    std::sort(array.begin(), array.end(), std::greater<uint64_t>());
+
+    MergeCursor<ArraySource> cursor(max_results);
+    addLists(cursor, lists);
+    drainCursor(cursor, array);
     return array;
 }
 
-intarray MemoryCache::__getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+intarray mergeLists(std::vector<std::tuple<poolstring const*, bool>> const& lists, size_t max_results) {
     intarray array;
-    std::string phrase = phrase_ref;
 
-    if (match_prefixes == PrefixMatch::disabled) phrase.push_back(LANGFIELD_SEPARATOR);
-    size_t phrase_length = phrase.length();
-    const char* phrase_data = phrase.data();
-    // Load values from memory cache
+    if (lists.size() == 1) {
+        poolstring const& message = *std::get<0>(lists[0]);
+        if (std::get<1>(lists[0])) {
+            decodeAndBoostMessage(rocksdb::Slice(message.data(), message.size()), array, max_results);
+        } else {
+            decodeMessage(rocksdb::Slice(message.data(), message.size()), array, max_results);
+        }
+        return array;
+    }
 
-    for (auto const& item : this->cache_) {
-        const char* item_data = item.first.data();
-        size_t item_length = item.first.length();
+    MergeCursor<VarintSource> cursor(max_results);
+    addLists(cursor, lists);
+    drainCursor(cursor, array);
+    return array;
+}
 
-        if (item_length < phrase_length) continue;
+// A merge of a MemoryCache's lists that's read from lazily. The lists are
+// copied while the cache is locked and merged from the copies, so the locks
+// are let go as soon as the cursor is made rather than when it's done with.
+template <typename Source, typename Copy>
+class SnapshotCursor final : public GridCursor {
+  public:
+    explicit SnapshotCursor(size_t max_results)
+        : merge(max_results) {}
+
+    bool next(uint64_t& grid) override { return merge.next(grid); }
+
+    template <typename List>
+    void copy(std::vector<std::tuple<List const*, bool>> const& found, size_t max_results) {
+        // reserved up front, so that the sources' pointers into the copies
+        // stay valid
+        copies.reserve(found.size());
+        for (auto const& list : found) {
+            copies.emplace_back(copyList(*std::get<0>(list), max_results));
+            merge.add(listSource(copies.back(), std::get<1>(list) ? LANGUAGE_MATCH_BOOST : 0));
+        }
+    }
 
-        if (memcmp(phrase_data, item_data, phrase_length) == 0) {
-            if (match_prefixes == PrefixMatch::word_boundary) {
-                size_t end = phrase_length;
-                if (item_data[end] != LANGFIELD_SEPARATOR && item_data[end] != ' ') {
-                    continue;
-                }
+  private:
+    // a merge never takes more than `max_results` grids from any one list
+    static intarray copyList(poolarray const& list, size_t max_results) {
+        return intarray(list.begin(), list.begin() + static_cast<std::ptrdiff_t>(std::min(list.size(), max_results)));
+    }
+    static std::string copyList(poolstring const& list, size_t /* max_results */) {
+        return std::string(list.data(), list.size());
+    }
+    static std::unique_ptr<ArraySource> listSource(intarray const& list, uint64_t boost) {
+        return std::unique_ptr<ArraySource>(new ArraySource(list.data(), list.size(), boost));
+    }
+    static std::unique_ptr<VarintSource> listSource(std::string const& list, uint64_t boost) {
+        return std::unique_ptr<VarintSource>(new VarintSource(list, boost));
+    }
+
+    // declared first so that it outlives the merge reading from it
+    std::vector<Copy> copies;
+    MergeCursor<Source> merge;
+};
+
+// the cache is ordered by key, so all the keys sharing a given prefix sit
+// in a single contiguous range that we can seek straight to. A word
+// boundary match is the union of two such ranges: the phrase followed by
+// a space, and the phrase followed by the langfield separator.
+std::vector<std::string> matchingPrefixes(std::string const& phrase, PrefixMatch match_prefixes) {
+    std::vector<std::string> prefixes;
+    if (match_prefixes == PrefixMatch::disabled) {
+        prefixes.emplace_back(phrase + LANGFIELD_SEPARATOR);
+    } else if (match_prefixes == PrefixMatch::word_boundary) {
+        prefixes.emplace_back(phrase + ' ');
+        prefixes.emplace_back(phrase + LANGFIELD_SEPARATOR);
+    } else {
+        prefixes.emplace_back(phrase);
+    }
+    return prefixes;
+}
+
+// writes out the cells of spatial copies, in whatever order they come in
+void putCells(std::unique_ptr<rocksdb::DB> const& db, std::vector<std::pair<std::string, std::string>>& cells, PackProgress& progress) {
+    for (auto const& cell : cells) {
+        db->Put(rocksdb::WriteOptions(), cell.first, cell.second);
+        progress.addCell(cell.first.size() + cell.second.size());
+    }
+    cells.clear();
+}
+
+template <typename Iterator>
+void packSerial(std::vector<Iterator> const& items, std::unique_ptr<rocksdb::DB> const& db, PackOptions const& pack_options, PackProgress& progress) {
+    std::vector<std::pair<std::string, std::string>> cells;
+    auto emit = [&db, &pack_options, &progress, &cells](std::string const& key, intarray const& varr) {
+        std::string message = encodeGrids(pack_options, varr);
+        addSpatialCopy(pack_options, key, varr.data(), varr.size(), message, cells);
+        db->Put(rocksdb::WriteOptions(), key, message);
+        progress.addPrefix(key.size() + message.size());
+        putCells(db, cells, progress);
+    };
+    PrefixMemoizer memoizer(emit, pack_options);
+
+    std::string message;
+    intarray scratch;
+    for (Iterator const& itr : items) {
+        auto const& item = *itr;
+        if (item.second.empty()) continue;
+
+        // lists are kept sorted in descending order and deduplicated by
+        // _set, so they can be delta-encoded as they are
+        auto const& grids = decodeList(item.second, scratch);
+        encodeList(item.second, pack_options, message);
+        addSpatialCopy(pack_options, item.first, grids.data(), grids.size(), message, cells);
+        db->Put(rocksdb::WriteOptions(), item.first, message);
+        progress.addKey(item.first.size() + message.size());
+        putCells(db, cells, progress);
+
+        // add this to the memoized prefix arrays too
+        memoizer.add(item.first, grids.data(), grids.size());
+    }
+    memoizer.finish();
+
+    // write everything out as tables, which carry bloom filters, rather than
+    // leaving it in the log to be replayed whenever the file is opened
+    rocksdb::Status status = finishPackedDB(db, MemoLayout{memoizer.hotLengths(), pack_options.memo_max_grids}, pack_options.format);
+    if (!status.ok()) {
+        throw std::runtime_error("unable to flush packed cache: " + status.ToString());
+    }
+}
+
+// Parallel version of pack: the keys are split into contiguous ranges that
+// are each encoded into an SST file on a separate thread, and the files are
+// then bulk-ingested into the database
+template <typename Iterator>
+void packParallel(std::vector<Iterator> items, std::unique_ptr<rocksdb::DB> const& db, rocksdb::Options const& options, std::string const& filename, PackOptions const& pack_options, PackProgress& progress) {
+    unsigned threads = pack_options.threads;
+    items.erase(std::remove_if(items.begin(), items.end(), [](Iterator const& itr) { return itr->second.empty(); }), items.end());
+
+    // the cells of spatial copies are written as the lists are encoded, to
+    // a file per thread for the keys and one per thread and tier for the
+    // memos, which follow the same order as the prefix files
+    bool spatial = pack_options.spatial_min_grids > 0;
+    std::vector<std::string> cell_paths;
+    std::vector<std::unique_ptr<CellSink>> cell_sinks;
+    if (spatial) {
+        for (unsigned t = 0; t < threads; t++) {
+            for (const char* part : {"keys", "1", "2", "hot"}) {
+                cell_paths.emplace_back(filename + "/pack-cells-" + part + "-" + std::to_string(t) + ".sst");
+                cell_sinks.emplace_back(new CellSink(options, cell_paths.back(), progress));
             }
-            langfield_type message_langfield = extract_langfield(item.first);
+        }
+    }
+
+    // cell files are written alongside everything else, so whatever goes
+    // wrong, whichever of them haven't been ingested are removed
+    std::vector<uint64_t> hot_lengths(threads);
+    try {
+        std::vector<std::string> files = writeSstFiles(options, filename, "pack-keys", items.size(), threads, [&items, &pack_options, &progress, &cell_sinks](unsigned t, size_t i, std::string& key, std::string& message) {
+            key.assign(items[i]->first.data(), items[i]->first.size());
+            encodeList(items[i]->second, pack_options, message);
+            if (!cell_sinks.empty()) {
+                intarray scratch;
+                std::vector<std::pair<std::string, std::string>> cells;
+                auto const& grids = decodeList(items[i]->second, scratch);
+                addSpatialCopy(pack_options, key, grids.data(), grids.size(), message, cells);
+                cell_sinks[t * 4]->add(key, cells);
+            }
+            progress.addKey(key.size() + message.size());
+            return true;
+        });
+        rocksdb::Status status = ingestSstFiles(db, files);
+        if (!status.ok()) {
+            throw std::runtime_error("unable to ingest packed keys: " + status.ToString());
+        }
 
-            if ((message_langfield & langfield) != 0u) {
-                array.reserve(array.size() + item.second.size());
-                for (auto const& grid : item.second) {
-                    array.emplace_back(grid | LANGUAGE_MATCH_BOOST);
+        // the memoized prefixes get their own ranges, which can only be split
+        // between two prefix groups since each group is memoized in one go
+        std::vector<size_t> bounds{0};
+        for (unsigned t = 1; t < threads; t++) {
+            size_t bound = std::max(bounds.back(), items.size() * t / threads);
+            while (bound > 0 && bound < items.size() && PrefixMemoizer::sameGroup(items[bound - 1]->first, items[bound]->first)) {
+                bound++;
+            }
+            bounds.emplace_back(bound);
+        }
+        bounds.emplace_back(items.size());
+
+        // each tier of prefixes is written in key order, but the tiers are
+        // interleaved with each other, so every thread writes one file per tier
+        std::vector<std::string> prefix_paths;
+        for (unsigned t = 0; t < threads; t++) {
+            for (const char* tier : {"1", "2", "hot"}) {
+                prefix_paths.emplace_back(filename + "/pack-prefixes-" + tier + "-" + std::to_string(t) + ".sst");
+            }
+        }
+        std::vector<std::string> prefix_files(threads * 3);
+        try {
+            runThreads(threads, [&](unsigned t) {
+                SstFileSink t1(options, prefix_paths[t * 3]);
+                SstFileSink t2(options, prefix_paths[t * 3 + 1]);
+                SstFileSink hot(options, prefix_paths[t * 3 + 2]);
+                std::vector<std::pair<std::string, std::string>> cells;
+                auto emit = [&](std::string const& key, intarray const& varr) {
+                    std::string message = encodeGrids(pack_options, varr);
+                    unsigned tier = key[1] == '1' ? 0 : key[1] == '2' ? 1 : 2;
+                    if (spatial) {
+                        addSpatialCopy(pack_options, key, varr.data(), varr.size(), message, cells);
+                        cell_sinks[t * 4 + 1 + tier]->add(key, cells);
+                    }
+                    (tier == 0 ? t1 : tier == 1 ? t2 : hot).add(key, message);
+                    progress.addPrefix(key.size() + message.size());
+                };
+                PrefixMemoizer memoizer(emit, pack_options);
+                intarray scratch;
+                for (size_t i = bounds[t]; i < bounds[t + 1]; i++) {
+                    auto const& grids = decodeList(items[i]->second, scratch);
+                    memoizer.add(items[i]->first, grids.data(), grids.size());
                 }
-            } else {
-                array.insert(array.end(), item.second.begin(), item.second.end());
+                memoizer.finish();
+                prefix_files[t * 3] = t1.finish();
+                prefix_files[t * 3 + 1] = t2.finish();
+                prefix_files[t * 3 + 2] = hot.finish();
+                hot_lengths[t] = memoizer.hotLengths();
+            });
+        } catch (...) {
+            removeSstFiles(prefix_paths);
+            throw;
+        }
+        prefix_files.erase(std::remove(prefix_files.begin(), prefix_files.end(), std::string()), prefix_files.end());
+
+        status = ingestSstFiles(db, prefix_files);
+        if (!status.ok()) {
+            throw std::runtime_error("unable to ingest packed prefixes: " + status.ToString());
+        }
+
+        // a phrase's cells can be split between the files of two threads, and
+        // the memos' cells fall in among the keys', so the files can overlap
+        // and go in one at a time
+        for (auto const& sink : cell_sinks) {
+            std::string file = sink->finish();
+            if (file.empty()) continue;
+            status = ingestSstFiles(db, {file});
+            if (!status.ok()) {
+                throw std::runtime_error("unable to ingest packed cells: " + status.ToString());
             }
         }
+    } catch (...) {
+        cell_sinks.clear();
+        removeSstFiles(cell_paths);
+        throw;
+    }
+
+    MemoLayout layout{0, pack_options.memo_max_grids};
+    for (uint64_t lengths : hot_lengths) {
+        layout.hot_lengths |= lengths;
+    }
+    rocksdb::Status status = finishPackedDB(db, layout, pack_options.format);
+    if (!status.ok()) {
+        throw std::runtime_error("unable to flush packed cache: " + status.ToString());
     }
-    std::sort(array.begin(), array.end(), std::greater<uint64_t>());
-    if (array.size() > max_results) array.resize(max_results);
-    return array;
 }
 
-MemoryCache::MemoryCache() = default;
+template <typename Iterator>
+std::vector<std::pair<std::string, langfield_type>> listKeys(std::vector<Iterator> const& items) {
+    std::vector<std::pair<std::string, langfield_type>> out;
 
-MemoryCache::~MemoryCache() = default;
+    for (Iterator const& item : items) {
+        std::string key = item->first.ToString();
+        std::string phrase = key.substr(0, key.find(LANGFIELD_SEPARATOR));
+        langfield_type langfield = extract_langfield(key);
 
-bool MemoryCache::pack(const std::string& filename) {
-    std::unique_ptr<rocksdb::DB> db;
-    rocksdb::Options options;
-    options.create_if_missing = true;
-    rocksdb::Status status = OpenDB(options, filename, db);
-
-    if (!status.ok()) {
-        throw std::invalid_argument("unable to open rocksdb file for packing");
+        out.emplace_back(phrase, langfield);
     }
 
-    std::map<key_type, std::deque<value_type>> memoized_prefixes;
+    return out;
+}
+
+// Merges `length` grids read from `data` into `vv`, whose first
+// `existing_size` grids are kept. `data` is read with memcpy, so it can point
+// at unaligned memory such as the contents of a node Buffer
+template <typename Array>
+void mergeGrids(Array& vv, size_t existing_size, const void* data, size_t length) {
+    vv.resize(existing_size + length);
+    if (length > 0) {
+        memcpy(&vv[existing_size], data, length * sizeof(value_type));
+    }
 
-    for (auto const& item : this->cache_) {
-        std::size_t array_size = item.second.size();
-        if (array_size > 0) {
-            // make copy of intarray so we can sort without
-            // modifying the original array
-            intarray varr = item.second;
+    // keep every list sorted in descending order and free of duplicates so
+    // that reads and pack never need to sort
+    auto middle = vv.begin() + static_cast<std::ptrdiff_t>(existing_size);
+    std::sort(middle, vv.end(), std::greater<uint64_t>());
+    if (existing_size > 0) {
+        std::inplace_merge(vv.begin(), middle, vv.end(), std::greater<uint64_t>());
+    }
+    vv.erase(std::unique(vv.begin(), vv.end()), vv.end());
+}
 
-            // delta-encode values, sorted in descending order.
-            std::sort(varr.begin(), varr.end(), std::greater<uint64_t>());
-            // remove duplicates
-            varr.erase(std::unique(varr.begin(), varr.end()), varr.end());
+// Finds the list stored under `key`, adding an empty one if there isn't one
+// yet; new keys are copied into the pool, where they stay for good
+template <typename Cache>
+typename Cache::mapped_type& findOrAdd(Cache& cache, MemoryPool& pool, std::string const& key) {
+    typedef typename Cache::mapped_type list_type;
 
-            packVec(varr, db, item.first);
+    auto itr = cache.lower_bound(key);
+    if (itr == cache.end() || itr->first != rocksdb::Slice(key)) {
+        rocksdb::Slice interned(pool.intern(key.data(), key.size()), key.size());
+        itr = cache.emplace_hint(itr, interned, list_type(typename list_type::allocator_type(&pool)));
+    }
+    return itr->second;
+}
 
-            std::string prefix_t1;
-            std::string prefix_t2;
+// Snapshot layout: a SnapshotHeader followed by one record per key, each
+// made up of a SnapshotRecord, the key and then the list. Lists are stored
+// the way the cache that saved them held them, as raw grids or as encoded
+// messages. Every part is padded to a multiple of 8 bytes so that the grids
+// of a mapped file are aligned.
+constexpr char SNAPSHOT_MAGIC[8] = {'C', 'A', 'R', 'M', 'E', 'N', 'M', 'C'};
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+constexpr size_t SNAPSHOT_ALIGNMENT = 8;
+
+enum class SnapshotEncoding : uint32_t {
+    grids = 0,
+    messages = 1
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    SnapshotEncoding encoding;
+    uint32_t reserved;
+    uint64_t count;
+};
+
+struct SnapshotRecord {
+    uint64_t key_length;
+    // in grids or in bytes, depending on the encoding
+    uint64_t list_length;
+};
+
+inline size_t snapshotPadding(size_t length) {
+    return (SNAPSHOT_ALIGNMENT - length % SNAPSHOT_ALIGNMENT) % SNAPSHOT_ALIGNMENT;
+}
 
-            // add this to the memoized prefix array too, maybe
-            auto phrase_length = item.first.find(LANGFIELD_SEPARATOR);
-            // use the full string for things shorter than the limit
-            // or the prefix otherwise
-            if (phrase_length < MEMO_PREFIX_LENGTH_T1) {
-                prefix_t1 = "=1" + item.first;
-            } else {
-                // get the prefix, then append the langfield back onto it again
-                langfield_type langfield = extract_langfield(item.first);
+template <typename Iterator>
+void writeSnapshot(std::vector<Iterator> const& items, SnapshotEncoding encoding, std::string const& filename) {
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("unable to open " + filename + " for writing");
+
+    // writes `length` bytes followed by the padding that realigns the file
+    auto write = [&out](const void* data, size_t length) {
+        static const char zeros[SNAPSHOT_ALIGNMENT] = {};
+        out.write(static_cast<const char*>(data), static_cast<std::streamsize>(length));
+        out.write(zeros, static_cast<std::streamsize>(snapshotPadding(length)));
+    };
+
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.encoding = encoding;
+    header.reserved = 0;
+    header.count = items.size();
+    write(&header, sizeof(header));
+
+    for (Iterator const& itr : items) {
+        auto const& list = itr->second;
+        SnapshotRecord record{itr->first.size(), list.size()};
+        write(&record, sizeof(record));
+        write(itr->first.data(), itr->first.size());
+        write(list.data(), list.size() * sizeof(list[0]));
+    }
 
-                prefix_t1 = "=1" + item.first.substr(0, MEMO_PREFIX_LENGTH_T1);
-                add_langfield(prefix_t1, langfield);
+    out.close();
+    if (!out) throw std::runtime_error("unable to write " + filename);
+}
 
-                if (phrase_length < MEMO_PREFIX_LENGTH_T2) {
-                    prefix_t2 = "=2" + item.first;
-                } else {
-                    prefix_t2 = "=2" + item.first.substr(0, MEMO_PREFIX_LENGTH_T2);
-                    add_langfield(prefix_t2, langfield);
-                }
+// a read-only mapping of a whole file, unmapped when it goes out of scope
+class MappedFile : noncopyable {
+  public:
+    explicit MappedFile(std::string const& filename)
+        : data_(nullptr),
+          size_(0) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("unable to open " + filename);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("unable to read " + filename);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("unable to map " + filename);
             }
+            data_ = static_cast<const char*>(mapped);
+            // records are read front to back, once
+            madvise(mapped, size_, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
 
-            if (!prefix_t1.empty()) {
-                std::map<key_type, std::deque<value_type>>::const_iterator mitr = memoized_prefixes.find(prefix_t1);
-                if (mitr == memoized_prefixes.end()) {
-                    memoized_prefixes.emplace(prefix_t1, std::deque<value_type>());
-                }
-                std::deque<value_type>& buf = memoized_prefixes[prefix_t1];
+    ~MappedFile() {
+        if (data_ != nullptr) munmap(const_cast<char*>(data_), size_);
+    }
 
-                buf.insert(buf.end(), varr.begin(), varr.end());
-            }
-            if (!prefix_t2.empty()) {
-                std::map<key_type, std::deque<value_type>>::const_iterator mitr = memoized_prefixes.find(prefix_t2);
-                if (mitr == memoized_prefixes.end()) {
-                    memoized_prefixes.emplace(prefix_t2, std::deque<value_type>());
-                }
-                std::deque<value_type>& buf = memoized_prefixes[prefix_t2];
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+  private:
+    const char* data_;
+    size_t size_;
+};
+
+// Walks the records of a mapped snapshot, checking that every one of them
+// lies within the file
+class SnapshotReader {
+  public:
+    SnapshotReader(const char* data, size_t size)
+        : data_(data),
+          size_(size),
+          offset_(0) {}
+
+    SnapshotHeader header() {
+        SnapshotHeader header;
+        memcpy(&header, take(sizeof(header)), sizeof(header));
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+            throw std::runtime_error("not a MemoryCache snapshot");
+        }
+        if (header.version != SNAPSHOT_VERSION) {
+            throw std::runtime_error("unsupported MemoryCache snapshot version " + std::to_string(header.version));
+        }
+        if (header.byte_order != SNAPSHOT_BYTE_ORDER) {
+            throw std::runtime_error("MemoryCache snapshot was saved with a different byte order");
+        }
+        if (header.encoding != SnapshotEncoding::grids && header.encoding != SnapshotEncoding::messages) {
+            throw std::runtime_error("corrupt MemoryCache snapshot");
+        }
+        return header;
+    }
 
-                buf.insert(buf.end(), varr.begin(), varr.end());
-            }
+    // reads the next record, pointing `key` and `list` into the mapping
+    void record(SnapshotEncoding encoding, rocksdb::Slice& key, rocksdb::Slice& list) {
+        SnapshotRecord record;
+        memcpy(&record, take(sizeof(record)), sizeof(record));
+        size_t unit = encoding == SnapshotEncoding::grids ? sizeof(value_type) : 1;
+        if (record.key_length > size_ || record.list_length > size_ / unit) {
+            throw std::runtime_error("corrupt MemoryCache snapshot");
         }
+        size_t key_length = static_cast<size_t>(record.key_length);
+        key = rocksdb::Slice(take(key_length), key_length);
+        size_t list_length = static_cast<size_t>(record.list_length) * unit;
+        list = rocksdb::Slice(take(list_length), list_length);
+    }
+
+  private:
+    const char* take(size_t length) {
+        size_t padded = length + snapshotPadding(length);
+        if (padded > size_ - offset_) throw std::runtime_error("truncated MemoryCache snapshot");
+        const char* ptr = data_ + offset_;
+        offset_ += padded;
+        return ptr;
+    }
+
+    const char* data_;
+    size_t size_;
+    size_t offset_;
+};
+
+// Stores a list read from a snapshot, converting it if the snapshot was
+// saved by a cache with the other storage mode
+inline void loadList(rocksdb::Slice const& list, SnapshotEncoding encoding, poolarray& out) {
+    if (encoding == SnapshotEncoding::grids) {
+        out.resize(list.size() / sizeof(value_type));
+        if (!out.empty()) memcpy(out.data(), list.data(), list.size());
+        return;
+    }
+    intarray grids;
+    if (!list.empty()) decodeMessage(list, grids, std::numeric_limits<size_t>::max());
+    out.assign(grids.begin(), grids.end());
+}
+
+inline void loadList(rocksdb::Slice const& list, SnapshotEncoding encoding, poolstring& out) {
+    if (encoding == SnapshotEncoding::messages) {
+        out.assign(list.data(), list.size());
+        return;
+    }
+    if (list.empty()) return;
+    intarray grids(list.size() / sizeof(value_type));
+    memcpy(grids.data(), list.data(), list.size());
+    std::string encoded = encodeVec(grids);
+    out.assign(encoded.data(), encoded.size());
+}
+
+} // namespace
+
+intarray MemoryCache::__get(const std::string& phrase, langfield_type langfield) {
+    intarray array;
+    std::string phrase_with_langfield = phrase;
+
+    add_langfield(phrase_with_langfield, langfield);
+    MemoryCacheShard& shard = shardFor(phrase_with_langfield);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (compact_) {
+        auto pitr = shard.data->packed.find(phrase_with_langfield);
+        if (pitr != shard.data->packed.end() && !pitr->second.empty()) {
+            decodeMessage(rocksdb::Slice(pitr->second.data(), pitr->second.size()), array, std::numeric_limits<size_t>::max());
+        }
+        return array;
+    }
+
+    auto aitr = shard.data->cache.find(phrase_with_langfield);
+    if (aitr != shard.data->cache.end()) {
+        // lists are kept sorted and deduplicated by _set, so this is a straight copy
+        array.assign(aitr->second.begin(), aitr->second.end());
+    }
+    return array;
+}
+
+intarray MemoryCache::__getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+    std::vector<std::string> prefixes = matchingPrefixes(phrase_ref, match_prefixes);
+
+    auto locks = lockAll();
+    if (compact_) {
+        std::vector<std::tuple<poolstring const*, bool>> lists;
+        for (auto const& shard : shards_) {
+            findLists(shard->data->packed, prefixes, langfield, lists);
+        }
+        return mergeLists(lists, max_results);
+    }
+    std::vector<std::tuple<poolarray const*, bool>> lists;
+    for (auto const& shard : shards_) {
+        findLists(shard->data->cache, prefixes, langfield, lists);
+    }
+    return mergeLists(lists, max_results);
+}
+
+std::unique_ptr<GridCursor> MemoryCache::__getmatchingCursor(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+    std::vector<std::string> prefixes = matchingPrefixes(phrase_ref, match_prefixes);
+
+    if (compact_) {
+        std::unique_ptr<SnapshotCursor<VarintSource, std::string>> cursor(new SnapshotCursor<VarintSource, std::string>(max_results));
+        auto locks = lockAll();
+        std::vector<std::tuple<poolstring const*, bool>> lists;
+        for (auto const& shard : shards_) {
+            findLists(shard->data->packed, prefixes, langfield, lists);
+        }
+        cursor->copy(lists, max_results);
+        return std::unique_ptr<GridCursor>(std::move(cursor));
+    }
+    std::unique_ptr<SnapshotCursor<ArraySource, intarray>> cursor(new SnapshotCursor<ArraySource, intarray>(max_results));
+    auto locks = lockAll();
+    std::vector<std::tuple<poolarray const*, bool>> lists;
+    for (auto const& shard : shards_) {
+        findLists(shard->data->cache, prefixes, langfield, lists);
+    }
+    cursor->copy(lists, max_results);
+    return std::unique_ptr<GridCursor>(std::move(cursor));
+}
+
+// there's no I/O to save here, so batches are simply looked up one by one
+std::vector<intarray> MemoryCache::__getBatch(std::vector<BatchQuery> const& queries) {
+    std::vector<intarray> results;
+    results.reserve(queries.size());
+    for (BatchQuery const& query : queries) {
+        results.emplace_back(__get(query.phrase, query.langfield));
+    }
+    return results;
+}
+
+std::vector<intarray> MemoryCache::__getmatchingBatch(std::vector<BatchQuery> const& queries, size_t max_results) {
+    std::vector<intarray> results;
+    results.reserve(queries.size());
+    for (BatchQuery const& query : queries) {
+        results.emplace_back(__getmatching(query.phrase, query.match_prefixes, query.langfield, max_results));
+    }
+    return results;
+}
+
+MemoryCacheShardData::MemoryCacheShardData()
+    : pool(),
+      cache(SliceLess(), arraycache::allocator_type(&pool)),
+      packed(SliceLess(), packedcache::allocator_type(&pool)) {}
+
+MemoryCacheShard::MemoryCacheShard()
+    : data(new MemoryCacheShardData()),
+      mutex() {}
+
+MemoryCache::MemoryCache()
+    : MemoryCache(false) {}
+
+MemoryCache::MemoryCache(bool compact, unsigned shards)
+    : shards_(),
+      compact_(compact) {
+    if (shards < 1) shards = 1;
+    for (unsigned i = 0; i < shards; i++) {
+        shards_.emplace_back(new MemoryCacheShard());
+    }
+}
+
+MemoryCache::~MemoryCache() = default;
+
+size_t MemoryCache::shardIndex(rocksdb::Slice const& key) const {
+    if (shards_.size() == 1) return 0;
+    // FNV-1a, which hashes a Slice without copying it into a string first
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.size(); i++) {
+        hash = (hash ^ static_cast<unsigned char>(key[i])) * 1099511628211ULL;
+    }
+    return static_cast<size_t>(hash % shards_.size());
+}
+
+MemoryCacheShard& MemoryCache::shardFor(rocksdb::Slice const& key) {
+    return *shards_[shardIndex(key)];
+}
+
+// locks every shard, always in the same order so that two threads doing
+// this can't deadlock
+std::vector<std::unique_lock<std::mutex>> MemoryCache::lockAll() {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(shards_.size());
+    for (auto const& shard : shards_) {
+        locks.emplace_back(shard->mutex);
     }
+    return locks;
+}
 
-    for (auto const& item : memoized_prefixes) {
-        // copy the deque into a vector so we can sort without
-        // modifying the original array
-        intarray varr(item.second.begin(), item.second.end());
+MemoryUsage MemoryCache::memoryUsage() {
+    auto locks = lockAll();
+    MemoryUsage usage{0, 0};
+    for (auto const& shard : shards_) {
+        usage.allocated += shard->data->pool.allocated();
+        usage.used += shard->data->pool.used();
+    }
+    return usage;
+}
 
-        // delta-encode values, sorted in descending order.
-        std::sort(varr.begin(), varr.end(), std::greater<uint64_t>());
-        // remove duplicates
-        varr.erase(std::unique(varr.begin(), varr.end()), varr.end());
+bool MemoryCache::pack(const std::string& filename, PackOptions const& pack_options) {
+    std::unique_ptr<rocksdb::DB> db;
+    rocksdb::Options options = cacheDBOptions();
+    options.create_if_missing = true;
+    options.compression = pack_options.compression;
+    rocksdb::Status status = OpenDB(options, filename, db);
 
-        packVec(varr, db, item.first);
+    if (!status.ok()) {
+        throw std::invalid_argument("unable to open rocksdb file for packing");
     }
 
+    auto locks = lockAll();
+    PackProgress progress(pack_options.progress);
+    if (pack_options.threads > 1) {
+        if (compact_) {
+            packParallel(sortedItems(shards_, &MemoryCacheShardData::packed), db, options, filename, pack_options, progress);
+        } else {
+            packParallel(sortedItems(shards_, &MemoryCacheShardData::cache), db, options, filename, pack_options, progress);
+        }
+    } else if (compact_) {
+        // compact lists are already encoded, so they're written out verbatim
+        packSerial(sortedItems(shards_, &MemoryCacheShardData::packed), db, pack_options, progress);
+    } else {
+        packSerial(sortedItems(shards_, &MemoryCacheShardData::cache), db, pack_options, progress);
+    }
+    progress.finish();
+
     return true;
 }
 
-std::vector<std::pair<std::string, langfield_type>> MemoryCache::list() {
-    std::vector<std::pair<std::string, langfield_type>> out;
+void MemoryCache::save(const std::string& filename) {
+    auto locks = lockAll();
+    if (compact_) {
+        writeSnapshot(sortedItems(shards_, &MemoryCacheShardData::packed), SnapshotEncoding::messages, filename);
+    } else {
+        writeSnapshot(sortedItems(shards_, &MemoryCacheShardData::cache), SnapshotEncoding::grids, filename);
+    }
+}
 
-    for (auto const& item : this->cache_) {
-        std::string phrase = item.first.substr(0, item.first.find(LANGFIELD_SEPARATOR));
-        langfield_type langfield = extract_langfield(item.first);
+// Loads into fresh shards, which only replace the current ones once the
+// whole snapshot has been read, so a bad file leaves the cache as it was
+void MemoryCache::load(const std::string& filename) {
+    MappedFile file(filename);
+    SnapshotReader reader(file.data(), file.size());
+    SnapshotHeader header = reader.header();
+
+    // the new contents are built up away from the shards, and each shard's
+    // lock is only held to swap them in
+    std::vector<std::unique_ptr<MemoryCacheShardData>> loaded;
+    for (size_t i = 0; i < shards_.size(); i++) {
+        loaded.emplace_back(new MemoryCacheShardData());
+    }
+    rocksdb::Slice key;
+    rocksdb::Slice list;
+    for (uint64_t i = 0; i < header.count; i++) {
+        reader.record(header.encoding, key, list);
+        MemoryCacheShardData& shard = *loaded[shardIndex(key)];
+        // snapshots are saved in key order, so every key goes on the end
+        rocksdb::Slice interned(shard.pool.intern(key.data(), key.size()), key.size());
+        if (compact_) {
+            auto itr = shard.packed.emplace_hint(shard.packed.end(), interned, poolstring(poolstring::allocator_type(&shard.pool)));
+            loadList(list, header.encoding, itr->second);
+        } else {
+            auto itr = shard.cache.emplace_hint(shard.cache.end(), interned, poolarray(poolarray::allocator_type(&shard.pool)));
+            loadList(list, header.encoding, itr->second);
+        }
+    }
 
-        out.emplace_back(phrase, langfield);
+    for (size_t i = 0; i < shards_.size(); i++) {
+        std::lock_guard<std::mutex> lock(shards_[i]->mutex);
+        shards_[i]->data.swap(loaded[i]);
     }
+    // the old contents are freed here, once no shard refers to them
+}
 
-    return out;
+std::vector<std::pair<std::string, langfield_type>> MemoryCache::list() {
+    auto locks = lockAll();
+    if (compact_) {
+        return listKeys(sortedItems(shards_, &MemoryCacheShardData::packed));
+    }
+    return listKeys(sortedItems(shards_, &MemoryCacheShardData::cache));
 }
 
 /**
- * Replaces or appends the data for a given key
+ * Replaces or appends the data for a given key. Lists are stored sorted in
+ * descending order with duplicate grids removed.
  *
  * @name set
  * @memberof MemoryCache
@@ -183,25 +883,36 @@ std::vector<std::pair<std::string, langfield_type>> MemoryCache::list() {
  */
 
 void MemoryCache::_set(std::string key_id, std::vector<uint64_t> data, langfield_type langfield, bool append) {
-    arraycache& arrc = this->cache_;
-    add_langfield(key_id, langfield);
-
-    auto itr2 = arrc.find(key_id);
-    if (itr2 == arrc.end()) {
-        arrc.emplace(key_id, intarray());
-    }
-    intarray& vv = arrc[key_id];
-
-    size_t array_size = data.size();
+    this->_set(std::move(key_id), data.data(), data.size(), langfield, append);
+}
 
-    if (append) {
-        vv.reserve(vv.size() + array_size);
-    } else {
-        if (itr2 != arrc.end()) vv.clear();
-        vv.reserve(array_size);
+// Copies `length` grids starting at `data` into the cache; see mergeGrids
+void MemoryCache::_set(std::string key_id, const void* data, size_t length, langfield_type langfield, bool append) {
+    add_langfield(key_id, langfield);
+    MemoryCacheShard& shard = shardFor(key_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    if (compact_) {
+        // compact lists are decoded, merged and encoded again, so appending
+        // to a long list piece by piece is comparatively slow
+        poolstring& message = findOrAdd(shard.data->packed, shard.data->pool, key_id);
+        intarray vv;
+        if (append && !message.empty()) {
+            decodeMessage(rocksdb::Slice(message.data(), message.size()), vv, std::numeric_limits<size_t>::max());
+        }
+        mergeGrids(vv, vv.size(), data, length);
+        if (vv.empty()) {
+            message.clear();
+        } else {
+            std::string encoded = encodeVec(vv);
+            message.assign(encoded.data(), encoded.size());
+        }
+        message.shrink_to_fit();
+        return;
     }
 
-    vv.insert(vv.end(), data.begin(), data.end());
+    poolarray& vv = findOrAdd(shard.data->cache, shard.data->pool, key_id);
+    mergeGrids(vv, append ? vv.size() : 0, data, length);
 }
 
 } // namespace carmen
@@ -2,26 +2,107 @@
 #define __CARMEN_MEMORYCACHE_HPP__
 
 #include "cpp_util.hpp"
+#include "memorypool.hpp"
+
+#include <memory>
+#include <mutex>
 
 namespace carmen {
 
+// Everything a MemoryCache shard holds lives in its MemoryPool. Keys are
+// interned in the pool once, when first set, and referred to by Slices from
+// then on.
+struct SliceLess {
+    bool operator()(rocksdb::Slice const& a, rocksdb::Slice const& b) const {
+        return a.compare(b) < 0;
+    }
+};
+
+typedef std::vector<value_type, PoolAllocator<value_type>> poolarray;
+typedef std::basic_string<char, std::char_traits<char>, PoolAllocator<char>> poolstring;
+
+typedef std::map<rocksdb::Slice, poolarray, SliceLess, PoolAllocator<std::pair<const rocksdb::Slice, poolarray>>> arraycache;
+// compact storage: each list is held as the delta-encoded message that pack
+// writes out, rather than as a vector of raw 64-bit grids
+typedef std::map<rocksdb::Slice, poolstring, SliceLess, PoolAllocator<std::pair<const rocksdb::Slice, poolstring>>> packedcache;
+
+// What one shard of a MemoryCache holds
+struct MemoryCacheShardData : noncopyable {
+    MemoryCacheShardData();
+
+    // declared first so that it outlives the containers allocating from it
+    MemoryPool pool;
+    arraycache cache;
+    packedcache packed;
+};
+
+// One shard of a MemoryCache; each shard has its own pool and lock, so
+// threads writing to different shards don't contend. The shard itself stays
+// put for the life of the cache, while load() swaps its data for new data
+// under the lock.
+struct MemoryCacheShard : noncopyable {
+    MemoryCacheShard();
+
+    std::unique_ptr<MemoryCacheShardData> data;
+    std::mutex mutex;
+};
+
+// bytes reserved by a MemoryCache's pools, and the share of them in use
+struct MemoryUsage {
+    size_t allocated;
+    size_t used;
+};
+
+// Every method is safe to call from several threads at once. Keys are
+// spread over the shards by hash: writes only lock the shard their key
+// falls in, while reads and pack that span many keys lock all of them.
+// pack, save and list hold every lock until they're done, so lookups and
+// writes on other threads wait for the whole of a pack.
 class MemoryCache {
   public:
     MemoryCache();
+    explicit MemoryCache(bool compact, unsigned shards = 1);
     ~MemoryCache();
+    MemoryCache(MemoryCache&& other) = default;
+    MemoryCache& operator=(MemoryCache&& other) = default;
 
-    bool pack(const std::string& filename);
+    bool pack(const std::string& filename, PackOptions const& pack_options = PackOptions());
+    // Writes every key and list to a flat snapshot file that load() reads
+    // back, replacing whatever the cache held. Calls that run alongside
+    // load() see each shard either as it was or as loaded. Snapshots
+    // are tied to the machine's byte order and aren't meant to be portable.
+    void save(const std::string& filename);
+    void load(const std::string& filename);
     std::vector<std::pair<std::string, langfield_type>> list();
 
     void _set(std::string key_id, std::vector<uint64_t>, langfield_type langfield, bool append);
+    void _set(std::string key_id, const void* data, size_t length, langfield_type langfield, bool append);
 
     std::vector<uint64_t> _get(std::string& phrase, std::vector<uint64_t> languages);
     std::vector<uint64_t> _getmatching(std::string phrase, PrefixMatch match_prefixes, std::vector<uint64_t> languages);
 
     std::vector<uint64_t> __get(const std::string& phrase, langfield_type langfield);
     std::vector<uint64_t> __getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results);
+    // the same grids as __getmatching, read one at a time from copies of
+    // the matching lists taken when the cursor is made. The cache is only
+    // locked while they're copied, and later writes don't show up in it.
+    std::unique_ptr<GridCursor> __getmatchingCursor(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results);
+
+    // answer many lookups at once, in the order they're given
+    std::vector<intarray> __getBatch(std::vector<BatchQuery> const& queries);
+    std::vector<intarray> __getmatchingBatch(std::vector<BatchQuery> const& queries, size_t max_results);
+
+    bool compact() const { return compact_; }
+    size_t shards() const { return shards_.size(); }
+    MemoryUsage memoryUsage();
+
+  private:
+    size_t shardIndex(rocksdb::Slice const& key) const;
+    MemoryCacheShard& shardFor(rocksdb::Slice const& key);
+    std::vector<std::unique_lock<std::mutex>> lockAll();
 
-    arraycache cache_;
+    std::vector<std::unique_ptr<MemoryCacheShard>> shards_;
+    bool compact_;
 };
 
 } // namespace carmen
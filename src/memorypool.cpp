@@ -0,0 +1,113 @@
+#include "memorypool.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+namespace carmen {
+
+namespace {
+
+constexpr size_t POOL_BLOCK_SIZE = 1 << 20;
+constexpr size_t POOL_ALIGNMENT = 8;
+
+// Allocations of up to 256 bytes are rounded up to a multiple of 8, which
+// fits map nodes and short lists snugly; beyond that, size classes go up in
+// powers of two, which is how vectors grow anyway. Anything bigger than
+// POOL_MAX_CHUNK is passed straight through to the system allocator.
+constexpr size_t POOL_SMALL_LIMIT = 256;
+constexpr size_t POOL_SMALL_CLASSES = POOL_SMALL_LIMIT / POOL_ALIGNMENT;
+constexpr size_t POOL_MAX_CHUNK = 64 * 1024;
+constexpr size_t POOL_CLASSES = POOL_SMALL_CLASSES + 8;
+
+inline size_t sizeClass(size_t bytes) {
+    if (bytes <= POOL_SMALL_LIMIT) return (bytes + POOL_ALIGNMENT - 1) / POOL_ALIGNMENT - 1;
+    size_t cls = POOL_SMALL_CLASSES;
+    for (size_t size = POOL_SMALL_LIMIT * 2; size < bytes; size <<= 1) {
+        cls++;
+    }
+    return cls;
+}
+
+inline size_t classSize(size_t cls) {
+    if (cls < POOL_SMALL_CLASSES) return (cls + 1) * POOL_ALIGNMENT;
+    return (POOL_SMALL_LIMIT * 2) << (cls - POOL_SMALL_CLASSES);
+}
+
+} // namespace
+
+MemoryPool::MemoryPool()
+    : blocks_(),
+      cursor_(nullptr),
+      end_(nullptr),
+      free_lists_(POOL_CLASSES, nullptr),
+      allocated_(0),
+      used_(0) {}
+
+MemoryPool::~MemoryPool() {
+    for (char* block : blocks_) {
+        ::operator delete(block);
+    }
+}
+
+// bump-allocates from the current block, starting a new one when it runs
+// out; whatever is left at the end of the old block is abandoned
+char* MemoryPool::carve(size_t bytes) {
+    if (static_cast<size_t>(end_ - cursor_) < bytes) {
+        size_t block_size = std::max(bytes, POOL_BLOCK_SIZE);
+        cursor_ = static_cast<char*>(::operator new(block_size));
+        end_ = cursor_ + block_size;
+        blocks_.push_back(cursor_);
+        allocated_ += block_size;
+    }
+    char* ptr = cursor_;
+    cursor_ += bytes;
+    return ptr;
+}
+
+void* MemoryPool::allocate(size_t bytes) {
+    if (bytes == 0) bytes = 1;
+    if (bytes > POOL_MAX_CHUNK) {
+        void* ptr = ::operator new(bytes);
+        allocated_ += bytes;
+        used_ += bytes;
+        return ptr;
+    }
+
+    size_t cls = sizeClass(bytes);
+    used_ += classSize(cls);
+
+    // freed chunks hold a pointer to the next free chunk of the same class
+    void* ptr = free_lists_[cls];
+    if (ptr != nullptr) {
+        memcpy(&free_lists_[cls], ptr, sizeof(void*));
+        return ptr;
+    }
+    return carve(classSize(cls));
+}
+
+void MemoryPool::deallocate(void* ptr, size_t bytes) noexcept {
+    if (ptr == nullptr) return;
+    if (bytes == 0) bytes = 1;
+    if (bytes > POOL_MAX_CHUNK) {
+        ::operator delete(ptr);
+        allocated_ -= bytes;
+        used_ -= bytes;
+        return;
+    }
+
+    size_t cls = sizeClass(bytes);
+    used_ -= classSize(cls);
+    memcpy(ptr, &free_lists_[cls], sizeof(void*));
+    free_lists_[cls] = ptr;
+}
+
+const char* MemoryPool::intern(const char* data, size_t length) {
+    size_t rounded = (length + POOL_ALIGNMENT - 1) / POOL_ALIGNMENT * POOL_ALIGNMENT;
+    char* ptr = carve(rounded);
+    if (length > 0) memcpy(ptr, data, length);
+    used_ += rounded;
+    return ptr;
+}
+
+} // namespace carmen
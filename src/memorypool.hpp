@@ -0,0 +1,87 @@
+#ifndef __CARMEN_MEMORYPOOL_HPP__
+#define __CARMEN_MEMORYPOOL_HPP__
+
+#include "cpp_util.hpp"
+
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace carmen {
+
+// A memory pool for the many small, long-lived allocations that make up a
+// MemoryCache: map nodes, grid lists and keys. Memory is carved out of large
+// blocks, and freed allocations go onto a free list for their size class to
+// be reused, so building a cache rarely reaches malloc and the whole lot is
+// handed back in one go when the pool is destroyed.
+//
+// Not thread-safe; every pool belongs to a single MemoryCache shard and is
+// only used under that shard's lock.
+class MemoryPool : noncopyable {
+  public:
+    MemoryPool();
+    ~MemoryPool();
+
+    void* allocate(size_t bytes);
+    void deallocate(void* ptr, size_t bytes) noexcept;
+
+    // copies `length` bytes into the pool, where they stay until the pool is
+    // destroyed
+    const char* intern(const char* data, size_t length);
+
+    // bytes reserved from the system, and the share of them currently
+    // handed out; the difference is fragmentation and unused block space
+    size_t allocated() const { return allocated_; }
+    size_t used() const { return used_; }
+
+  private:
+    char* carve(size_t bytes);
+
+    std::vector<char*> blocks_;
+    char* cursor_;
+    char* end_;
+    std::vector<void*> free_lists_;
+    size_t allocated_;
+    size_t used_;
+};
+
+// std-compatible allocator drawing from a MemoryPool
+template <typename T>
+class PoolAllocator {
+  public:
+    typedef T value_type;
+    // containers carry their pool with them when moved or swapped
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    explicit PoolAllocator(MemoryPool* pool) noexcept : pool_(pool) {}
+    template <typename U>
+    PoolAllocator(PoolAllocator<U> const& other) noexcept : pool_(other.pool()) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(pool_->allocate(n * sizeof(T)));
+    }
+    void deallocate(T* ptr, size_t n) noexcept {
+        pool_->deallocate(ptr, n * sizeof(T));
+    }
+
+    MemoryPool* pool() const noexcept { return pool_; }
+
+  private:
+    MemoryPool* pool_;
+};
+
+template <typename T, typename U>
+inline bool operator==(PoolAllocator<T> const& a, PoolAllocator<U> const& b) noexcept {
+    return a.pool() == b.pool();
+}
+
+template <typename T, typename U>
+inline bool operator!=(PoolAllocator<T> const& a, PoolAllocator<U> const& b) noexcept {
+    return a.pool() != b.pool();
+}
+
+} // namespace carmen
+
+#endif // __CARMEN_MEMORYPOOL_HPP__
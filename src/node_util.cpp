@@ -34,4 +34,91 @@ Local<Array> contextToArray(Context const& context) {
     return array;
 }
 
+// convert from the JS options object accepted by pack() to a PackOptions;
+// returns false, having thrown a JS TypeError, if the options are invalid
+bool packOptionsFromObject(Local<Value> const& options_val, PackOptions& pack_options) {
+    if (options_val->IsNull() || options_val->IsUndefined()) return true;
+    if (!options_val->IsObject()) {
+        Nan::ThrowTypeError("options, if supplied, must be an object");
+        return false;
+    }
+    Local<Object> options = options_val->ToObject();
+
+    if (options->Has(Nan::New("threads").ToLocalChecked())) {
+        Local<Value> prop_val = options->Get(Nan::New("threads").ToLocalChecked());
+        if (!prop_val->IsNumber()) {
+            Nan::ThrowTypeError("threads must be a number");
+            return false;
+        }
+        int64_t _threads = prop_val->IntegerValue();
+        if (_threads < 1) {
+            Nan::ThrowTypeError("threads must be a positive integer");
+            return false;
+        }
+        if (_threads > MAX_PACK_THREADS) {
+            Nan::ThrowTypeError(("threads must be no more than " + std::to_string(MAX_PACK_THREADS)).c_str());
+            return false;
+        }
+        pack_options.threads = static_cast<unsigned>(_threads);
+    }
+
+    for (auto const& threshold : {std::make_pair("memoMinKeys", &pack_options.memo_min_keys), std::make_pair("memoMinGrids", &pack_options.memo_min_grids), std::make_pair("memoMaxGrids", &pack_options.memo_max_grids), std::make_pair("spatialMinGrids", &pack_options.spatial_min_grids)}) {
+        if (!options->Has(Nan::New(threshold.first).ToLocalChecked())) continue;
+        Local<Value> prop_val = options->Get(Nan::New(threshold.first).ToLocalChecked());
+        if (!prop_val->IsNumber() || prop_val->NumberValue() < 0) {
+            Nan::ThrowTypeError((std::string(threshold.first) + " must be a non-negative number").c_str());
+            return false;
+        }
+        *threshold.second = static_cast<size_t>(prop_val->IntegerValue());
+    }
+
+    if (options->Has(Nan::New("compression").ToLocalChecked())) {
+        Local<Value> prop_val = options->Get(Nan::New("compression").ToLocalChecked());
+        static const std::map<std::string, rocksdb::CompressionType> compressions{
+            {"none", rocksdb::kNoCompression},
+            {"snappy", rocksdb::kSnappyCompression},
+            {"zlib", rocksdb::kZlibCompression},
+            {"lz4", rocksdb::kLZ4Compression},
+            {"zstd", rocksdb::kZSTD}};
+        auto itr = prop_val->IsString() ? compressions.find(*Nan::Utf8String(prop_val)) : compressions.end();
+        if (itr == compressions.end()) {
+            Nan::ThrowTypeError("compression must be one of 'none', 'snappy', 'zlib', 'lz4' or 'zstd'");
+            return false;
+        }
+        pack_options.compression = itr->second;
+    }
+
+    if (options->Has(Nan::New("format").ToLocalChecked())) {
+        Local<Value> prop_val = options->Get(Nan::New("format").ToLocalChecked());
+        static const std::map<std::string, GridFormat> formats{
+            {"varint", GridFormat::varint},
+            {"blocks", GridFormat::blocks}};
+        auto itr = prop_val->IsString() ? formats.find(*Nan::Utf8String(prop_val)) : formats.end();
+        if (itr == formats.end()) {
+            Nan::ThrowTypeError("format must be either 'varint' or 'blocks'");
+            return false;
+        }
+        pack_options.format = itr->second;
+    }
+
+    if (options->Has(Nan::New("skipIndex").ToLocalChecked())) {
+        Local<Value> prop_val = options->Get(Nan::New("skipIndex").ToLocalChecked());
+        if (!prop_val->IsBoolean()) {
+            Nan::ThrowTypeError("skipIndex must be a Boolean");
+            return false;
+        }
+        pack_options.skip_index = prop_val->BooleanValue();
+    }
+    if (pack_options.skip_index && pack_options.format != GridFormat::varint) {
+        Nan::ThrowTypeError("skipIndex only applies to the 'varint' format");
+        return false;
+    }
+    if (pack_options.spatial_min_grids > 0 && pack_options.format != GridFormat::varint) {
+        Nan::ThrowTypeError("spatialMinGrids only applies to the 'varint' format");
+        return false;
+    }
+
+    return true;
+}
+
 } // namespace carmen
@@ -27,6 +27,7 @@ using namespace v8;
 
 Local<Object> coverToObject(Cover const& cover);
 Local<Array> contextToArray(Context const& context);
+bool packOptionsFromObject(Local<Value> const& options_val, PackOptions& pack_options);
 
 constexpr unsigned MAX_LANG = (sizeof(langfield_type) * 8) - 1;
 // convert from a JS array of language IDs to a bitmask where the bits corresponding
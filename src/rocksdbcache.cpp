@@ -2,29 +2,46 @@
 #include "rocksdbcache.hpp"
 #include "cpp_util.hpp"
 
-namespace carmen {
+#include "rocksdb/env.h"
+#include <mutex>
+#include <numeric>
 
-intarray RocksDBCache::__get(const std::string& phrase, langfield_type langfield) {
-    intarray array;
-    std::string phrase_with_langfield = phrase;
+namespace carmen {
 
-    add_langfield(phrase_with_langfield, langfield);
-    std::string message;
-    rocksdb::Status s = db->Get(rocksdb::ReadOptions(), phrase_with_langfield, &message);
-    if (s.ok()) {
-        decodeMessage(message, array, std::numeric_limits<size_t>::max());
+namespace {
+
+// Prefix scans hold on to every value they visit until they're done merging,
+// so their iterators pin the blocks they read: the value slices then point
+// straight into RocksDB's memory instead of being copied out. This relies on
+// the cache never using a merge operator, which would make values temporary.
+//
+// An exact match seeks to "phrase|", which is a whole prefix as far as the
+// prefix extractor goes, so the bloom filters can rule out tables that don't
+// have the phrase; so does a read of a hot-prefix memo, which seeks to
+// "=+prefix|". Other scans seek to targets outside of the extractor's domain
+// and need to ignore it.
+inline rocksdb::ReadOptions scanReadOptions(PrefixMatch match_prefixes) {
+    rocksdb::ReadOptions options;
+    options.pin_data = true;
+    if (match_prefixes == PrefixMatch::disabled) {
+        options.prefix_same_as_start = true;
+    } else {
+        options.total_order_seek = true;
     }
-
-    return array;
+    return options;
 }
 
-intarray RocksDBCache::__getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
-    intarray array;
+// The key a scan for `phrase_ref` seeks to: the phrase itself, followed by
+// the langfield separator for an exact match, or the matching memoized
+// prefix for short autocomplete scans unless `use_memos` is false
+std::string scanTarget(const std::string& phrase_ref, PrefixMatch match_prefixes, bool use_memos = true) {
     std::string phrase = phrase_ref;
 
     if (match_prefixes == PrefixMatch::disabled) {
         phrase.push_back(LANGFIELD_SEPARATOR);
+        return phrase;
     }
+    if (!use_memos) return phrase;
 
     size_t phrase_length = phrase.length();
     if (match_prefixes == PrefixMatch::word_boundary) {
@@ -34,29 +51,27 @@ intarray RocksDBCache::__getmatching(const std::string& phrase_ref, PrefixMatch
         phrase_length++;
     }
 
-    // Load values from message cache
-    std::vector<std::tuple<std::string, bool>> messages;
-    std::vector<sortableGrid> grids;
-
-    if (match_prefixes != PrefixMatch::disabled) {
-        // if this is an autocomplete scan, use the prefix cache
-        if (phrase_length <= MEMO_PREFIX_LENGTH_T1) {
-            phrase = "=1" + phrase.substr(0, MEMO_PREFIX_LENGTH_T1);
-        } else if (phrase_length <= MEMO_PREFIX_LENGTH_T2) {
-            phrase = "=2" + phrase.substr(0, MEMO_PREFIX_LENGTH_T2);
-        }
+    // if this is an autocomplete scan, use the prefix cache
+    if (phrase_length <= MEMO_PREFIX_LENGTH_T1) {
+        phrase = "=1" + phrase.substr(0, MEMO_PREFIX_LENGTH_T1);
+    } else if (phrase_length <= MEMO_PREFIX_LENGTH_T2) {
+        phrase = "=2" + phrase.substr(0, MEMO_PREFIX_LENGTH_T2);
     }
+    return phrase;
+}
 
-    radix_max_heap::pair_radix_max_heap<uint64_t, size_t> rh;
-
-    std::unique_ptr<rocksdb::Iterator> rit(db->NewIterator(rocksdb::ReadOptions()));
-    for (rit->Seek(phrase); rit->Valid() && rit->key().ToString().compare(0, phrase.size(), phrase) == 0; rit->Next()) {
-        std::string key = rit->key().ToString();
+// Collects the value of every key starting with `phrase`, along with whether
+// its langfield matches the requested one, and the keys themselves if `keys`
+// isn't null
+void collectMessages(rocksdb::Iterator& rit, std::string const& phrase, PrefixMatch match_prefixes, langfield_type langfield, std::vector<std::tuple<rocksdb::Slice, bool>>& messages, std::vector<std::string>* keys = nullptr) {
+    for (rit.Seek(phrase); rit.Valid() && rit.key().starts_with(phrase); rit.Next()) {
+        rocksdb::Slice key = rit.key();
 
         if (match_prefixes == PrefixMatch::word_boundary) {
             // Read one character beyond the input prefix length, should always
             // be safe because of the LANGFIELD_SEPARATOR
-            char endChar = key.at(phrase.length());
+            if (key.size() <= phrase.length()) continue;
+            char endChar = key[phrase.length()];
             if (endChar != LANGFIELD_SEPARATOR && endChar != ' ') {
                 continue;
             }
@@ -66,107 +81,547 @@ intarray RocksDBCache::__getmatching(const std::string& phrase_ref, PrefixMatch
         langfield_type message_langfield = extract_langfield(key);
         auto matches_language = static_cast<bool>(message_langfield & langfield);
 
-        messages.emplace_back(std::make_tuple(rit->value().ToString(), matches_language));
+        messages.emplace_back(std::make_tuple(rit.value(), matches_language));
+        if (keys != nullptr) keys->emplace_back(key.data(), key.size());
+    }
+}
+
+// The key a scan for `phrase` seeks to among the hot-prefix memos, or an
+// empty string if the cache has no memos of the right length. A
+// word-boundary scan is served by the memo of the phrase followed by a
+// space, plus the keys of the phrase itself.
+std::string hotMemoTarget(std::string const& phrase, PrefixMatch match_prefixes, uint64_t memo_lengths) {
+    if (match_prefixes == PrefixMatch::disabled) return std::string();
+
+    size_t length = phrase.size() + (match_prefixes == PrefixMatch::word_boundary ? 1 : 0);
+    if (length <= MEMO_PREFIX_LENGTH_T2 || length > MEMO_PREFIX_MAX_LENGTH) return std::string();
+    if (!(memo_lengths & (uint64_t(1) << length))) return std::string();
+
+    std::string target = "=+" + phrase;
+    if (match_prefixes == PrefixMatch::word_boundary) target.push_back(' ');
+    target.push_back(LANGFIELD_SEPARATOR);
+    return target;
+}
+
+// The iterators a run of scans reads through, opened as they're first
+// needed: one for exact matches, which the hot-prefix memos are read
+// through as well, and one for prefix scans
+struct ScanIterators {
+    explicit ScanIterators(rocksdb::DB& database)
+        : db(database),
+          exact(),
+          scan() {}
+
+    rocksdb::Iterator& get(PrefixMatch match_prefixes) {
+        std::unique_ptr<rocksdb::Iterator>& rit = match_prefixes == PrefixMatch::disabled ? exact : scan;
+        if (!rit) rit.reset(db.NewIterator(scanReadOptions(match_prefixes)));
+        return *rit;
+    }
+
+    rocksdb::DB& db;
+    std::unique_ptr<rocksdb::Iterator> exact;
+    std::unique_ptr<rocksdb::Iterator> scan;
+};
+
+// Whether any of the lists in `messages` holds `max_grids` or more grids,
+// and so may be a memoized list that pack cut short
+bool memoCapped(std::vector<std::tuple<rocksdb::Slice, bool>> const& messages, GridFormat format, size_t max_grids) {
+    for (std::tuple<rocksdb::Slice, bool> const& message : messages) {
+        if (countGrids(format, std::get<0>(message)) >= max_grids) return true;
+    }
+    return false;
+}
+
+// Collects the lists a scan for `phrase` has to merge into `messages`, which
+// has to start out empty: from a memo if there's one for the phrase, and by
+// scanning every matching key otherwise. Capped memos keep the top grids of
+// each list, which is what normal scans are after, so only an extended scan
+// that needs more grids than the cap passes over a memo that may have lost
+// some of them. The keys of the lists go into `keys`, if it isn't null, in
+// the same order.
+void collectScan(ScanIterators& iterators, MemoLayout const& memos, GridFormat format, std::string const& phrase, PrefixMatch match_prefixes, langfield_type langfield, size_t needed, std::vector<std::tuple<rocksdb::Slice, bool>>& messages, std::vector<std::string>* keys = nullptr) {
+    bool check_cap = memos.max_grids > 0 && needed > PREFIX_MAX_GRID_LENGTH && needed > memos.max_grids;
+    auto clear = [&messages, keys]() {
+        messages.clear();
+        if (keys != nullptr) keys->clear();
+    };
+
+    std::string memo_target = hotMemoTarget(phrase, match_prefixes, memos.hot_lengths);
+    if (!memo_target.empty()) {
+        // only some prefixes of each length are hot, so this can come up empty
+        rocksdb::Iterator& rit = iterators.get(PrefixMatch::disabled);
+        collectMessages(rit, memo_target, PrefixMatch::disabled, langfield, messages, keys);
+        if (check_cap && memoCapped(messages, format, memos.max_grids)) {
+            clear();
+        } else if (!messages.empty()) {
+            if (match_prefixes == PrefixMatch::word_boundary) {
+                collectMessages(rit, phrase + LANGFIELD_SEPARATOR, PrefixMatch::disabled, langfield, messages, keys);
+            }
+            return;
+        }
     }
 
+    std::string target = scanTarget(phrase, match_prefixes);
+    std::string full_target = scanTarget(phrase, match_prefixes, false);
+    rocksdb::Iterator& rit = iterators.get(match_prefixes);
+    collectMessages(rit, target, match_prefixes, langfield, messages, keys);
+    if (check_cap && target != full_target && memoCapped(messages, format, memos.max_grids)) {
+        clear();
+        collectMessages(rit, full_target, match_prefixes, langfield, messages, keys);
+    }
+}
+
+// Hands `fn` each cell of the spatial copy of the list under `key` that
+// overlaps `box`, given the shift the list was split with
+template <typename Fn>
+void forEachCell(rocksdb::Iterator& rit, std::string const& key, unsigned shift, const uint64_t box[4], Fn const& fn) {
+    uint32_t min_x = static_cast<uint32_t>(std::min<uint64_t>(box[0] >> 20, POW2_14M1)) >> shift;
+    uint32_t min_y = static_cast<uint32_t>(std::min<uint64_t>(box[1] >> 34, POW2_14M1)) >> shift;
+    uint32_t max_x = static_cast<uint32_t>(std::min<uint64_t>(box[2] >> 20, POW2_14M1)) >> shift;
+    uint32_t max_y = static_cast<uint32_t>(std::min<uint64_t>(box[3] >> 34, POW2_14M1)) >> shift;
+    if (min_x > max_x || min_y > max_y) return;
+
+    // every cell in the box has a code between those of its corners, though
+    // not every code in between is in the box
+    std::string prefix = spatialPrefix(key);
+    rocksdb::Slice langfield = langfieldBytes(key);
+    std::string target(prefix);
+    appendCell(target, mortonCode(min_x, min_y));
+    uint32_t last = mortonCode(max_x, max_y);
+    for (rit.Seek(target); rit.Valid() && rit.key().starts_with(prefix); rit.Next()) {
+        rocksdb::Slice cell_key = rit.key();
+        if (cell_key.size() < prefix.size() + 4) continue;
+        uint32_t cell = readCell(cell_key.data() + prefix.size());
+        if (cell > last) break;
+
+        // other langfields' cells are interleaved with this one's
+        cell_key.remove_prefix(prefix.size() + 4);
+        if (cell_key != langfield) continue;
+        uint32_t x, y;
+        mortonDecode(cell, x, y);
+        if (x < min_x || x > max_x || y < min_y || y > max_y) continue;
+        fn(rit.value());
+    }
+}
+
+// Queues up each of `messages` in a merge, boosting the ones whose
+// langfield matched
+template <typename Source>
+void addMessages(MergeCursor<Source>& cursor, std::vector<std::tuple<rocksdb::Slice, bool>> const& messages) {
+    for (std::tuple<rocksdb::Slice, bool> const& message : messages) {
+        uint64_t boost = std::get<1>(message) ? LANGUAGE_MATCH_BOOST : 0;
+        cursor.add(std::unique_ptr<Source>(new Source(std::get<0>(message), boost)));
+    }
+}
+
+template <typename Source>
+intarray mergeSources(std::vector<std::tuple<rocksdb::Slice, bool>> const& messages, size_t max_results) {
+    MergeCursor<Source> cursor(max_results);
+    addMessages(cursor, messages);
+    intarray array;
+    drainCursor(cursor, array);
+    return array;
+}
+
+intarray mergeMessages(std::vector<std::tuple<rocksdb::Slice, bool>> const& messages, GridFormat format, size_t max_results) {
+    intarray array;
+
     // short-circuit the priority queue merging logic if we only found one message
     // as will be the norm for exact matches in translationless indexes
     if (messages.size() == 1) {
-        if (std::get<1>(messages[0])) {
-            decodeAndBoostMessage(std::get<0>(messages[0]), array, max_results);
-        } else {
-            decodeMessage(std::get<0>(messages[0]), array, max_results);
-        }
+        decodeGrids(format, std::get<0>(messages[0]), array, max_results, std::get<1>(messages[0]));
         return array;
     }
+    if (format == GridFormat::blocks) return mergeSources<BlockSource>(messages, max_results);
+    return mergeSources<VarintSource>(messages, max_results);
+}
 
-    for (std::tuple<std::string, bool>& message : messages) {
-        protozero::pbf_reader item(std::get<0>(message));
-        bool matches_language = std::get<1>(message);
+// A merge that's read from lazily, which holds on to the iterators of its
+// scan so that the values they pinned stay valid
+template <typename Source>
+class ScanCursor final : public GridCursor {
+  public:
+    ScanCursor(rocksdb::DB& db, size_t max_results)
+        : iterators(db),
+          merge(max_results) {}
+
+    bool next(uint64_t& grid) override { return merge.next(grid); }
+
+    ScanIterators iterators;
+    MergeCursor<Source> merge;
+};
+
+template <typename Source>
+std::unique_ptr<GridCursor> scanCursor(rocksdb::DB& db, MemoLayout const& memos, GridFormat format, std::string const& phrase, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+    std::unique_ptr<ScanCursor<Source>> cursor(new ScanCursor<Source>(db, max_results));
+    std::vector<std::tuple<rocksdb::Slice, bool>> messages;
+    collectScan(cursor->iterators, memos, format, phrase, match_prefixes, langfield, max_results, messages);
+    addMessages(cursor->merge, messages);
+    return std::unique_ptr<GridCursor>(std::move(cursor));
+}
 
-        item.next(CACHE_ITEM);
-        auto vals = item.get_packed_uint64();
+// A cursor over a whole list out of the GridListCache
+class CachedCursor final : public GridCursor {
+  public:
+    explicit CachedCursor(std::shared_ptr<const CachedGridList> list)
+        : list_(std::move(list)),
+          pos_(0) {}
+
+    bool next(uint64_t& grid) override {
+        if (pos_ == list_->grids.size()) return false;
+        grid = list_->grids[pos_++];
+        return true;
+    }
 
-        if (vals.first != vals.second) {
-            value_type unadjusted_lastval = *(vals.first);
-            grids.emplace_back(
-                vals.first,
-                vals.second,
-                unadjusted_lastval,
-                matches_language);
-            rh.push(matches_language ? unadjusted_lastval | LANGUAGE_MATCH_BOOST : unadjusted_lastval, grids.size() - 1);
+  private:
+    std::shared_ptr<const CachedGridList> list_;
+    size_t pos_;
+};
+
+// opens the scan behind a cursor, from its first grid
+using ScanFactory = std::function<std::unique_ptr<GridCursor>()>;
+
+// Passes on the grids of a scan, starting with whatever part of its list the
+// GridListCache already has, and caches the grids it has passed on once it's
+// done with. coalesceSingle stops reading as soon as it has enough, and the
+// rest of a scan can run to hundreds of thousands of grids, so only the part
+// that was read is cached; a later cursor that needs more opens the scan
+// again and skips what it already has. A list that outgrows a shard of the
+// cache stops being collected as soon as it does.
+class CachingCursor final : public GridCursor {
+  public:
+    CachingCursor(std::shared_ptr<const CachedGridList> cached, ScanFactory scan, std::shared_ptr<GridListCache> cache, std::string key)
+        : cached_(std::move(cached)),
+          scan_(std::move(scan)),
+          cursor_(),
+          cache_(std::move(cache)),
+          key_(std::move(key)),
+          max_grids_(cache_->maxGrids(key_)),
+          pos_(0),
+          grids_(),
+          complete_(false) {}
+
+    ~CachingCursor() override {
+        // nothing to add unless the scan got further than the cached list
+        size_t cached_size = cached_ ? cached_->grids.size() : 0;
+        if (!cache_ || !cursor_ || (!complete_ && grids_.size() <= cached_size)) return;
+        std::shared_ptr<CachedGridList> list = std::make_shared<CachedGridList>();
+        list->grids = std::move(grids_);
+        list->complete = complete_;
+        cache_->put(key_, std::move(list));
+    }
+
+    bool next(uint64_t& grid) override {
+        if (cached_ && pos_ < cached_->grids.size()) {
+            grid = cached_->grids[pos_++];
+            return true;
+        }
+        if (!cursor_) resume();
+        if (complete_ || !cursor_->next(grid)) {
+            complete_ = true;
+            return false;
         }
+        pos_++;
+        if (cache_) collect(grid);
+        return true;
     }
 
-    while (!rh.empty() && array.size() < max_results) {
-        size_t gridIdx = rh.top_value();
-        uint64_t gridId = rh.top_key();
-        rh.pop();
+  private:
+    // opens the scan and skips the grids already passed on from the cache
+    void resume() {
+        cursor_ = scan_();
+        uint64_t skipped;
+        for (size_t i = 0; i < pos_ && !complete_; i++) {
+            complete_ = !cursor_->next(skipped);
+        }
+        if (cache_ && cached_) grids_.assign(cached_->grids.begin(), cached_->grids.end());
+    }
 
-        if (array.empty() || array.back() != gridId) array.emplace_back(gridId);
-        sortableGrid* sg = &(grids[gridIdx]);
-        sg->it++;
-        if (sg->it != sg->end) {
-            sg->unadjusted_lastval -= *(grids[gridIdx].it);
-            rh.push(
-                sg->matches_language ? sg->unadjusted_lastval | LANGUAGE_MATCH_BOOST : sg->unadjusted_lastval,
-                gridIdx);
+    void collect(uint64_t grid) {
+        grids_.emplace_back(grid);
+        if (grids_.size() > max_grids_) {
+            cache_.reset();
+            intarray().swap(grids_);
         }
     }
 
-    return array;
+    std::shared_ptr<const CachedGridList> cached_;
+    ScanFactory scan_;
+    std::unique_ptr<GridCursor> cursor_;
+    std::shared_ptr<GridListCache> cache_;
+    std::string key_;
+    size_t max_grids_;
+    // the grids passed on so far, cached or not
+    size_t pos_;
+    intarray grids_;
+    bool complete_;
+};
+
+// a rough allowance for what the GridListCache spends keeping track of
+// each list
+constexpr size_t GRID_LIST_ENTRY_OVERHEAD = 128;
+// RocksDB splits an LRU cache into shards that each get an equal part of
+// its capacity, and a list has to fit in one; lists are far larger than
+// blocks, so the cache gets fewer shards than a block cache would
+constexpr int GRID_LIST_CACHE_SHARD_BITS = 2;
+
+void deleteGridList(const rocksdb::Slice& /* key */, void* value) {
+    delete static_cast<std::shared_ptr<const CachedGridList>*>(value);
 }
 
-// This is an alternative version of getmatching specifically intended for the
-// address/partial-number case that parses grid data eagerly rather than lazily
-// and does bbox filtering before sorting. At present we only use it from
-// coalesceSingle, and it's only defined for the RocksDBCache; this filtering is
-// not necessary for correctness, just for performance, so the MemoryCache
-// doesn't need it in order to produce the correct results (and it's slow anyway)
-intarray RocksDBCache::__getmatchingBboxFiltered(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, const uint64_t box[4]) {
+// the raw bytes of keys and values written to each table when a
+// RocksDBCache is copied by pack
+constexpr size_t PACK_COPY_FILE_BYTES = 256 << 20;
+
+// RocksDB sets this many of a database's max_open_files aside for files
+// other than tables, and won't go below twice as many in total
+constexpr int NON_TABLE_OPEN_FILES = 10;
+
+// the resources set up by RocksDBCache::configure
+struct SharedResources {
+    std::mutex mutex;
+    std::shared_ptr<rocksdb::Cache> block_cache;
+    int max_open_files = -1;
+    // table files promised to caches that are still open
+    int open_files_reserved = 0;
+};
+
+SharedResources& sharedResources() {
+    static SharedResources resources;
+    return resources;
+}
+
+void releaseOpenFiles(int count) {
+    SharedResources& shared = sharedResources();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    shared.open_files_reserved -= count;
+}
+
+int countTableFiles(std::string const& filename) {
+    std::vector<std::string> children;
+    if (!rocksdb::Env::Default()->GetChildren(filename, &children).ok()) return 0;
+    return static_cast<int>(std::count_if(children.begin(), children.end(), [](std::string const& child) {
+        return child.size() > 4 && child.compare(child.size() - 4, 4, ".sst") == 0;
+    }));
+}
+
+} // namespace
+
+GridListCache::GridListCache(size_t capacity)
+    : lists_(rocksdb::NewLRUCache(capacity, GRID_LIST_CACHE_SHARD_BITS)),
+      hits_(0),
+      misses_(0) {}
+
+// the fixed-size parts go first, so that no phrase can run into them
+std::string GridListCache::key(const std::string& phrase, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+    auto max = static_cast<uint64_t>(max_results);
+    std::string key;
+    key.reserve(1 + sizeof(langfield) + sizeof(max) + phrase.size());
+    key.push_back(static_cast<char>(match_prefixes));
+    key.append(reinterpret_cast<const char*>(&langfield), sizeof(langfield));
+    key.append(reinterpret_cast<const char*>(&max), sizeof(max));
+    key.append(phrase);
+    return key;
+}
+
+std::shared_ptr<const CachedGridList> GridListCache::get(const std::string& key, bool partial) {
+    rocksdb::Cache::Handle* handle = lists_->Lookup(key);
+    std::shared_ptr<const CachedGridList> list;
+    if (handle != nullptr) {
+        list = *static_cast<std::shared_ptr<const CachedGridList>*>(lists_->Value(handle));
+        lists_->Release(handle);
+    }
+    if (!list || (!partial && !list->complete)) {
+        misses_++;
+        return nullptr;
+    }
+    hits_++;
+    return list;
+}
+
+size_t GridListCache::maxGrids(const std::string& key) const {
+    size_t shard_capacity = capacity() >> GRID_LIST_CACHE_SHARD_BITS;
+    size_t fixed = key.size() + GRID_LIST_ENTRY_OVERHEAD;
+    return shard_capacity > fixed ? (shard_capacity - fixed) / sizeof(value_type) : 0;
+}
+
+void GridListCache::put(const std::string& key, std::shared_ptr<const CachedGridList> list) {
+    if (list->grids.size() > maxGrids(key)) return;
+    size_t charge = key.size() + list->grids.size() * sizeof(value_type) + GRID_LIST_ENTRY_OVERHEAD;
+    lists_->Insert(key, new std::shared_ptr<const CachedGridList>(std::move(list)), charge, &deleteGridList);
+}
+
+void RocksDBCache::configure(size_t block_cache_size, int max_open_files) {
+    SharedResources& shared = sharedResources();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    if (block_cache_size > 0) {
+        shared.block_cache = rocksdb::NewLRUCache(block_cache_size);
+    } else {
+        shared.block_cache.reset();
+    }
+    shared.max_open_files = max_open_files;
+}
+
+RocksDBCacheUsage RocksDBCache::memoryUsage() {
+    RocksDBCacheUsage usage{0, 0, open_files_, static_cast<bool>(block_cache_), 0, 0, 0, static_cast<bool>(grid_lists_), 0, 0, 0, 0};
+    db->GetIntProperty("rocksdb.estimate-table-readers-mem", &usage.table_readers);
+    db->GetIntProperty("rocksdb.cur-size-all-mem-tables", &usage.memtables);
+    if (block_cache_) {
+        usage.block_cache_capacity = block_cache_->GetCapacity();
+        usage.block_cache_usage = block_cache_->GetUsage();
+        usage.block_cache_pinned = block_cache_->GetPinnedUsage();
+    }
+    if (grid_lists_) {
+        usage.grid_list_capacity = grid_lists_->capacity();
+        usage.grid_list_usage = grid_lists_->usage();
+        usage.grid_list_hits = grid_lists_->hits();
+        usage.grid_list_misses = grid_lists_->misses();
+    }
+    return usage;
+}
+
+intarray RocksDBCache::__get(const std::string& phrase, langfield_type langfield) {
     intarray array;
-    std::string phrase = phrase_ref;
+    std::string phrase_with_langfield = phrase;
 
-    if (match_prefixes == PrefixMatch::disabled) {
-        phrase.push_back(LANGFIELD_SEPARATOR);
+    add_langfield(phrase_with_langfield, langfield);
+    // decode straight out of the block cache rather than a copy of the value
+    rocksdb::PinnableSlice message;
+    rocksdb::Status s = db->Get(rocksdb::ReadOptions(), db->DefaultColumnFamily(), phrase_with_langfield, &message);
+    if (s.ok()) {
+        decodeGrids(format_, message, array, std::numeric_limits<size_t>::max(), false);
     }
 
-    size_t phrase_length = phrase.length();
-    if (match_prefixes == PrefixMatch::word_boundary) {
-        // If we're looking for a word boundary we need have one more character
-        // available than the phrase is long. Incrementing this lengh ensures we
-        // don't use a prefix cache that could cut off the word break.
-        phrase_length++;
+    return array;
+}
+
+intarray RocksDBCache::__getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+    std::string cache_key;
+    if (grid_lists_) {
+        cache_key = GridListCache::key(phrase_ref, match_prefixes, langfield, max_results);
+        std::shared_ptr<const CachedGridList> cached = grid_lists_->get(cache_key, false);
+        if (cached) return cached->grids;
+    }
+
+    // the values stay valid for as long as the pinning iterators are alive
+    std::vector<std::tuple<rocksdb::Slice, bool>> messages;
+    ScanIterators iterators(*db);
+    collectScan(iterators, memos_, format_, phrase_ref, match_prefixes, langfield, max_results, messages);
+    intarray array = mergeMessages(messages, format_, max_results);
+    // lists the cache can't keep aren't copied for it
+    if (grid_lists_ && array.size() <= grid_lists_->maxGrids(cache_key)) {
+        grid_lists_->put(cache_key, std::make_shared<const CachedGridList>(CachedGridList{array, true}));
     }
+    return array;
+}
 
-    if (match_prefixes != PrefixMatch::disabled) {
-        // if this is an autocomplete scan, use the prefix cache
-        if (phrase_length <= MEMO_PREFIX_LENGTH_T1) {
-            phrase = "=1" + phrase.substr(0, MEMO_PREFIX_LENGTH_T1);
-        } else if (phrase_length <= MEMO_PREFIX_LENGTH_T2) {
-            phrase = "=2" + phrase.substr(0, MEMO_PREFIX_LENGTH_T2);
+std::unique_ptr<GridCursor> RocksDBCache::__getmatchingCursor(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+    std::string cache_key;
+    std::shared_ptr<const CachedGridList> cached;
+    if (grid_lists_) {
+        cache_key = GridListCache::key(phrase_ref, match_prefixes, langfield, max_results);
+        cached = grid_lists_->get(cache_key, true);
+        if (cached && cached->complete) return std::unique_ptr<GridCursor>(new CachedCursor(std::move(cached)));
+    }
+
+    ScanFactory scan = [database = db, memos = memos_, format = format_, phrase = phrase_ref, match_prefixes, langfield, max_results]() {
+        if (format == GridFormat::blocks) {
+            return scanCursor<BlockSource>(*database, memos, format, phrase, match_prefixes, langfield, max_results);
         }
+        return scanCursor<VarintSource>(*database, memos, format, phrase, match_prefixes, langfield, max_results);
+    };
+    if (!grid_lists_) return scan();
+    return std::unique_ptr<GridCursor>(new CachingCursor(std::move(cached), std::move(scan), grid_lists_, std::move(cache_key)));
+}
+
+// Looks up many keys with a single MultiGet, which sorts them and reads
+// each block they fall in only once
+std::vector<intarray> RocksDBCache::__getBatch(std::vector<BatchQuery> const& queries) {
+    std::vector<std::string> keys;
+    keys.reserve(queries.size());
+    for (BatchQuery const& query : queries) {
+        keys.emplace_back(query.phrase);
+        add_langfield(keys.back(), query.langfield);
     }
+    std::vector<rocksdb::Slice> key_slices(keys.begin(), keys.end());
 
-    std::unique_ptr<rocksdb::Iterator> rit(db->NewIterator(rocksdb::ReadOptions()));
-    for (rit->Seek(phrase); rit->Valid() && rit->key().ToString().compare(0, phrase.size(), phrase) == 0; rit->Next()) {
-        std::string key = rit->key().ToString();
+    std::vector<std::string> messages;
+    std::vector<rocksdb::Status> statuses = db->MultiGet(rocksdb::ReadOptions(), key_slices, &messages);
 
-        if (match_prefixes == PrefixMatch::word_boundary) {
-            // Read one character beyond the input prefix length, should always
-            // be safe because of the LANGFIELD_SEPARATOR
-            char endChar = key.at(phrase.length());
-            if (endChar != LANGFIELD_SEPARATOR && endChar != ' ') {
+    std::vector<intarray> results(queries.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+        if (statuses[i].ok()) {
+            decodeGrids(format_, messages[i], results[i], std::numeric_limits<size_t>::max(), false);
+        }
+    }
+    return results;
+}
+
+// Runs the scans in the order of the keys they seek to, so that a single
+// iterator per read mode moves forward through the database, reusing the
+// blocks it has already loaded whenever neighbouring scans share them
+std::vector<intarray> RocksDBCache::__getmatchingBatch(std::vector<BatchQuery> const& queries, size_t max_results) {
+    std::vector<std::string> targets;
+    targets.reserve(queries.size());
+    for (BatchQuery const& query : queries) {
+        targets.emplace_back(scanTarget(query.phrase, query.match_prefixes));
+    }
+    std::vector<size_t> order(queries.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&targets](size_t a, size_t b) {
+        return targets[a] < targets[b];
+    });
+
+    ScanIterators iterators(*db);
+    std::vector<intarray> results(queries.size());
+    std::vector<std::tuple<rocksdb::Slice, bool>> messages;
+    std::string cache_key;
+    for (size_t i : order) {
+        BatchQuery const& query = queries[i];
+        if (grid_lists_) {
+            cache_key = GridListCache::key(query.phrase, query.match_prefixes, query.langfield, max_results);
+            std::shared_ptr<const CachedGridList> cached = grid_lists_->get(cache_key, false);
+            if (cached) {
+                results[i] = cached->grids;
                 continue;
             }
         }
+        messages.clear();
+        collectScan(iterators, memos_, format_, query.phrase, query.match_prefixes, query.langfield, max_results, messages);
+        results[i] = mergeMessages(messages, format_, max_results);
+        if (grid_lists_ && results[i].size() <= grid_lists_->maxGrids(cache_key)) {
+            grid_lists_->put(cache_key, std::make_shared<const CachedGridList>(CachedGridList{results[i], true}));
+        }
+    }
+    return results;
+}
 
-        // grab the langfield from the end of the key
-        langfield_type message_langfield = extract_langfield(key);
-        auto matches_language = static_cast<bool>(message_langfield & langfield);
-
-        uint64_t boost = matches_language ? LANGUAGE_MATCH_BOOST : 0;
-        decodeAndBboxFilter(rit->value().ToString(), array, boost, box);
+// This is an alternative version of getmatching specifically intended for the
+// address/partial-number case that parses grid data eagerly rather than lazily
+// and does bbox filtering before sorting. At present we only use it from
+// coalesceSingle, and it's only defined for the RocksDBCache; this filtering is
+// not necessary for correctness, just for performance, so the MemoryCache
+// doesn't need it in order to produce the correct results (and it's slow anyway)
+intarray RocksDBCache::__getmatchingBboxFiltered(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, const uint64_t box[4]) {
+    intarray array;
+    std::vector<std::tuple<rocksdb::Slice, bool>> messages;
+    std::vector<std::string> keys;
+    ScanIterators iterators(*db);
+    // any of the grids can be filtered out, so a capped memo won't do
+    collectScan(iterators, memos_, format_, phrase_ref, match_prefixes, langfield, std::numeric_limits<size_t>::max(), messages, &keys);
+    for (size_t i = 0; i < messages.size(); i++) {
+        rocksdb::Slice message = std::get<0>(messages[i]);
+        uint64_t boost = std::get<1>(messages[i]) ? LANGUAGE_MATCH_BOOST : 0;
+
+        // a list with a spatial copy only has the cells in the box read
+        int shift = format_ == GridFormat::varint ? PackedGrids(message).cell_shift : -1;
+        if (shift < 0) {
+            decodeAndBboxFilter(format_, message, array, boost, box);
+            continue;
+        }
+        forEachCell(iterators.get(PrefixMatch::disabled), keys[i], static_cast<unsigned>(shift), box, [&](rocksdb::Slice const& cell) {
+            decodeAndBboxFilter(format_, cell, array, boost, box);
+        });
     }
 
     std::sort(array.begin(), array.end(), std::greater<uint64_t>());
@@ -179,7 +634,16 @@ RocksDBCache::RocksDBCache() = default;
 
 RocksDBCache::~RocksDBCache() = default;
 
-bool RocksDBCache::pack(const std::string& filename) {
+// Copies the cache by streaming its tables, in key order, into SST files
+// that are ingested whole, rather than writing every key through the
+// memtable and log. rocksdb::Checkpoint would hard-link the tables instead,
+// but it has to disable file deletions, which a read-only database can't do.
+// Rewriting the tables also means the copy is laid out with the current
+// table options, bloom filters included, and compressed as asked. The keys
+// and values themselves are copied byte for byte, so the copy keeps the
+// grid format, skip indexes and spatial copies of the original; of the pack
+// options, only compression applies.
+bool RocksDBCache::pack(const std::string& filename, PackOptions const& pack_options) {
     std::shared_ptr<rocksdb::DB> existing = this->db;
 
     if (existing && existing->GetName() == filename) {
@@ -187,30 +651,80 @@ bool RocksDBCache::pack(const std::string& filename) {
     }
 
     std::unique_ptr<rocksdb::DB> clone;
-    rocksdb::Options options;
+    rocksdb::Options options = cacheDBOptions();
     options.create_if_missing = true;
+    options.compression = pack_options.compression;
     rocksdb::Status status = OpenDB(options, filename, clone);
 
     if (!status.ok()) {
         throw std::invalid_argument("unable to open rocksdb file for packing");
     }
 
-    // if what we have now is already a rocksdb, and it's a different
-    // one from what we're being asked to pack into, copy from one to the other
-    std::unique_ptr<rocksdb::Iterator> existingIt(existing->NewIterator(rocksdb::ReadOptions()));
-    for (existingIt->SeekToFirst(); existingIt->Valid(); existingIt->Next()) {
-        clone->Put(rocksdb::WriteOptions(), existingIt->key(), existingIt->value());
+    rocksdb::ReadOptions read_options;
+    read_options.total_order_seek = true;
+    // everything is read exactly once, so keep it out of the block cache
+    read_options.fill_cache = false;
+    std::unique_ptr<rocksdb::Iterator> existingIt(existing->NewIterator(read_options));
+    PackProgress progress(pack_options.progress);
+
+    std::vector<std::string> files;
+    std::unique_ptr<SstFileSink> sink;
+    size_t sink_bytes = 0;
+    try {
+        for (existingIt->SeekToFirst(); existingIt->Valid(); existingIt->Next()) {
+            if (!sink) {
+                sink.reset(new SstFileSink(options, filename + "/pack-copy-" + std::to_string(files.size()) + ".sst"));
+            }
+            rocksdb::Slice key = existingIt->key();
+            rocksdb::Slice value = existingIt->value();
+            sink->add(key, value);
+
+            // the memoized prefixes are copied along with everything else
+            size_t bytes = key.size() + value.size();
+            if (key.starts_with("=")) {
+                progress.addPrefix(bytes);
+            } else {
+                progress.addKey(bytes);
+            }
+
+            sink_bytes += bytes;
+            if (sink_bytes >= PACK_COPY_FILE_BYTES) {
+                files.emplace_back(sink->finish());
+                sink.reset();
+                sink_bytes = 0;
+            }
+        }
+        if (!existingIt->status().ok()) {
+            throw std::runtime_error("unable to read rocksdb file for packing: " + existingIt->status().ToString());
+        }
+        if (sink) files.emplace_back(sink->finish());
+    } catch (...) {
+        // the file being written when it failed is next in line
+        sink.reset();
+        files.emplace_back(filename + "/pack-copy-" + std::to_string(files.size()) + ".sst");
+        removeSstFiles(files);
+        throw;
+    }
+
+    // the files follow each other in key order, so they go in together
+    status = ingestSstFiles(clone, files);
+    if (!status.ok()) {
+        throw std::runtime_error("unable to ingest packed rocksdb file: " + status.ToString());
     }
+    progress.finish();
 
     return true;
 }
 
 std::vector<std::pair<std::string, langfield_type>> RocksDBCache::list() {
-    std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(rocksdb::ReadOptions()));
+    rocksdb::ReadOptions read_options;
+    read_options.total_order_seek = true;
+    std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(read_options));
     std::vector<std::pair<std::string, langfield_type>> out;
     for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        // skip the memoized prefixes before copying anything
+        if (it->key().starts_with("=")) continue;
         std::string key_id = it->key().ToString();
-        if (key_id.at(0) == '=') continue;
 
         std::string phrase = key_id.substr(0, key_id.find(LANGFIELD_SEPARATOR));
         langfield_type langfield = extract_langfield(key_id);
@@ -220,16 +734,47 @@ std::vector<std::pair<std::string, langfield_type>> RocksDBCache::list() {
     return out;
 }
 
-RocksDBCache::RocksDBCache(const std::string& filename) {
+RocksDBCache::RocksDBCache(const std::string& filename, size_t grid_list_cache_size) {
     std::unique_ptr<rocksdb::DB> _db;
     rocksdb::Options options;
-    options.create_if_missing = true;
+
+    // take this cache's share of the process-wide resources
+    int reserved = 0;
+    {
+        SharedResources& shared = sharedResources();
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        // index and filter blocks go in the shared cache too, if there is
+        // one, so that it bounds nearly all of the memory the caches use
+        options = cacheDBOptions(shared.block_cache);
+        options.create_if_missing = true;
+        block_cache_ = shared.block_cache;
+        if (shared.max_open_files >= 0) {
+            // enough to keep every table open if the budget allows, and
+            // never less than RocksDB's minimum, which may overdraw it. The
+            // database is read-only, so it never has more tables than now.
+            int tables = countTableFiles(filename);
+            int allowed = std::max(std::min(tables, std::max(shared.max_open_files - shared.open_files_reserved, 0)), NON_TABLE_OPEN_FILES);
+            reserved = std::min(tables, allowed);
+            shared.open_files_reserved += reserved;
+            options.max_open_files = allowed + NON_TABLE_OPEN_FILES;
+            open_files_ = reserved;
+        }
+    }
+
     rocksdb::Status status = OpenForReadOnlyDB(options, filename, _db);
 
     if (!status.ok()) {
+        releaseOpenFiles(reserved);
         throw std::invalid_argument("unable to open rocksdb file for loading");
     }
-    this->db = std::move(_db);
+    // the reservation is returned once the last copy of the cache is gone
+    this->db = std::shared_ptr<rocksdb::DB>(_db.release(), [reserved](rocksdb::DB* db) {
+        delete db;
+        releaseOpenFiles(reserved);
+    });
+    memos_ = readMemoLayout(*this->db);
+    format_ = readGridFormat(*this->db);
+    if (grid_list_cache_size > 0) grid_lists_ = std::make_shared<GridListCache>(grid_list_cache_size);
 }
 
 } // namespace carmen
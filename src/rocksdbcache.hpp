@@ -3,72 +3,11 @@
 
 #include "cpp_util.hpp"
 
-// this is an external library, so squash this warning
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wsign-conversion"
-#include "radix_max_heap.h"
-#pragma clang diagnostic pop
+#include "rocksdb/cache.h"
+#include "rocksdb/table.h"
 
 namespace carmen {
 
-struct sortableGrid {
-    sortableGrid(protozero::const_varint_iterator<uint64_t> _it,
-                 protozero::const_varint_iterator<uint64_t> _end,
-                 value_type _unadjusted_lastval,
-                 bool _matches_language)
-        : it(_it),
-          end(_end),
-          unadjusted_lastval(_unadjusted_lastval),
-          matches_language(_matches_language) {
-    }
-    protozero::const_varint_iterator<uint64_t> it;
-    protozero::const_varint_iterator<uint64_t> end;
-    value_type unadjusted_lastval;
-    bool matches_language;
-    sortableGrid() = delete;
-    sortableGrid(sortableGrid const& c) = delete;
-    sortableGrid& operator=(sortableGrid const& c) = delete;
-    sortableGrid& operator=(sortableGrid&& c) = default;
-    sortableGrid(sortableGrid&& c) = default;
-};
-
-// this is a basic decoding operation that unpacks a whole protobuff message
-inline void decodeMessage(std::string const& message, intarray& array, size_t limit) {
-    protozero::pbf_reader item(message);
-    item.next(CACHE_ITEM);
-    auto vals = item.get_packed_uint64();
-    uint64_t lastval = 0;
-    // delta decode values.
-    for (auto it = vals.first; it != vals.second && array.size() < limit; ++it) {
-        if (lastval == 0) {
-            lastval = *it;
-            array.emplace_back(lastval);
-        } else {
-            lastval = lastval - *it;
-            array.emplace_back(lastval);
-        }
-    }
-}
-
-// this function is as above, but also modifies the output of the protobuf message
-// to set the language-match bit to true, effectively boosting its sort order
-inline void decodeAndBoostMessage(std::string const& message, intarray& array, size_t limit) {
-    protozero::pbf_reader item(message);
-    item.next(CACHE_ITEM);
-    auto vals = item.get_packed_uint64();
-    uint64_t lastval = 0;
-    // delta decode values.
-    for (auto it = vals.first; it != vals.second && array.size() < limit; ++it) {
-        if (lastval == 0) {
-            lastval = *it;
-            array.emplace_back(lastval | LANGUAGE_MATCH_BOOST);
-        } else {
-            lastval = lastval - *it;
-            array.emplace_back(lastval | LANGUAGE_MATCH_BOOST);
-        }
-    }
-}
-
 inline bool inplaceBboxCheck(uint64_t val, const uint64_t box[4]) {
     uint64_t inplaceX = val & X_MASK;
     uint64_t inplaceY = val & Y_MASK;
@@ -89,37 +28,122 @@ inline bool inplaceBboxCheck(uint64_t val, const uint64_t box[4]) {
 // as they occupy in encoded grids (20 bits left and 34 bits left, respectively)
 // so that we can efficiently compare them to the X and Y coordinates within each
 // grid without shifting, to keep this whole operation as fast as possible.
-inline void decodeAndBboxFilter(std::string const& message, intarray& array, uint64_t boost, const uint64_t box[4]) {
-    protozero::pbf_reader item(message);
-    item.next(CACHE_ITEM);
-    auto vals = item.get_packed_uint64();
-    // delta decode values.
-    auto it = vals.first;
-    if (vals.first != vals.second) {
-        uint64_t lastval = *it;
-        if (inplaceBboxCheck(lastval, box)) array.emplace_back(lastval | boost);
-        it++;
-        for (; it != vals.second; ++it) {
-            lastval = lastval - *it;
-            if (inplaceBboxCheck(lastval, box)) array.emplace_back(lastval | boost);
+inline void decodeAndBboxFilter(GridFormat format, rocksdb::Slice const& message, intarray& array, uint64_t boost, const uint64_t box[4]) {
+    if (format == GridFormat::blocks) {
+        GridBlockReader reader(message);
+        while (reader.next()) {
+            for (size_t i = 0; i < reader.size(); i++) {
+                if (inplaceBboxCheck(reader.data()[i], box)) array.emplace_back(reader.data()[i] | boost);
+            }
         }
+        return;
     }
+
+    // with a skip index, the blocks outside of the box aren't decoded at all
+    auto keep = [box](uint64_t grid) {
+        return inplaceBboxCheck(grid, box);
+    };
+    auto keep_block = [box](GridIndexBlock const& block) {
+        return block.max_x >= box[0] && block.min_x <= box[2] && block.max_y >= box[1] && block.min_y <= box[3];
+    };
+    decodePackedGrids(message, array, std::numeric_limits<size_t>::max(), boost, keep, keep_block);
 }
 
+// What one RocksDBCache costs. The block cache may be shared with every
+// other cache in the process, in which case its figures cover all of them.
+struct RocksDBCacheUsage {
+    uint64_t table_readers;
+    uint64_t memtables;
+    // table files reserved for this cache from the budget, or -1 if none is set
+    int open_files;
+    bool shared_block_cache;
+    size_t block_cache_capacity;
+    size_t block_cache_usage;
+    size_t block_cache_pinned;
+    // the cache's own cache of decoded grid lists, if it has one
+    bool grid_list_cache;
+    size_t grid_list_capacity;
+    size_t grid_list_usage;
+    uint64_t grid_list_hits;
+    uint64_t grid_list_misses;
+};
+
+// A list kept by the GridListCache. A cursor that was only read part of the
+// way leaves just the grids it passed on, with `complete` unset, and a
+// later cursor picks the scan up again where they end.
+struct CachedGridList {
+    intarray grids;
+    bool complete;
+};
+
+// An LRU cache of the grid lists that prefix scans decode, kept so that the
+// phrases most queries share aren't read and merged all over again every
+// time. Lists are keyed by everything the scan was asked for, and charged
+// for the memory they take up. It's safe to use from several threads.
+class GridListCache : noncopyable {
+  public:
+    explicit GridListCache(size_t capacity);
+
+    // the key the list of a scan is cached under
+    static std::string key(const std::string& phrase, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results);
+    // the cached list under `key`, or null if there isn't one; a partial
+    // list only counts as a hit if `partial` allows for it
+    std::shared_ptr<const CachedGridList> get(const std::string& key, bool partial);
+    // the most grids a list under `key` can have and still be kept; RocksDB
+    // frees anything larger than one shard of the cache as soon as it's added
+    size_t maxGrids(const std::string& key) const;
+    // lists with more than maxGrids grids are left out
+    void put(const std::string& key, std::shared_ptr<const CachedGridList> list);
+
+    size_t capacity() const { return lists_->GetCapacity(); }
+    size_t usage() const { return lists_->GetUsage(); }
+    uint64_t hits() const { return hits_.load(); }
+    uint64_t misses() const { return misses_.load(); }
+
+  private:
+    std::shared_ptr<rocksdb::Cache> lists_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+};
+
 class RocksDBCache {
   public:
-    RocksDBCache(const std::string& filename);
+    // `grid_list_cache_size` is the most memory, in bytes, that the cache
+    // keeps decoded grid lists in; 0 leaves them out
+    RocksDBCache(const std::string& filename, size_t grid_list_cache_size = 0);
     RocksDBCache();
     ~RocksDBCache();
 
-    bool pack(const std::string& filename);
+    // Sets up resources shared by every RocksDBCache opened from then on:
+    // one LRU block cache of `block_cache_size` bytes (0 leaves each database
+    // with RocksDB's own default cache), and a budget of `max_open_files`
+    // table files split between all open caches (-1 for no budget). Caches
+    // that are already open keep what they were opened with.
+    static void configure(size_t block_cache_size, int max_open_files);
+
+    RocksDBCacheUsage memoryUsage();
+
+    bool pack(const std::string& filename, PackOptions const& pack_options = PackOptions());
     std::vector<std::pair<std::string, langfield_type>> list();
 
     std::vector<uint64_t> __get(const std::string& phrase, langfield_type langfield);
     std::vector<uint64_t> __getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results);
+    // the same grids as __getmatching, read one at a time
+    std::unique_ptr<GridCursor> __getmatchingCursor(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results);
+    // answer many lookups at once, in the order they're given
+    std::vector<intarray> __getBatch(std::vector<BatchQuery> const& queries);
+    std::vector<intarray> __getmatchingBatch(std::vector<BatchQuery> const& queries, size_t max_results);
     std::vector<uint64_t> __getmatchingBboxFiltered(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, const uint64_t box[4]);
 
     std::shared_ptr<rocksdb::DB> db;
+
+  private:
+    std::shared_ptr<rocksdb::Cache> block_cache_;
+    int open_files_ = -1;
+    MemoLayout memos_{0, 0};
+    GridFormat format_ = GridFormat::varint;
+    // shared between copies of the cache, like the database
+    std::shared_ptr<GridListCache> grid_lists_;
 };
 
 } // namespace carmen
@@ -79,6 +79,122 @@ test('get / set / list / pack / load (simple)', (t) => {
     t.end();
 });
 
+test('set keeps lists sorted and deduplicated', (t) => {
+    const cache = new carmenCache.MemoryCache('a');
+    cache._set('5', [3,1,2,3,1]);
+    t.deepEqual(cache._get('5'), [3,2,1], 'duplicates are dropped on set');
+    cache._set('5', [5,2,0], null, true);
+    t.deepEqual(cache._get('5'), [5,3,2,1,0], 'appended data is merged in order without duplicates');
+    cache._set('5', [7,7]);
+    t.deepEqual(cache._get('5'), [7], 'replaced data is deduplicated too');
+
+    const pack = tmpfile();
+    cache.pack(pack);
+    const loader = new carmenCache.RocksDBCache('b', pack);
+    t.deepEqual(loader._get('5'), [7], 'packed data matches');
+    t.end();
+});
+
+// packs [high, low] 32-bit pairs into a buffer of little-endian 64-bit grids
+const gridBuffer = function(pairs) {
+    const buf = Buffer.alloc(pairs.length * 8);
+    pairs.forEach((pair, i) => {
+        buf.writeUInt32LE(pair[1], i * 8);
+        buf.writeUInt32LE(pair[0], i * 8 + 4);
+    });
+    return buf;
+};
+
+test('setBulk', (t) => {
+    const cache = new carmenCache.MemoryCache('a');
+
+    t.throws(() => { cache._setBulk(['a'], [1], [1]); }, /second arg must be a Buffer or typed array/, 'requires binary data');
+    t.throws(() => { cache._setBulk(['a'], gridBuffer([[0, 1]]), [2]); }, /lengths must add up/, 'lengths must cover data');
+    t.throws(() => { cache._setBulk(['a', 'b'], gridBuffer([[0, 1]]), [1]); }, /one length per id/, 'one length per id');
+    t.throws(() => { cache._setBulk(['a'], Buffer.alloc(3), [0]); }, /whole number of 64-bit grids/, 'data must be 64-bit aligned');
+    t.deepEqual(cache.list(), [], 'failed calls leave the cache untouched');
+
+    cache._setBulk(['a', 'b', 'c'], gridBuffer([[0, 1], [0, 3], [0, 2], [0, 5], [0, 4], [0, 6]]), [3, 2, 1], [null, [0], [1]]);
+    t.deepEqual(cache._get('a'), [3, 2, 1], 'first key set and sorted');
+    t.deepEqual(cache._get('b', [0]), [5, 4], 'second key set with its languages');
+    t.deepEqual(cache._get('c', [1]), [6], 'third key set with its languages');
+
+    cache._setBulk(['a'], gridBuffer([[0, 7], [0, 1]]), [2], null, true);
+    t.deepEqual(cache._get('a'), [7, 3, 2, 1], 'appended in bulk');
+
+    // 2^53 and 2^53 + 1 collapse into one value when passed as JS numbers
+    cache._setBulk(['big'], gridBuffer([[Math.pow(2, 21), 1], [Math.pow(2, 21), 0]]), [2]);
+    t.equal(cache._get('big').length, 2, 'values above 2^53 keep full precision');
+
+    const pack = tmpfile();
+    cache.pack(pack);
+    const loader = new carmenCache.RocksDBCache('b', pack);
+    t.deepEqual(loader._get('a'), [7, 3, 2, 1], 'packed data matches');
+    t.deepEqual(loader._get('b', [0]), [5, 4], 'packed data matches');
+    t.end();
+});
+
+// Packed lists are decoded a 64-bit word at a time, falling back to
+// protozero for varints longer than 8 bytes and for the last few bytes of a
+// list. Grids as large as 2^64 - 1 make deltas of 9 and 10 bytes, and lists
+// of every length up to 24 put them in both paths, so every grid has to come
+// back exactly as protozero wrote it.
+test('varint decoding of long and trailing grids', (t) => {
+    // a fixed xorshift sequence, so failures can be reproduced
+    let seed = 0x9e3779b9;
+    const random = function() {
+        seed ^= seed << 13;
+        seed ^= seed >>> 17;
+        seed ^= seed << 5;
+        return seed >>> 0;
+    };
+    // a random nonzero [high, low] pair of `bits` bits at most
+    const randomGrid = function(bits) {
+        const high = bits > 32 ? random() >>> (64 - bits) : 0;
+        const low = bits >= 32 ? random() : random() >>> (32 - bits);
+        return high || low ? [high, low] : [0, 1];
+    };
+    const hex = (pair) => ('0000000' + pair[0].toString(16)).slice(-8) + ('0000000' + pair[1].toString(16)).slice(-8);
+
+    const lists = [
+        [[0xffffffff, 0xffffffff]],
+        [[0xffffffff, 0xffffffff], [0, 1]],
+        [[0xffffffff, 0xffffffff], [0xffffffff, 0xfffffffe], [0x80000000, 0], [0x7fffffff, 0xffffffff], [0x01000000, 0], [0x00ffffff, 0xffffffff], [0, 1]],
+        [[0x01000000, 0], [0x00000001, 0], [0, 0x80]]
+    ];
+    for (let length = 1; length <= 24; length++) {
+        const list = [];
+        for (let i = 0; i < length; i++) list.push(randomGrid(1 + random() % 64));
+        lists.push(list);
+    }
+
+    const memory = new carmenCache.MemoryCache('a');
+    const compact = new carmenCache.MemoryCache('b', { compact: true });
+    const ids = lists.map((list, i) => 'list ' + i);
+    const data = gridBuffer([].concat.apply([], lists));
+    const lengths = lists.map((list) => list.length);
+    memory._setBulk(ids, data, lengths);
+    compact._setBulk(ids, data, lengths);
+    const pack = tmpfile();
+    memory.pack(pack);
+    const loader = new carmenCache.RocksDBCache('c', pack);
+
+    // lists come back sorted in descending order with duplicates removed
+    const expected = lists.map((list) => list.map(hex).sort().reverse().filter((grid, i, grids) => grid !== grids[i - 1]));
+    const gets = ids.map((id) => [id]);
+    for (const cache of [memory, compact, loader]) {
+        const result = cache._getBatch(gets);
+        let offset = 0;
+        const grids = result.lengths.map((length) => {
+            const list = [];
+            for (let i = 0; i < length; i++, offset += 8) list.push(hex([result.grids.readUInt32LE(offset + 4), result.grids.readUInt32LE(offset)]));
+            return list;
+        });
+        t.deepEqual(grids, expected, cache.id + ' reads back every grid exactly');
+    }
+    t.end();
+});
+
 test('get / set / list / pack / load (with lang codes)', (t) => {
     const cache = new carmenCache.MemoryCache('a');
 
@@ -169,3 +285,551 @@ test('pack', (t) => {
 
     t.end();
 });
+
+test('pack (parallel)', (t) => {
+    const cache = new carmenCache.MemoryCache('a');
+    const ids = [];
+    for (let i = 0; i < 200; i++) {
+        const id = 'key' + i;
+        ids.push(id);
+        cache._set(id, [i, i + 1, i + 2]);
+        cache._set(id, [i + 3], [i % 3]);
+    }
+
+    t.throws(() => { cache.pack(tmpfile(), 1); }, /options, if supplied, must be an object/, 'options must be an object');
+    t.throws(() => { cache.pack(tmpfile(), { threads: 0 }); }, /threads must be a positive integer/, 'threads must be positive');
+    t.throws(() => { cache.pack(tmpfile(), { threads: 65 }); }, /threads must be no more than 64/, 'threads are limited');
+
+    const serial = tmpfile();
+    cache.pack(serial);
+    const parallel = tmpfile();
+    cache.pack(parallel, { threads: 4 });
+
+    const serialLoader = new carmenCache.RocksDBCache('b', serial);
+    const parallelLoader = new carmenCache.RocksDBCache('c', parallel);
+    t.deepEqual(sorted(parallelLoader.list().map(JSON.stringify)), sorted(serialLoader.list().map(JSON.stringify)), 'same keys');
+    for (const id of ids) {
+        t.deepEqual(parallelLoader._get(id), serialLoader._get(id), id + ' matches');
+    }
+    for (const prefix of ['k', 'key', 'key1', 'key19', 'key199']) {
+        t.deepEqual(parallelLoader._getMatching(prefix, 1, [0]), serialLoader._getMatching(prefix, 1, [0]), prefix + ' prefix matches');
+    }
+    t.end();
+});
+
+test('compact MemoryCache', (t) => {
+    t.throws(() => { new carmenCache.MemoryCache('a', 1); }, /must be an Object/, 'options must be an object');
+    t.throws(() => { new carmenCache.MemoryCache('a', { compact: 1 }); }, /compact must be a Boolean/, 'compact must be a boolean');
+
+    const plain = new carmenCache.MemoryCache('a');
+    const compact = new carmenCache.MemoryCache('b', { compact: true });
+    const ids = [];
+    for (let i = 0; i < 100; i++) {
+        const id = 'main ' + i;
+        ids.push(id);
+        for (const cache of [plain, compact]) {
+            cache._set(id, [i * 10, i * 10 + 1, i * 10 + 2]);
+            cache._set(id, [i * 10 + 1, i * 10 + 3], null, true);
+            cache._set(id, [i * 10 + 5], [i % 3]);
+        }
+    }
+    plain._set('empty', []);
+    compact._set('empty', []);
+
+    t.deepEqual(sorted(compact.list().map(JSON.stringify)), sorted(plain.list().map(JSON.stringify)), 'same keys');
+    t.deepEqual(compact._get('empty'), [], 'empty list');
+    for (const id of ids) {
+        t.deepEqual(compact._get(id), plain._get(id), id + ' matches');
+        t.deepEqual(compact._get(id, [id.length % 3]), plain._get(id, [id.length % 3]), id + ' matches with languages');
+    }
+    for (const prefix of ['m', 'main', 'main 1', 'main 99']) {
+        for (const mode of [0, 1, 2]) {
+            t.deepEqual(compact._getMatching(prefix, mode, [0]), plain._getMatching(prefix, mode, [0]), prefix + ' matches in mode ' + mode);
+        }
+    }
+
+    const plainPack = tmpfile();
+    plain.pack(plainPack);
+    const compactPack = tmpfile();
+    compact.pack(compactPack);
+    const plainLoader = new carmenCache.RocksDBCache('c', plainPack);
+    const compactLoader = new carmenCache.RocksDBCache('d', compactPack);
+    for (const id of ids) {
+        t.deepEqual(compactLoader._get(id), plainLoader._get(id), id + ' packs the same');
+    }
+    t.deepEqual(compactLoader._getMatching('main', 1), plainLoader._getMatching('main', 1), 'memoized prefixes pack the same');
+    t.end();
+});
+
+test('memoryUsage', (t) => {
+    for (const options of [{}, { compact: true }]) {
+        const cache = new carmenCache.MemoryCache('a', options);
+        const empty = cache.memoryUsage();
+        t.equal(empty.used, 0, 'nothing used by an empty cache');
+
+        for (let i = 0; i < 1000; i++) {
+            cache._set('key' + i, [i, i + 1, i + 2]);
+        }
+        const full = cache.memoryUsage();
+        t.ok(full.used > 0, 'keys and lists are accounted for');
+        t.ok(full.allocated >= full.used, 'no more is used than is allocated');
+
+        // replacing every list frees memory back to the pool for reuse
+        for (let i = 0; i < 1000; i++) {
+            cache._set('key' + i, [i]);
+        }
+        const replaced = cache.memoryUsage();
+        t.ok(replaced.used <= full.used, 'replaced lists are reused or freed');
+        t.equal(replaced.allocated, full.allocated, 'no new memory is allocated');
+    }
+    t.end();
+});
+
+test('sharded MemoryCache', (t) => {
+    t.throws(() => { new carmenCache.MemoryCache('a', { shards: 0 }); }, /shards must be an integer/, 'shards must be positive');
+
+    const plain = new carmenCache.MemoryCache('a');
+    const sharded = new carmenCache.MemoryCache('b', { shards: 8 });
+
+    // split the writes into batches, and run the sharded ones concurrently
+    const batches = [];
+    for (let b = 0; b < 8; b++) {
+        const ids = [];
+        const pairs = [];
+        const lengths = [];
+        for (let i = 0; i < 200; i++) {
+            ids.push('street ' + ((b * 200 + i) % 500));
+            pairs.push([0, b * 1000 + i], [0, i]);
+            lengths.push(2);
+        }
+        batches.push({ ids, data: gridBuffer(pairs), lengths });
+    }
+    for (const batch of batches) {
+        plain._setBulk(batch.ids, batch.data, batch.lengths, null, true);
+    }
+
+    let pending = batches.length;
+    for (const batch of batches) {
+        sharded._setBulk(batch.ids, batch.data, batch.lengths, null, true, (err) => {
+            t.ifError(err, 'no error');
+            if (--pending > 0) return;
+
+            t.deepEqual(sharded.list().map(JSON.stringify), plain.list().map(JSON.stringify), 'same keys, in the same order');
+            for (let i = 0; i < 500; i++) {
+                t.deepEqual(sharded._get('street ' + i), plain._get('street ' + i), 'street ' + i + ' matches');
+            }
+            t.deepEqual(sharded._getMatching('street 1', 1), plain._getMatching('street 1', 1), 'prefix scan matches');
+
+            const plainPack = tmpfile();
+            plain.pack(plainPack);
+            const shardedPack = tmpfile();
+            sharded.pack(shardedPack);
+            const plainLoader = new carmenCache.RocksDBCache('c', plainPack);
+            const shardedLoader = new carmenCache.RocksDBCache('d', shardedPack);
+            t.deepEqual(shardedLoader.list().map(JSON.stringify), plainLoader.list().map(JSON.stringify), 'packs the same keys');
+            t.deepEqual(shardedLoader._getMatching('s', 1), plainLoader._getMatching('s', 1), 'packs the same prefixes');
+            t.end();
+        });
+    }
+});
+
+test('CacheBuilder', (t) => {
+    t.throws(() => { new carmenCache.CacheBuilder('a', tmpfile(), { memoryLimit: 0 }); }, /memoryLimit must be a positive integer/, 'memoryLimit must be positive');
+
+    const reference = new carmenCache.MemoryCache('a');
+    // a tiny memory limit forces the builder to spill and merge many runs
+    const builderPack = tmpfile();
+    const builder = new carmenCache.CacheBuilder('b', builderPack, { memoryLimit: 4096 });
+
+    for (let i = 0; i < 2000; i++) {
+        const id = 'street ' + (i * 7919 % 600);
+        const langs = i % 3 === 0 ? [i % 5] : null;
+        reference._set(id, [i, i * 3], langs, true);
+        builder._set(id, [i, i * 3], langs);
+    }
+    const ids = [];
+    const pairs = [];
+    const lengths = [];
+    for (let i = 0; i < 300; i++) {
+        ids.push('avenue ' + (i % 40));
+        pairs.push([0, i], [1, i]);
+        lengths.push(2);
+    }
+    reference._setBulk(ids, gridBuffer(pairs), lengths, null, true);
+    builder._setBulk(ids, gridBuffer(pairs), lengths);
+    t.ok(builder.finish(), 'finishes');
+    t.throws(() => { builder._set('street 1', [1]); }, /already been built/, 'cannot add once finished');
+
+    const referencePack = tmpfile();
+    reference.pack(referencePack);
+    const referenceLoader = new carmenCache.RocksDBCache('c', referencePack);
+    const builderLoader = new carmenCache.RocksDBCache('d', builderPack);
+
+    t.deepEqual(builderLoader.list().map(JSON.stringify), referenceLoader.list().map(JSON.stringify), 'builds the same keys');
+    for (let i = 0; i < 600; i++) {
+        t.deepEqual(builderLoader._get('street ' + i), referenceLoader._get('street ' + i), 'street ' + i + ' matches');
+    }
+    t.deepEqual(builderLoader._get('avenue 7'), referenceLoader._get('avenue 7'), 'bulk-set keys match');
+    t.deepEqual(builderLoader._getMatching('s', 1), referenceLoader._getMatching('s', 1), 'builds the same short prefixes');
+    t.deepEqual(builderLoader._getMatching('street 1', 1, [2]), referenceLoader._getMatching('street 1', 1, [2]), 'builds the same long prefixes');
+    t.equal(fs.readdirSync(builderPack).filter((f) => /\.run$/.test(f)).length, 0, 'cleans up its sorted runs');
+    t.end();
+});
+
+test('save / load', (t) => {
+    const source = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 500; i++) {
+        source._set('road ' + i, [i * 3, i * 3 + 1, Math.pow(2, 40) + i], i % 4 === 0 ? [i % 7] : null);
+    }
+    source._set('empty', []);
+    const snapshot = tmpfile();
+    t.ok(source.save(snapshot), 'saves');
+
+    const configs = [{}, { compact: true }, { shards: 4 }, { compact: true, shards: 3 }];
+    for (const options of configs) {
+        const loaded = new carmenCache.MemoryCache('b', options);
+        loaded._set('stale', [1]);
+        t.ok(loaded.load(snapshot), 'loads into ' + JSON.stringify(options));
+        t.deepEqual(loaded.list().map(JSON.stringify), source.list().map(JSON.stringify), 'same keys');
+        t.deepEqual(loaded._get('road 12', [5]), source._get('road 12', [5]), 'same lists');
+        t.deepEqual(loaded._getMatching('road 4', 1), source._getMatching('road 4', 1), 'same prefix scans');
+
+        // and saving the loaded cache again gives the same snapshot
+        const resaved = tmpfile();
+        loaded.save(resaved);
+        const reloaded = new carmenCache.MemoryCache('c');
+        reloaded.load(resaved);
+        t.deepEqual(reloaded._getMatching('road', 1), source._getMatching('road', 1), 'round-trips through ' + JSON.stringify(options));
+    }
+
+    const truncated = tmpfile();
+    const bytes = fs.readFileSync(snapshot);
+    fs.writeFileSync(truncated, bytes.slice(0, bytes.length - 8));
+    const target = new carmenCache.MemoryCache('d');
+    target._set('kept', [1]);
+    t.throws(() => { target.load(truncated); }, /truncated MemoryCache snapshot/, 'rejects a truncated snapshot');
+    t.deepEqual(target.list().map((x) => { return x[0]; }), ['kept'], 'a failed load leaves the cache alone');
+    t.throws(() => { target.load(tmpfile()); }, /unable to open/, 'rejects a missing file');
+    t.end();
+});
+
+test('RocksDBCache.configure / memoryUsage', (t) => {
+    t.throws(() => { carmenCache.RocksDBCache.configure({ maxOpenFiles: -2 }); }, /maxOpenFiles must be/, 'rejects a bad budget');
+
+    const source = new carmenCache.MemoryCache('a');
+    source._set('main street', [1, 2, 3]);
+    const pack = tmpfile();
+    source.pack(pack);
+
+    const unshared = new carmenCache.RocksDBCache('b', pack);
+    t.equal(unshared.memoryUsage().blockCache, null, 'no shared block cache by default');
+    t.equal(unshared.memoryUsage().openFiles, -1, 'no open files budget by default');
+
+    carmenCache.RocksDBCache.configure({ blockCacheSize: 8 * 1024 * 1024, maxOpenFiles: 100 });
+    const a = new carmenCache.RocksDBCache('c', pack);
+    const b = new carmenCache.RocksDBCache('d', pack);
+    t.deepEqual(a._get('main street'), [3, 2, 1], 'reads through the shared cache');
+    t.deepEqual(b._get('main street'), [3, 2, 1], 'reads through the shared cache');
+    const usage = a.memoryUsage();
+    t.equal(usage.blockCache.capacity, 8 * 1024 * 1024, 'reports the shared block cache');
+    t.ok(usage.blockCache.usage >= 0, 'reports block cache usage');
+    t.ok(usage.openFiles >= 0 && usage.openFiles <= 100, 'takes a share of the open files budget');
+    t.ok(usage.tableReaders >= 0 && usage.memtables >= 0, 'reports its own memory');
+    t.equal(b.memoryUsage().blockCache.capacity, usage.blockCache.capacity, 'caches share one block cache');
+
+    // back to the defaults for the rest of the tests
+    carmenCache.RocksDBCache.configure({});
+    t.equal(new carmenCache.RocksDBCache('e', pack).memoryUsage().blockCache, null, 'configure only affects caches opened later');
+    t.end();
+});
+
+test('RocksDBCache grid list cache', (t) => {
+    const source = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 20; i++) {
+        source._set('main street ' + i, [i * 3 + 1, i * 3 + 2, i * 3 + 3]);
+    }
+    const pack = tmpfile();
+    source.pack(pack);
+
+    t.throws(() => { new carmenCache.RocksDBCache('a', pack, 1); }, /third argument 'options', if supplied, must be an Object/, 'options must be an Object');
+    t.throws(() => { new carmenCache.RocksDBCache('a', pack, { gridListCacheSize: -1 }); }, /gridListCacheSize must be a non-negative integer/, 'rejects a negative size');
+    t.equal(new carmenCache.RocksDBCache('a', pack).memoryUsage().gridListCache, null, 'no grid list cache by default');
+
+    const plain = new carmenCache.RocksDBCache('b', pack);
+    const cached = new carmenCache.RocksDBCache('c', pack, { gridListCacheSize: 1024 * 1024 });
+    for (const prefix of ['m', 'main', 'main street 1', 'main street 19', 'nothing']) {
+        for (const mode of [0, 1, 2]) {
+            const expected = plain._getMatching(prefix, mode, [0]);
+            t.deepEqual(cached._getMatching(prefix, mode, [0]), expected, prefix + ' matches in mode ' + mode);
+            t.deepEqual(cached._getMatching(prefix, mode, [0]), expected, prefix + ' matches again in mode ' + mode);
+        }
+    }
+    const usage = cached.memoryUsage().gridListCache;
+    t.equal(usage.capacity, 1024 * 1024, 'reports its capacity');
+    t.equal(usage.misses, 15, 'misses the first time a scan comes up');
+    t.equal(usage.hits, 15, 'hits when it comes up again');
+    t.ok(usage.usage > 0 && usage.usage <= usage.capacity, 'reports its usage');
+    t.end();
+});
+
+test('exact matches with bloom filters', (t) => {
+    const source = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 200; i++) {
+        source._set('main street ' + i, [i], i % 2 ? [i % 5] : null);
+        source._set('main street ' + i, [i + 1000], [7]);
+    }
+    const pack = tmpfile();
+    source.pack(pack);
+    const loader = new carmenCache.RocksDBCache('b', pack);
+
+    // every table is written with a full bloom filter over the phrase prefixes;
+    // the table properties and meta blocks naming them are never compressed
+    const tables = fs.readdirSync(pack).filter((file) => /\.sst$/.test(file));
+    t.ok(tables.length > 0, 'packs into tables');
+    for (const file of tables) {
+        const table = fs.readFileSync(pack + '/' + file);
+        t.ok(table.includes('fullfilter.rocksdb.BuiltinBloomFilter'), file + ' has a full bloom filter');
+        t.ok(table.includes('carmen.PhrasePrefix'), file + ' records the phrase prefix extractor');
+    }
+
+    // _get and _getMatching return undefined rather than an empty Array when
+    // nothing matches, as they always have, filtered out or not
+    t.deepEqual(loader._getMatching('main street 9', 0), source._getMatching('main street 9', 0), 'finds every langfield of a phrase');
+    t.equal(source._getMatching('main street 999', 0), undefined, 'nothing for a missing phrase in memory');
+    t.equal(loader._getMatching('main street 999', 0), undefined, 'nothing for a missing phrase');
+    t.deepEqual(loader._getMatching('main street 1', 0), source._getMatching('main street 1', 0), 'no longer phrases for an exact match');
+    t.equal(loader._get('main street 999'), undefined, 'nothing for a missing key');
+    t.deepEqual(loader._getMatching('main street 1', 1), source._getMatching('main street 1', 1), 'prefix scans still see every key');
+
+    // a copy of a packed cache is written with the same filters
+    const copy = tmpfile();
+    loader.pack(copy);
+    const copyLoader = new carmenCache.RocksDBCache('c', copy);
+    t.deepEqual(copyLoader._getMatching('main street 9', 0), source._getMatching('main street 9', 0), 'reads the copy');
+    t.deepEqual(copyLoader.list().map(JSON.stringify), loader.list().map(JSON.stringify), 'copies every key');
+
+    // and can be recompressed on the way
+    t.throws(() => { loader.pack(tmpfile(), { compression: 'lzma' }); }, /compression must be one of/, 'compression must be known');
+    const uncompressed = tmpfile();
+    loader.pack(uncompressed, { compression: 'none' });
+    const uncompressedLoader = new carmenCache.RocksDBCache('d', uncompressed);
+    t.deepEqual(uncompressedLoader.list().map(JSON.stringify), loader.list().map(JSON.stringify), 'recompresses every key');
+    for (let i = 0; i < 200; i += 17) {
+        t.deepEqual(uncompressedLoader._get('main street ' + i, [7]), loader._get('main street ' + i, [7]), 'same grids for main street ' + i);
+    }
+    t.deepEqual(uncompressedLoader._getMatching('main street 1', 1), loader._getMatching('main street 1', 1), 'same memoized prefixes');
+    t.end();
+});
+
+// splits the result of a batched lookup back into one array of grids per
+// query; grids with the language match bit set lose precision as Numbers,
+// but identical grids still compare equal
+const batchToArrays = function(result) {
+    let offset = 0;
+    return result.lengths.map((length) => {
+        const grids = [];
+        for (let i = 0; i < length; i++, offset += 8) {
+            grids.push(result.grids.readUInt32LE(offset + 4) * Math.pow(2, 32) + result.grids.readUInt32LE(offset));
+        }
+        return grids;
+    });
+};
+
+test('getBatch / getMatchingBatch', (t) => {
+    const memory = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 100; i++) {
+        memory._set('main street ' + i, [i, i + 100], i % 3 ? [i % 4] : null);
+    }
+    const pack = tmpfile();
+    memory.pack(pack);
+    const rocks = new carmenCache.RocksDBCache('b', pack);
+
+    t.throws(() => { rocks._getBatch('main street'); }, /first arg must be an Array/, 'requires an Array of queries');
+    t.throws(() => { rocks._getMatchingBatch([['main', 3]]); }, /matchPrefixes must be an integer/, 'checks matchPrefixes');
+
+    const gets = [['main street 3'], ['main street 4', [0]], ['nowhere'], ['main street 10', null]];
+    for (const cache of [memory, rocks]) {
+        const result = cache._getBatch(gets);
+        t.equal(result.grids.length, 8 * result.lengths.reduce((a, b) => a + b, 0), 'one buffer holds every grid');
+        t.deepEqual(batchToArrays(result), gets.map((query) => cache._get(query[0], query[1]) || []), 'same as one _get at a time');
+    }
+
+    // partial-number style queries whose scans land next to each other
+    const scans = [['main street 1', 1], ['main', 1, [1]], ['main street 5', 0], ['main street 1', 2, [2]], ['nowhere', 1]];
+    const rockResults = batchToArrays(rocks._getMatchingBatch(scans));
+    t.deepEqual(batchToArrays(memory._getMatchingBatch(scans)), rockResults, 'MemoryCache and RocksDBCache agree');
+    const individual = scans.map((query) => (rocks._getMatching(query[0], query[1], query[2]) || []).map((grid) => grid.relev));
+    t.deepEqual(rockResults.map((grids) => grids.length), individual.map((grids) => grids.length), 'same as one _getMatching at a time');
+    t.end();
+});
+
+test('async get / getMatching / list', (t) => {
+    const memory = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 50; i++) {
+        memory._set('main street ' + i, [i, i + 100], i % 2 ? [1] : null);
+    }
+    const pack = tmpfile();
+    memory.pack(pack);
+    const rocks = new carmenCache.RocksDBCache('b', pack);
+
+    let pending = 0;
+    const done = () => { if (--pending === 0) t.end(); };
+    for (const cache of [memory, rocks]) {
+        pending += 5;
+        cache._get('main street 4', (err, grids) => {
+            t.ifError(err, 'no error');
+            t.deepEqual(grids, cache._get('main street 4'), 'async _get matches');
+            done();
+        });
+        cache._get('main street 5', [1], (err, grids) => {
+            t.ifError(err, 'no error');
+            t.deepEqual(grids, cache._get('main street 5', [1]), 'async _get with languages matches');
+            done();
+        });
+        cache._get('nowhere', (err, grids) => {
+            t.ifError(err, 'no error');
+            t.equal(grids, undefined, 'async _get of a missing phrase');
+            done();
+        });
+        cache._getMatching('main street 1', 1, [1], true, (err, grids) => {
+            t.ifError(err, 'no error');
+            t.deepEqual(grids, cache._getMatching('main street 1', 1, [1], true), 'async extended _getMatching matches');
+            done();
+        });
+        cache.list((err, keys) => {
+            t.ifError(err, 'no error');
+            t.deepEqual(keys, cache.list(), 'async list matches');
+            done();
+        });
+    }
+});
+
+test('async pack with progress', (t) => {
+    const memory = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 200; i++) {
+        memory._set('main street ' + i, [i, i + 1000], i % 2 ? [1] : null);
+    }
+    const pack = tmpfile();
+    memory.pack(pack);
+    const rocks = new carmenCache.RocksDBCache('b', pack);
+
+    t.throws(() => { memory.pack(tmpfile(), { progress: 1 }, () => {}); }, /progress must be a function/, 'progress must be a function');
+    t.throws(() => { memory.pack(tmpfile(), { progress: () => {} }); }, /progress can only be reported when packing with a callback/, 'progress needs a callback');
+
+    // both packs run at the same time, each on its own cache
+    let pending = 0;
+    const done = () => { if (--pending === 0) t.end(); };
+    for (const [cache, options] of [[memory, { threads: 2 }], [rocks, {}]]) {
+        pending++;
+        const copy = tmpfile();
+        let last;
+        options.progress = (stats) => { last = stats; };
+        cache.pack(copy, options, (err) => {
+            t.ifError(err, 'no error');
+            t.equal(last.keys, 200, 'progress counts every key');
+            t.ok(last.prefixes > 0, 'progress counts memoized prefixes');
+            t.ok(last.bytes > 0, 'progress counts bytes');
+            const loaded = new carmenCache.RocksDBCache('c', copy);
+            t.deepEqual(loaded.list().sort(), rocks.list().sort(), 'async pack writes the same keys');
+            t.deepEqual(loaded._getMatching('main street 1', 1), rocks._getMatching('main street 1', 1), 'async pack writes the same prefixes');
+            done();
+        });
+    }
+    t.equal(pending, 2, 'pack returns before it is done');
+});
+
+test('hot prefix memos', (t) => {
+    const memory = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 300; i++) {
+        memory._set('main street ' + i, [i, i + 1000], i % 3 ? [1] : null);
+        memory._set('main st ' + i, [i + 2000], [2]);
+        memory._set('mainland ' + i, [i + 3000]);
+    }
+    t.throws(() => { memory.pack(tmpfile(), { memoMinKeys: -1 }); }, /memoMinKeys must be a non-negative number/, 'memoMinKeys must be a number');
+
+    const hot = tmpfile();
+    memory.pack(hot, { memoMinKeys: 100, memoMinGrids: 0 });
+    const cold = tmpfile();
+    memory.pack(cold, { memoMinKeys: 0, memoMinGrids: 0 });
+    const hotLoader = new carmenCache.RocksDBCache('b', hot);
+    const coldLoader = new carmenCache.RocksDBCache('c', cold);
+
+    t.deepEqual(hotLoader.list().map(JSON.stringify), coldLoader.list().map(JSON.stringify), 'memos are not listed');
+    for (const phrase of ['main st', 'main str', 'main street', 'main street 1', 'main street 12', 'mainland', 'mainland 2', 'main stx']) {
+        for (const mode of [1, 2]) {
+            t.deepEqual(hotLoader._getMatching(phrase, mode), coldLoader._getMatching(phrase, mode), phrase + ' matches in mode ' + mode);
+            t.deepEqual(hotLoader._getMatching(phrase, mode, [2]), memory._getMatching(phrase, mode, [2]), phrase + ' matches the MemoryCache in mode ' + mode);
+        }
+    }
+    const scans = [['main street', 1], ['main st', 2], ['mainland', 1, [1]]];
+    t.deepEqual(batchToArrays(hotLoader._getMatchingBatch(scans)), batchToArrays(coldLoader._getMatchingBatch(scans)), 'batched scans match');
+
+    // copies keep the memos
+    const copy = tmpfile();
+    hotLoader.pack(copy);
+    t.deepEqual(new carmenCache.RocksDBCache('d', copy)._getMatching('main street', 1), hotLoader._getMatching('main street', 1), 'copied memos match');
+    t.end();
+});
+
+test('capped memos', (t) => {
+    const memory = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 200; i++) {
+        memory._set('main street ' + i, [i * 3, i * 3 + 1], i % 2 ? [1] : null);
+        memory._set('market ' + i, [i * 3 + 2]);
+    }
+    const capped = tmpfile();
+    memory.pack(capped, { memoMaxGrids: 10 });
+    const full = tmpfile();
+    memory.pack(full);
+    const cappedLoader = new carmenCache.RocksDBCache('b', capped);
+    const fullLoader = new carmenCache.RocksDBCache('c', full);
+
+    // normal scans read the capped memos, which keep the top grids
+    for (const phrase of ['m', 'ma', 'mai', 'main', 'main s', 'mar', 'main street 1']) {
+        for (const mode of [1, 2]) {
+            const cappedMatches = cappedLoader._getMatching(phrase, mode, [1]);
+            const fullMatches = fullLoader._getMatching(phrase, mode, [1]);
+            t.deepEqual(cappedMatches.slice(0, 10), fullMatches.slice(0, 10), phrase + ' has the same top matches in mode ' + mode);
+            t.ok(cappedMatches.length <= fullMatches.length, phrase + ' has no more matches in mode ' + mode);
+            t.deepEqual(cappedLoader._getMatching(phrase, mode, [1], true), fullLoader._getMatching(phrase, mode, [1], true), phrase + ' matches in an extended scan in mode ' + mode);
+        }
+    }
+    t.ok(cappedLoader._getMatching('m', 1).length < fullLoader._getMatching('m', 1).length, 'a normal scan stays on a capped memo');
+    t.deepEqual(batchToArrays(cappedLoader._getMatchingBatch([['ma', 1], ['main', 2]], true)), batchToArrays(fullLoader._getMatchingBatch([['ma', 1], ['main', 2]], true)), 'batched extended scans match');
+    t.end();
+});
+
+test('block grid format', (t) => {
+    const memory = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 300; i++) {
+        memory._set('main street ' + (i % 20), [i * 7, i * 7 + 1], i % 2 ? [1] : null, true);
+        memory._set('market ' + i, [i * 100000 + 3]);
+    }
+    t.throws(() => { memory.pack(tmpfile(), { format: 'zigzag' }); }, /format must be either 'varint' or 'blocks'/, 'checks the format');
+
+    const varint = tmpfile();
+    memory.pack(varint);
+    const varintLoader = new carmenCache.RocksDBCache('b', varint);
+    for (const threads of [1, 2]) {
+        const blocks = tmpfile();
+        memory.pack(blocks, { format: 'blocks', threads: threads, memoMinKeys: 20 });
+        const blocksLoader = new carmenCache.RocksDBCache('c', blocks);
+
+        t.deepEqual(blocksLoader._get('main street 3'), varintLoader._get('main street 3'), 'exact matches are the same with ' + threads + ' threads');
+        for (const phrase of ['m', 'ma', 'main', 'main street', 'main street 1', 'market 2']) {
+            for (const mode of [0, 1, 2]) {
+                t.deepEqual(blocksLoader._getMatching(phrase, mode, [1]), varintLoader._getMatching(phrase, mode, [1]), phrase + ' matches in mode ' + mode + ' with ' + threads + ' threads');
+                t.deepEqual(blocksLoader._getMatching(phrase, mode, [1], true), varintLoader._getMatching(phrase, mode, [1], true), phrase + ' matches in an extended scan in mode ' + mode + ' with ' + threads + ' threads');
+            }
+        }
+        const gets = [['main street 3'], ['main street 4', [1]], ['nowhere']];
+        t.deepEqual(batchToArrays(blocksLoader._getBatch(gets)), batchToArrays(varintLoader._getBatch(gets)), 'batched gets match with ' + threads + ' threads');
+        t.deepEqual(batchToArrays(blocksLoader._getMatchingBatch([['ma', 1], ['main', 2]])), batchToArrays(varintLoader._getMatchingBatch([['ma', 1], ['main', 2]])), 'batched scans match with ' + threads + ' threads');
+
+        // a copy keeps the format of the original
+        const copy = tmpfile();
+        blocksLoader.pack(copy);
+        t.deepEqual(new carmenCache.RocksDBCache('d', copy)._getMatching('ma', 1), varintLoader._getMatching('ma', 1), 'a copy reads the same with ' + threads + ' threads');
+    }
+    t.end();
+});
@@ -1468,3 +1468,139 @@ test('coalesce args', (t) => {
         });
     });
 })();
+
+// extended scans within a bbox read the same grids whether or not the
+// packed lists have skip indexes
+(() => {
+    const cache = new MemoryCache('a');
+    const grids = [];
+    for (let i = 1; i <= 1000; i++) {
+        grids.push(Grid.encode({ id: i, x: i % 50, y: Math.floor(i / 20), relev: 1, score: i % 8 }));
+    }
+    cache._set('1 main street', grids);
+
+    const plainPack = tmpfile();
+    cache.pack(plainPack);
+    const indexedPack = tmpfile();
+    cache.pack(indexedPack, { skipIndex: true });
+    const plain = new RocksDBCache('plain', plainPack);
+    const indexed = new RocksDBCache('indexed', indexedPack);
+
+    test('skipIndex', (t) => {
+        t.throws(() => { cache.pack(tmpfile(), { skipIndex: 1 }); }, /skipIndex must be a Boolean/, 'skipIndex must be a Boolean');
+        t.throws(() => { cache.pack(tmpfile(), { skipIndex: true, format: 'blocks' }); }, /skipIndex only applies to the 'varint' format/, 'only in the varint format');
+        t.deepEqual(indexed._get('1 main street'), plain._get('1 main street'), 'exact matches are the same');
+        t.end();
+    });
+
+    for (const bboxzxy of [[6, 0, 0, 20, 10], [6, 30, 40, 40, 50], [6, 60, 0, 63, 63]]) {
+        test('coalesceSingle bbox + extendedScan with skip indexes: ' + bboxzxy.join(','), (t) => {
+            const subq = (c) => [{ cache: c, mask: 1 << 0, idx: 0, zoom: 6, weight: 1, phrase: '1 main', prefix: scan.enabled, extendedScan: true }];
+            coalesce(subq(plain), { bboxzxy: bboxzxy }, (err, expected) => {
+                t.ifError(err, 'no errors');
+                coalesce(subq(indexed), { bboxzxy: bboxzxy }, (err, res) => {
+                    t.ifError(err, 'no errors');
+                    t.deepEqual(res, expected, 'same results');
+                    t.end();
+                });
+            });
+        });
+    }
+})();
+
+// extended scans within a bbox read the same grids whether or not the
+// packed lists have spatial copies
+(() => {
+    const cache = new MemoryCache('a');
+    const grids = [];
+    for (let i = 1; i <= 1000; i++) {
+        grids.push(Grid.encode({ id: i, x: (i * 7) % 64, y: Math.floor(i / 16), relev: 1, score: i % 8 }));
+    }
+    cache._set('1 main street', grids);
+    cache._set('1 main avenue', grids.slice(0, 10));
+
+    const plainPack = tmpfile();
+    cache.pack(plainPack);
+    const spatialPack = tmpfile();
+    cache.pack(spatialPack, { spatialMinGrids: 100 });
+    const plain = new RocksDBCache('plain', plainPack);
+    const spatial = new RocksDBCache('spatial', spatialPack);
+
+    test('spatialMinGrids', (t) => {
+        t.throws(() => { cache.pack(tmpfile(), { spatialMinGrids: -1 }); }, /spatialMinGrids must be a non-negative number/, 'spatialMinGrids must be a non-negative number');
+        t.throws(() => { cache.pack(tmpfile(), { spatialMinGrids: 100, format: 'blocks' }); }, /spatialMinGrids only applies to the 'varint' format/, 'only in the varint format');
+        t.deepEqual(spatial._get('1 main street'), plain._get('1 main street'), 'exact matches are the same');
+        t.deepEqual(spatial.list(), plain.list(), 'cells are not listed as keys');
+        t.end();
+    });
+
+    for (const bboxzxy of [[6, 0, 0, 20, 10], [6, 30, 40, 40, 50], [6, 60, 0, 63, 63], [6, 5, 5, 5, 5]]) {
+        test('coalesceSingle bbox + extendedScan with spatial copies: ' + bboxzxy.join(','), (t) => {
+            const subq = (c) => [{ cache: c, mask: 1 << 0, idx: 0, zoom: 6, weight: 1, phrase: '1 main', prefix: scan.enabled, extendedScan: true }];
+            coalesce(subq(plain), { bboxzxy: bboxzxy }, (err, expected) => {
+                t.ifError(err, 'no errors');
+                coalesce(subq(spatial), { bboxzxy: bboxzxy }, (err, res) => {
+                    t.ifError(err, 'no errors');
+                    t.deepEqual(res, expected, 'same results');
+                    t.end();
+                });
+            });
+        });
+    }
+})();
+
+// coalesceSingle reads grids from a cursor and stops early; a popular prefix
+// gives the same results from every kind of cache, and a MemoryCache can be
+// written to again once coalesce is done with it
+(() => {
+    const memory = new MemoryCache('a');
+    const compact = new MemoryCache('a', { compact: true });
+    for (let k = 0; k < 200; k++) {
+        const grids = [];
+        for (let i = 0; i < 50; i++) {
+            grids.push(Grid.encode({ id: k * 50 + i + 1, x: i, y: k % 64, relev: 1 - (k % 4) * 0.2, score: (k + i) % 8 }));
+        }
+        memory._set('main street ' + k, grids);
+        compact._set('main street ' + k, grids);
+    }
+    const rocks = toRocksCache(memory);
+
+    test('coalesceSingle with a cursor over many lists', (t) => {
+        const subq = (c) => [{ cache: c, mask: 1 << 0, idx: 0, zoom: 6, weight: 1, phrase: 'main', prefix: scan.enabled }];
+        coalesce(subq(memory), {}, (err, expected) => {
+            t.ifError(err, 'no errors');
+            t.equal(expected.length, 40, '40 results');
+            memory._set('main street 0', [Grid.encode({ id: 1, x: 0, y: 0, relev: 1, score: 7 })]);
+            t.pass('memory cache can be written to afterwards');
+            coalesce(subq(compact), {}, (err, res) => {
+                t.ifError(err, 'no errors');
+                t.deepEqual(res, expected, 'compact cache gives the same results');
+                coalesce(subq(rocks), {}, (err, res) => {
+                    t.ifError(err, 'no errors');
+                    t.deepEqual(res, expected, 'rocksdb cache gives the same results');
+                    t.end();
+                });
+            });
+        });
+    });
+
+    test('coalesceSingle caches the part of a list it reads', (t) => {
+        const pack = tmpfile();
+        memory.pack(pack);
+        const cached = new RocksDBCache('a.cached', pack, { gridListCacheSize: 1024 * 1024 });
+        const subq = [{ cache: cached, mask: 1 << 0, idx: 0, zoom: 6, weight: 1, phrase: 'main', prefix: scan.enabled }];
+        coalesce(subq, {}, (err, first) => {
+            t.ifError(err, 'no errors');
+            t.equal(first.length, 40, 'stops at 40 results');
+            const usage = cached.memoryUsage().gridListCache;
+            t.equal(usage.hits, 0, 'nothing is cached to begin with');
+            t.ok(usage.usage > 0 && usage.usage < 10000 * 8, 'only the grids it read are cached');
+            coalesce(subq, {}, (err, second) => {
+                t.ifError(err, 'no errors');
+                t.deepEqual(second, first, 'the cached list gives the same results');
+                t.ok(cached.memoryUsage().gridListCache.hits > usage.hits, 'reads the list from the cache the second time');
+                t.end();
+            });
+        });
+    });
+})();
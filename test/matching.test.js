@@ -292,3 +292,27 @@ test('getMatching', (t) => {
     // t.deepEqual(loader.list('grid'), [ 'else.', 'something', 'test', 'test.' ], 'keys in shard');
     t.end();
 });
+
+test('getMatching prefix ranges', (t) => {
+    const cache = new carmenCache.MemoryCache('mem');
+
+    const phrases = ['mai', 'main', 'main st', 'mains', 'maio', 'mbin', 'ma'];
+    phrases.forEach((phrase, i) => {
+        cache._set(phrase, [Grid.encode({ id: i + 1, x: 1, y: 1, relev: 1, score: 1 })], [0]);
+        cache._set(phrase, [Grid.encode({ id: i + 101, x: 1, y: 1, relev: 1, score: 1 })], [1]);
+    });
+
+    const pack = tmpfile();
+    cache.pack(pack);
+    const loader = new carmenCache.RocksDBCache('packed', pack);
+
+    [cache, loader].forEach((c) => {
+        t.deepEqual(getIds(c._getMatching('main', scan.disabled)), [2, 102], 'exact match only returns the phrase itself');
+        t.deepEqual(getIds(c._getMatching('main', scan.enabled)), [2, 3, 4, 102, 103, 104], 'prefix match returns every phrase starting with the prefix');
+        t.deepEqual(getIds(c._getMatching('main', scan.word_boundary)), [2, 3, 102, 103], 'word boundary match skips phrases continuing the last word');
+        t.deepEqual(getIds(c._getMatching('mai', scan.enabled)), [1, 2, 3, 4, 5, 101, 102, 103, 104, 105], 'short prefix match stays inside its range');
+        t.false(c._getMatching('maj', scan.enabled), 'prefix match between ranges returns nothing');
+    });
+
+    t.end();
+});